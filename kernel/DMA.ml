@@ -17,6 +17,12 @@ let page_port  = [| 0x87; 0x83; 0x81; 0x82; 0x8F; 0x8B; 0x89; 0x8A |]
 let addr_port  = [| 0x00; 0x02; 0x04; 0x06; 0xC0; 0xC4; 0xC8; 0xCC |]
 let count_port = [| 0x01; 0x03; 0x05; 0x07; 0xC2; 0xC6; 0xCA; 0xCE |]
 
+(* mode register bits *)
+let read      = 0x08 (* memory to device *)
+let write     = 0x04
+let auto_init = 0x10
+let single    = 0x40
+
 let allocate () =
 	get_dma_region ()
 
@@ -24,27 +30,36 @@ let start_transfer channel data mode =
 	let is_16_bit = channel >= 4 in
 	let channel4 = channel mod 4 in
 	let mode = mode lor channel4 in
+	let bytes = Array1.dim data in
+	(* the controller only reaches the first 16MiB, and its address counter
+	   can't carry into the page register: 8-bit channels stay within a
+	   64KiB page, 16-bit ones within a 128KiB page and on a word *)
+	let page_size = if is_16_bit then 0x20000 else 0x10000 in
+	if Int32.compare (Asm.address data) 0x1000000l >= 0 then
+		invalid_arg "DMA.start_transfer: buffer above 16MiB";
+	let address = Int32.to_int (Asm.address data) in
+	if bytes = 0 || address + bytes > 0x1000000
+	|| address / page_size <> (address + bytes - 1) / page_size
+	|| (is_16_bit && (address lor bytes) land 1 <> 0) then
+		invalid_arg "DMA.start_transfer: buffer crosses a DMA page";
+	(* 16-bit channels count words, and take a word offset into the page *)
+	let offset, length =
+		if is_16_bit then (address land 0x1FFFF) lsr 1, bytes / 2 - 1
+		else address land 0xFFFF, bytes - 1
+	in
 	Asm.out8 mask_reg.(channel) (0x04 lor channel4);
 	Asm.out8 clear_reg.(channel) 0x00;
 	Asm.out8 mode_reg.(channel) mode;
-	(* get data *)
-	let address = Asm.address data in
-	let length =
-		if is_16_bit then Array1.dim data / 2 - 1
-		else Array1.dim data - 1
-	in
-	(* prepare transfer *)
-	Asm.out8 addr_port.(channel) 0;
-	Asm.out8 addr_port.(channel) 0;
-	(* load data *)
+	Asm.out8 addr_port.(channel) (lo_byte offset);
+	Asm.out8 addr_port.(channel) (hi_byte offset);
 	Asm.out8 count_port.(channel) (lo_byte length);
 	Asm.out8 count_port.(channel) (hi_byte length);
-	Asm.out8 page_port.(channel) (Int32.to_int (Int32.div address 0x1_0000l));
+	(* bit 0 is ignored for the 16-bit channels *)
+	Asm.out8 page_port.(channel) (lo_byte (address lsr 16));
 	(* unmask channel *)
 	Asm.out8 mask_reg.(channel) channel4
 
 let stop_transfer channel =
 	let channel4 = channel mod 4 in
 	Asm.out8 mask_reg.(channel) (0x04 lor channel4);
-	Asm.out8 clear_reg.(channel) 0x00;
-	Asm.out8 mask_reg.(channel) channel4
+	Asm.out8 clear_reg.(channel) 0x00
@@ -3,8 +3,18 @@
 
 open Bigarray
 
+(* mode bits for [start_transfer], ored with a transfer mode *)
+val read : int
+val write : int
+val auto_init : int
+val single : int
+
+(* A fixed 64KiB buffer at 1MiB, usable by every channel *)
 val allocate : unit -> (int, int8_unsigned_elt, c_layout) Array1.t
 
+(* [start_transfer channel data mode] programs and unmasks [channel] for
+   the whole of [data]; Invalid_argument if the controller can't reach it *)
 val start_transfer : int -> (int, int8_unsigned_elt, c_layout) Array1.t -> int -> unit
 
+(* Mask the channel *)
 val stop_transfer : int -> unit
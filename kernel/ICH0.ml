@@ -144,9 +144,10 @@ let create device =
     C.nambar.write16 R.sample_rate 44100;
 	
 	(* register an interrupt handler *)
-	Interrupts.create device.request_line C.isr;
+	let line = Interrupts.pci_line device in
+	Interrupts.create line C.isr;
 	C.set_bit C.nabmbar R.control 4; (* interrupts for buffer completion *)
-	Vt100.printf "ich0: on request line %02X\n" device.request_line;
+	Vt100.printf "ich0: on request line %02X\n" line;
 	
 	(* start output *)
 	C.nabmbar.write8 R.control (C.nabmbar.read8 R.control lor 1);
@@ -157,6 +158,7 @@ let create device =
 	AudioMixer.register_device {
 		format = 16, sample_rate, 2;
 		output = C.output;
+		render = None;
 	}
 
 let init () =
@@ -1,6 +1,8 @@
 
 (* start out small; only support primary master *)
 
+open Bigarray
+
 exception Timeout
 
 type t = int
@@ -23,7 +25,20 @@ end
 module C = struct
 	let diagnostic = 0x90
 	let read_sectors = 0x20
+	let read_sectors_ext = 0x24
+	let read_dma_ext = 0x25
+	let read_multiple_ext = 0x29
 	let write_sectors = 0x30
+	let write_sectors_ext = 0x34
+	let write_dma_ext = 0x35
+	let write_multiple_ext = 0x39
+	let read_multiple = 0xC4
+	let write_multiple = 0xC5
+	let set_multiple = 0xC6
+	let read_dma = 0xC8
+	let write_dma = 0xCA
+	let flush_cache = 0xE7
+	let flush_cache_ext = 0xEA
 	let identify = 0xEC
 end
 
@@ -39,6 +54,7 @@ module S = struct
 end
 
 let pri = 0x1F0
+let pri_control = 0x3F6 (* device control; bit 2 resets the channel *)
 
 let rec poll ofs f lim =
 	if not (f (Asm.in8 (pri+ofs))) && lim < 100_000 then begin
@@ -74,24 +90,473 @@ let swab s =
 	done;
 	s
 
-(* disk is disk_to_id, 0, 1, 2, 3 *)
-let read_disk disk sector length = (* disk = 0x00/0x10 master/slave *)
-	(*poll R.status (fun i -> i land S.bsy = 0);*)
-	write R.seccount length;
+let select disk sector length command =
+	write R.seccount (length land 0xFF);
+	write R.lba_low (sector land 0xFF);
+	write R.lba_mid ((sector lsr 8) land 0xFF);
+	write R.lba_high ((sector lsr 16) land 0xFF);
+	write R.dev_head (0xE0 lor ((disk land 1) lsl 4) lor ((sector lsr 24) land 0x0F));
+	write R.command command
+
+(* LBA48: the high bytes go in first, then the low ones over the top *)
+let select48 disk sector length command =
+	write R.dev_head (0x40 lor ((disk land 1) lsl 4));
+	write R.seccount ((length lsr 8) land 0xFF);
+	write R.lba_low ((sector lsr 24) land 0xFF);
+	write R.lba_mid ((sector lsr 24) lsr 8 land 0xFF);
+	write R.lba_high 0;
+	write R.seccount (length land 0xFF);
 	write R.lba_low (sector land 0xFF);
 	write R.lba_mid ((sector lsr 8) land 0xFF);
 	write R.lba_high ((sector lsr 16) land 0xFF);
-	write R.dev_head (0xE0 lor disk lor ((sector lsr 24) land 0x0F));
-	write R.command C.read_sectors;
-	poll R.status (fun i -> i land S.bsy = 0 && i land S.drdy <> 0);
-	let data = String.create (512 * length) in
-	for i = 0 to length - 1 do
-		String.blit
-			(Asm.in16s (pri+R.data) 256) 0
-			data (i * 512)
-			512;
+	write R.command command
+
+(* What IDENTIFY DEVICE says about a drive *)
+
+type info = {
+	model : string;
+	sectors : int;
+	lba48 : bool;
+	multiple : int; (* sectors per DRQ block once SET MULTIPLE is done, 1 without *)
+	dma : bool;
+	flush_ext : bool;
+}
+
+let infos = Array.make 4 {
+	model = ""; sectors = 0x0FFFFFFF; lba48 = false;
+	multiple = 1; dma = true; flush_ext = false;
+}
+
+let identify disk =
+	write R.dev_head (0xA0 lor ((disk land 1) lsl 4));
+	write R.command C.identify;
+	poll R.status (fun i -> i land S.bsy = 0 && i land (S.drq lor S.err) <> 0);
+	if Asm.in8 (pri + R.status) land S.err <> 0 then raise Not_found;
+	let id = Asm.in16s (pri + R.data) 256 in
+	let word n = Char.code id.[2 * n] lor (Char.code id.[2 * n + 1] lsl 8) in
+	let lba48 = word 83 land (1 lsl 10) <> 0 in
+	let sectors =
+		if not lba48 then word 60 lor (word 61 lsl 16)
+		else if word 102 <> 0 || word 103 <> 0 || word 101 >= 0x4000 then max_int
+		else word 100 lor (word 101 lsl 16) in
+	{
+		model = ExtString.String.strip (swab (String.sub id 54 40));
+		sectors = sectors;
+		lba48 = lba48;
+		multiple = word 47 land 0xFF;
+		dma = word 49 land (1 lsl 8) <> 0;
+		flush_ext = lba48 && word 83 land (1 lsl 13) <> 0;
+	}
+
+(* switch to READ/WRITE MULTIPLE if the drive offers it *)
+let set_multiple disk info =
+	if info.multiple <= 1 then { info with multiple = 1 }
+	else begin
+		write R.seccount info.multiple;
+		write R.dev_head (0xE0 lor ((disk land 1) lsl 4));
+		write R.command C.set_multiple;
+		poll R.status (fun i -> i land S.bsy = 0);
+		if Asm.in8 (pri + R.status) land S.err <> 0
+			then { info with multiple = 1 }
+			else info
+	end
+
+(* 28-bit commands can't reach past 128GiB or move more than 256 sectors *)
+let needs48 disk sector length =
+	infos.(disk).lba48 && (sector + length > 0x0FFFFFFF || length > 256)
+
+let command disk sector length cmd28 cmd48 =
+	if needs48 disk sector length
+		then select48 disk sector length cmd48
+		else select disk sector length cmd28
+
+let check_status what sector length =
+	let status = Asm.in8 (pri + R.status) in
+	if status land (S.err lor S.df) <> 0 then
+		failwith (Printf.sprintf "ide: %s of %d+%d failed (status %x, error %x)"
+			what sector length status (Asm.in8 (pri + R.error)))
+
+(* PIO moves one DRQ block (a sector, or [multiple] in multiple mode) at a time *)
+let pio disk sector length buf writing =
+	let m = infos.(disk).multiple in
+	let multi = m > 1 in
+	if writing then
+		command disk sector length
+			(if multi then C.write_multiple else C.write_sectors)
+			(if multi then C.write_multiple_ext else C.write_sectors_ext)
+	else
+		command disk sector length
+			(if multi then C.read_multiple else C.read_sectors)
+			(if multi then C.read_multiple_ext else C.read_sectors_ext);
+	let rec blocks done_ =
+		if done_ < length then begin
+			let n = min m (length - done_) in
+			poll R.status (fun i -> i land S.bsy = 0 && i land (S.drq lor S.err) <> 0);
+			check_status (if writing then "write" else "read") sector length;
+			let chunk = Array1.sub buf (512 * done_) (512 * n) in
+			if writing
+				then Asm.out16s_ba (pri + R.data) chunk (256 * n)
+				else Asm.in16s_ba (pri + R.data) chunk (256 * n);
+			blocks (done_ + n)
+		end
+	in
+	blocks 0;
+	poll R.status (fun i -> i land S.bsy = 0);
+	check_status (if writing then "write" else "read") sector length
+
+let flush_cache disk =
+	if infos.(disk).flush_ext then
+		select48 disk 0 0 C.flush_cache_ext
+	else begin
+		write R.dev_head (0xE0 lor ((disk land 1) lsl 4));
+		write R.command C.flush_cache
+	end;
+	(* flushing a big write cache takes far longer than a normal command *)
+	let rec wait tries =
+		try poll R.status (fun i -> i land S.bsy = 0)
+		with Timeout when tries > 0 -> wait (tries - 1)
+	in
+	wait 100;
+	check_status "flush" 0 0
+
+(* Bus-master DMA (PIIX/ICH). The controller copies sectors between the
+   drive and dma_buffer through a two-entry PRD table, and completion
+   arrives on IRQ 14, so the calling thread sleeps instead of spinning. *)
+
+module BM = struct
+	let command = 0x00
+	let status  = 0x02
+	let prd     = 0x04
+	
+	let start = 0x01
+	let read  = 0x08 (* device to memory *)
+	
+	let active = 0x01
+	let error  = 0x02
+	let irq    = 0x04
+end
+
+(* two 64KiB PRD entries, neither of which may cross a 64KiB boundary *)
+let max_dma_sectors = 256
+
+type bus_master = {
+	base : int;
+	prd_mem : BlockIO.t;
+	prd : (int32, int32_elt, c_layout) Array1.t;
+	dma_buffer : BlockIO.t;
+	lock : Mutex.t;
+	finished : Condition.t;
+	started : Condition.t;
+	mutable status : int; (* -1 while a transfer is in flight *)
+	mutable transfers : int;
+}
+
+(* Thread.usleep ticks a transfer may take before the channel is reset *)
+let dma_timeout = 100_000
+let timed_out = 0x200
+
+let bus_master = ref None
+
+(* one command on the controller at a time, whether PIO or DMA *)
+let controller = Mutex.create ()
+
+let with_controller f =
+	Mutex.lock controller;
+	try
+		let r = f () in
+		Mutex.unlock controller;
+		r
+	with ex ->
+		Mutex.unlock controller;
+		raise ex
+
+let dma_isr bm () =
+	let status = Asm.in8 (bm.base + BM.status) in
+	(* reading the ATA status register acknowledges the drive *)
+	let ata = Asm.in8 (pri + R.status) in
+	if status land BM.irq <> 0 then begin
+		Asm.out8 (bm.base + BM.status) BM.irq;
+		Mutex.lock bm.lock;
+		if bm.status = -1 then begin
+			bm.status <- ata lor (if status land BM.error <> 0 then 0x100 else 0);
+			Condition.signal bm.finished
+		end;
+		Mutex.unlock bm.lock
+	end
+
+(* ends the wait of a transfer that is still in flight [dma_timeout] after
+   the watchdog saw it start. Thread.usleep blocks until a timer tick, and
+   while the channel is idle the watchdog sleeps on [started], so neither
+   keeps the CPU from halting. *)
+let rec watchdog bm =
+	Mutex.lock bm.lock;
+	while bm.status <> -1 do
+		Condition.wait bm.started bm.lock
+	done;
+	let transfer = bm.transfers in
+	Mutex.unlock bm.lock;
+	Thread.usleep dma_timeout;
+	Mutex.lock bm.lock;
+	if bm.status = -1 && bm.transfers = transfer then begin
+		bm.status <- timed_out;
+		Condition.signal bm.finished
+	end;
+	Mutex.unlock bm.lock;
+	watchdog bm
+
+(* software reset of both drives on the channel, which drops a hung
+   command; SRST also clears multiple mode, so that is set again *)
+let reset_channel bm =
+	Asm.out8 (bm.base + BM.command) 0;
+	Asm.out8 pri_control 0x04;
+	for i = 1 to 10 do Asm.out8 0x80 0x80 done;
+	Asm.out8 pri_control 0x00;
+	(try poll R.status (fun i -> i land S.bsy = 0) with Timeout -> ());
+	Asm.out8 (bm.base + BM.status) (BM.irq lor BM.error);
+	for disk = 0 to 1 do
+		if infos.(disk).multiple > 1 then
+			try infos.(disk) <- set_multiple disk infos.(disk) with Timeout -> ()
+	done
+
+let dma bm disk sector length buf writing =
+	let bytes = 512 * length in
+	let first = min bytes 0x10000 in
+	let base = Asm.address bm.dma_buffer in
+	(* a byte count of 0 means 64KiB; bit 31 marks the last entry *)
+	let entry n addr size last =
+		bm.prd.{2 * n} <- addr;
+		bm.prd.{2 * n + 1} <- Int32.logor
+			(if last then 0x8000_0000l else 0l) (Int32.of_int (size land 0xFFFF))
+	in
+	entry 0 base first (bytes = first);
+	if bytes > first then
+		entry 1 (Int32.add base 0x10000l) (bytes - first) true;
+	if writing then
+		Array1.blit (Array1.sub buf 0 bytes) (Array1.sub bm.dma_buffer 0 bytes);
+	let direction = if writing then 0 else BM.read in
+	Asm.out32 (bm.base + BM.prd) (Asm.address bm.prd_mem);
+	Asm.out8 (bm.base + BM.command) direction;
+	Asm.out8 (bm.base + BM.status) (BM.irq lor BM.error);
+	Mutex.lock bm.lock;
+	bm.status <- -1;
+	bm.transfers <- bm.transfers + 1;
+	Condition.signal bm.started;
+	Mutex.unlock bm.lock;
+	if writing
+		then command disk sector length C.write_dma C.write_dma_ext
+		else command disk sector length C.read_dma C.read_dma_ext;
+	Asm.out8 (bm.base + BM.command) (direction lor BM.start);
+	Mutex.lock bm.lock;
+	while bm.status = -1 do
+		Condition.wait bm.finished bm.lock
 	done;
-	data
+	Mutex.unlock bm.lock;
+	if bm.status = timed_out then begin
+		reset_channel bm;
+		failwith (Printf.sprintf "ide: dma %s of %d+%d timed out"
+			(if writing then "write" else "read") sector length)
+	end;
+	Asm.out8 (bm.base + BM.command) 0;
+	if bm.status land (0x100 lor S.err lor S.df) <> 0 then
+		failwith (Printf.sprintf "ide: dma %s of %d+%d failed (%x)"
+			(if writing then "write" else "read") sector length bm.status);
+	if not writing then
+		Array1.blit (Array1.sub bm.dma_buffer 0 bytes) (Array1.sub buf 0 bytes)
+
+(* move [length] sectors between the disk and [buf], in chunks the
+   controller can take *)
+let transfer disk sector length buf writing =
+	with_controller begin fun () ->
+		let rec loop sector length ofs =
+			if length > 0 then begin
+				let n = min length max_dma_sectors in
+				let chunk = Array1.sub buf ofs (512 * n) in
+				begin match !bus_master with
+				| Some bm when infos.(disk).dma -> dma bm disk sector n chunk writing
+				| _ -> pio disk sector n chunk writing
+				end;
+				loop (sector + n) (length - n) (ofs + 512 * n)
+			end
+		in loop sector length 0
+	end
+
+let transfer_read disk sector length dst = transfer disk sector length dst false
+
+let transfer_write disk sector length src = transfer disk sector length src true
+
+(* Request queue. Callers hand over descriptors and one I/O thread, for
+   the primary channel the driver talks to, issues them: C-LOOK order
+   (ascending from the last position, then wrap), with any request passed
+   over [starvation_limit] times served first. Contiguous requests of the same kind are merged into one
+   command of up to [max_dma_sectors]. *)
+
+type op = Read | Write | Flush
+
+type request = {
+	seq : int;
+	op : op;
+	disk : int;
+	sector : int;
+	count : int;
+	data : BlockIO.t;
+	complete : exn option -> unit;
+	mutable passed : int;
+}
+
+let starvation_limit = 32
+
+type queue = {
+	q_lock : Mutex.t;
+	q_ready : Condition.t;
+	mutable pending : request list; (* sorted by (disk, sector) *)
+	mutable position : int * int;
+	mutable worker : Thread.t option;
+	mutable requests : int; (* also the next sequence number *)
+	mutable commands : int;
+}
+
+let queue = {
+	q_lock = Mutex.create ();
+	q_ready = Condition.create ();
+	pending = [];
+	position = (0, 0);
+	worker = None;
+	requests = 0;
+	commands = 0;
+}
+
+let position r = (r.disk, r.sector)
+
+let rec insert_sorted r = function
+	| x :: rest when position x <= position r -> x :: insert_sorted r rest
+	| l -> r :: l
+
+(* a flush is a barrier: it waits for everything submitted before it *)
+let ready q r =
+	r.op <> Flush
+	|| not (List.exists (fun x -> x.disk = r.disk && x.seq < r.seq) q.pending)
+
+let pick q =
+	let ready = List.filter (ready q) q.pending in
+	match List.filter (fun r -> r.passed >= starvation_limit) ready with
+	| r :: _ -> r
+	| [] ->
+		match List.filter (fun r -> position r >= q.position) ready with
+		| r :: _ -> r
+		| [] -> List.hd ready
+
+(* [first] plus the pending requests that continue it on disk *)
+let gather q first =
+	let rec extend batch last total =
+		let next = last.sector + last.count in
+		match List.filter (fun r ->
+				r.op = first.op && r.op <> Flush && r.disk = first.disk && r.sector = next
+				&& total + r.count <= max_dma_sectors) q.pending with
+		| r :: _ -> extend (r :: batch) r (total + r.count)
+		| [] -> List.rev batch
+	in
+	extend [first] first first.count
+
+let merge_buffer = lazy (Array1.create int8_unsigned c_layout (512 * max_dma_sectors))
+
+let issue batch =
+	let first = List.hd batch in
+	match batch with
+	| [{ op = Flush } as r] -> with_controller (fun () -> flush_cache r.disk)
+	| [r] ->
+		(if r.op = Read then transfer_read else transfer_write) r.disk r.sector r.count r.data
+	| _ ->
+		let total = List.fold_left (fun n r -> n + r.count) 0 batch in
+		let buf = Array1.sub (Lazy.force merge_buffer) 0 (512 * total) in
+		let each f =
+			ignore (List.fold_left (fun ofs r ->
+				f (Array1.sub buf ofs (512 * r.count)) (Array1.sub r.data 0 (512 * r.count));
+				ofs + 512 * r.count) 0 batch)
+		in
+		if first.op = Read then begin
+			transfer_read first.disk first.sector total buf;
+			each Array1.blit
+		end else begin
+			each (fun merged src -> Array1.blit src merged);
+			transfer_write first.disk first.sector total buf
+		end
+
+let rec worker q =
+	Mutex.lock q.q_lock;
+	while q.pending = [] do
+		Condition.wait q.q_ready q.q_lock
+	done;
+	let batch = gather q (pick q) in
+	q.pending <- List.filter (fun r -> not (List.memq r batch)) q.pending;
+	List.iter (fun r -> r.passed <- r.passed + 1) q.pending;
+	let last = List.nth batch (List.length batch - 1) in
+	q.position <- (last.disk, last.sector + last.count);
+	q.commands <- q.commands + 1;
+	Mutex.unlock q.q_lock;
+	let result = try issue batch; None with ex -> Some ex in
+	List.iter (fun r -> try r.complete result with _ -> ()) batch;
+	worker q
+
+(* [complete] runs on the I/O thread, so it must not wait on the queue *)
+let submit disk op sector count data complete =
+	if Array1.dim data < 512 * count then invalid_arg "IDE.submit";
+	Mutex.lock queue.q_lock;
+	let r = {
+		seq = queue.requests; op = op; disk = disk; sector = sector; count = count;
+		data = data; complete = complete; passed = 0;
+	} in
+	if queue.worker = None then
+		queue.worker <- Some (Thread.create worker queue "ide");
+	queue.pending <- insert_sorted r queue.pending;
+	queue.requests <- queue.requests + 1;
+	Condition.signal queue.q_ready;
+	Mutex.unlock queue.q_lock
+
+let wait_for f =
+	let result = MVar.create () in
+	f (fun r -> MVar.put r result);
+	match MVar.get result with
+	| Some ex -> raise ex
+	| None -> ()
+
+let read_disk_ba disk sector length dst =
+	wait_for (submit disk Read sector length dst)
+
+let write_disk_ba disk sector length src =
+	wait_for (submit disk Write sector length src)
+
+let no_data = Array1.create int8_unsigned c_layout 0
+
+let flush disk =
+	wait_for (submit disk Flush 0 0 no_data)
+
+let queue_stats () = queue.requests, queue.commands
+
+let read_disk disk sector length =
+	let data = Array1.create int8_unsigned c_layout (512 * length) in
+	read_disk_ba disk sector length data;
+	Array1.to_string data
+
+let write_disk disk sector length data =
+	if String.length data < 512 * length then invalid_arg "IDE.write_disk";
+	let buf = Array1.create int8_unsigned c_layout (512 * length) in
+	Array1.blit_from_string data buf;
+	write_disk_ba disk sector length buf
+
+(* capacity in sectors, from IDENTIFY DEVICE *)
+let sectors disk = infos.(disk).sectors
+
+(* every disk shares the block cache; registered on first use *)
+let caches = Array.make 4 None
+
+let cache disk =
+	match caches.(disk) with
+	| Some dev -> dev
+	| None ->
+		let dev = BlockCache.register (Printf.sprintf "ide%d" disk)
+			~write:(write_disk_ba disk) ~flush:(fun () -> flush disk) (read_disk_ba disk) in
+		caches.(disk) <- Some dev;
+		dev
 	
 let present_disks= [| false; false; false; false |]
 
@@ -120,7 +585,7 @@ let mk_source disk_id =
 		units = 512;
 		offset = 0;
 		fill = begin fun buf ofs len ->
-				let s = read_disk disk_id src.position ((len + src.units - 1) / src.units) in
+				let s = BlockCache.read (cache disk_id) src.position ((len + src.units - 1) / src.units) in
 				(* blit from string into bigarray buffer *)
 				BlockIO.blit_from_string s buf;
 				len (* how much we wrote *)
@@ -203,9 +668,22 @@ let init () =
 			Printf.printf "ide: can't find primary slave\n";
 		end;
 	end;
+	Array.iteri (fun i present ->
+		if present then begin try
+			infos.(i) <- set_multiple i (identify i);
+			let info = infos.(i) in
+			Printf.printf "ide%d: %s, %d sectors%s, %d per block%s\n" i info.model info.sectors
+				(if info.lba48 then " (lba48)" else "") info.multiple
+				(if info.dma then ", dma" else "")
+		with _ ->
+			Printf.printf "ide%d: identify failed\n" i
+		end) present_disks;
 	Array.iteri (fun i d ->
 		if present_disks.(i) then
-			disks.(i) <- { disks.(i) with read = read_disk i }) disks;
+			disks.(i) <- {
+				read = BlockCache.read (cache i);
+				write = BlockCache.write (cache i);
+			}) disks;
 	init ()
 
 let get c d =
@@ -219,18 +697,33 @@ open PCI
 
 let create dev =
 	begin try
-		(*let dev = PCI.probe dev.b dev.d 1 in
-	Printf.printf "probing device %04x:%04x\r\n" dev.vendor dev.device;
-	Printf.printf "programming interface: %x\r\n"
-		(PCI.read8 dev.id 9);
-	(*(* write 1f0 into the bmiba *)
-	PCI.write32 dev.id 0x20
-		(Int32.of_int ((0x1f0 lsl 4) lor 1));*)
-	(*(* write bit to set I/O space enable to command register *)
-	PCI.write16 dev.id 0x04 1;*)
-	(* try init() again *)
-	Printf.printf "pci ide: init...\r\n";*)
-	init ();
+		if not (Array.fold_left (||) false present_disks) then init ();
+		(* some ids are the ISA bridge; the IDE controller is function 1 *)
+		let dev =
+			if PCI.read8 dev.id 0x0B = 0x01 then dev
+			else PCI.probe dev.b dev.d 1 in
+		(* BAR4 is the bus-master register block; enable I/O and bus mastering *)
+		let base = Int32.to_int (Int32.logand (PCI.read32 dev.id 0x20) 0xFFFCl) in
+		if base <> 0 then begin
+			PCI.write16 dev.id 0x04 (PCI.read16 dev.id 0x04 lor 0x05);
+			let prd_mem = Asm.dma_alloc 16 16 in
+			let bm = {
+				base = base;
+				prd_mem = prd_mem;
+				prd = Asm.array32 (Asm.address prd_mem) 4;
+				dma_buffer = Asm.dma_alloc (512 * max_dma_sectors) 0x10000;
+				lock = Mutex.create ();
+				finished = Condition.create ();
+				started = Condition.create ();
+				status = 0;
+				transfers = 0;
+			} in
+			(* legacy-mode controllers always use IRQ 14 for the primary channel *)
+			Interrupts.create 14 (dma_isr bm);
+			ignore (Thread.create watchdog bm "ide-watchdog");
+			bus_master := Some bm;
+			Printf.printf "ide: bus-master dma at %04x\n" base
+		end
 	with Not_found -> Printf.printf "no sub device" end
 	
 let init2 () =
@@ -5,6 +5,36 @@ type t
 
 val read_disk : t -> int -> int -> string
 
+val write_disk : t -> int -> int -> string -> unit
+
+val read_disk_ba : t -> int -> int -> BlockIO.t -> unit
+(** [read_disk_ba disk sector count buf] reads [count] sectors into the
+    start of [buf], using bus-master DMA once the PCI controller has been
+    attached. It goes through the request queue and waits for completion. *)
+
+val write_disk_ba : t -> int -> int -> BlockIO.t -> unit
+
+(** Wait for everything queued so far, then flush the drive's write cache *)
+val flush : t -> unit
+
+type op = Read | Write | Flush
+
+(** [submit disk op sector count buf complete] queues a transfer between
+    [count] sectors at [sector] and the start of [buf], and returns at
+    once. The I/O thread sorts and merges queued requests and calls
+    [complete None] (or [Some exn]) when the transfer is done; [complete]
+    must not itself wait on the queue. *)
+val submit : t -> op -> int -> int -> BlockIO.t -> (exn option -> unit) -> unit
+
+(** (requests submitted, commands issued) *)
+val queue_stats : unit -> int * int
+
+(** Capacity in sectors, as the drive reports it *)
+val sectors : t -> int
+
+(** The disk's handle in the shared block cache *)
+val cache : t -> BlockCache.device
+
 type controller = Primary | Secondary
 type device = Master | Slave
 
@@ -25,3 +55,5 @@ val disks : device_t array
 type disk = { sink : KernelBuffer.sink; source : KernelBuffer.source }
 
 val kb_disks : disk array
+
+val init2 : unit -> unit
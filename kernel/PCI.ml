@@ -124,12 +124,20 @@ let write32 command offset value =
 module C = struct
 	let vendor = 0x00
 	let device = 0x02
+	let command = 0x04
+	let status = 0x06
 	let header_type = 0x0E
 	let resource_addr = 0x10
 	let resource_addr_size = 0x04
+	let capabilities = 0x34
 	let request_line = 0x3C
 end
 
+module Cap = struct
+	let msi = 0x05
+	let msix = 0x11
+end
+
 let probe bus device funct =
 	let id =
 		let x = (bus lsl 16) lor (device lsl 11) lor ((funct land 7) lsl 8)
@@ -173,3 +181,52 @@ let probe_bus () =
 		done
 	done;
 	!list
+
+let find_capability id cap =
+	if read16 id C.status land 0x10 = 0 then raise Not_found;
+	let rec walk ptr =
+		if ptr = 0 then raise Not_found
+		else if read8 id ptr = cap then ptr
+		else walk (read8 id (ptr + 1) land 0xFC)
+	in walk (read8 id C.capabilities land 0xFC)
+
+let supports_msi device =
+	List.exists (fun cap ->
+			try ignore (find_capability device.id cap); true
+			with Not_found -> false)
+		[Cap.msi; Cap.msix]
+
+(* program a single message; INTx is disabled once the device uses it *)
+let enable_msi device address data =
+	let id = device.id in
+	let disable_intx () = write16 id C.command (read16 id C.command lor 0x400) in
+	try
+		let cap = find_capability id Cap.msi in
+		let control = read16 id (cap + 2) in
+		write32 id (cap + 4) address;
+		if control land 0x80 <> 0 then begin
+			(* 64-bit message address *)
+			write32 id (cap + 8) zero;
+			write16 id (cap + 12) data
+		end else
+			write16 id (cap + 8) data;
+		write16 id (cap + 2) ((control land (lnot 0x70)) lor 1);
+		disable_intx ();
+		true
+	with Not_found ->
+	try
+		let cap = find_capability id Cap.msix in
+		let control = read16 id (cap + 2) in
+		let table = read32 id (cap + 4) in
+		match device.resources.(to_int (logand table 7l)) with
+		| Memory base ->
+			let entry = add (logand base 0xFFFF_FFF0l) (logand table (lognot 7l)) in
+			Asm.poke32_offset entry 0 address;
+			Asm.poke32_offset entry 4 zero;
+			Asm.poke32_offset entry 8 (of_int data);
+			Asm.poke32_offset entry 12 zero;
+			write16 id (cap + 2) ((control lor 0x8000) land (lnot 0x4000));
+			disable_intx ();
+			true
+		| _ -> false
+	with Not_found -> false
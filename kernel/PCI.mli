@@ -38,3 +38,14 @@ val read32 : device_id -> int -> int32
 val write8 : device_id -> int -> int -> unit
 val write16 : device_id -> int -> int -> unit
 val write32 : device_id -> int -> int32 -> unit
+
+val find_capability : device_id -> int -> int
+(** [find_capability id cap] returns the config space offset of
+    capability [cap], or raises [Not_found]. *)
+
+val supports_msi : device -> bool
+
+val enable_msi : device -> int32 -> int -> bool
+(** [enable_msi device address data] programs the device's MSI (or the
+    first MSI-X table entry) with the given message, and disables INTx.
+    Returns false if the device has neither capability. *)
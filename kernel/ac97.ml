@@ -29,11 +29,41 @@ module R = struct
 	let control = 0x1B
 	let status = 0x16
 	let sample_rate = 0x2C
+	let record_select = 0x1A
+	let record_gain = 0x1C
+	let adc_rate = 0x32
+end
+
+(* the PCM in box of the bus master registers *)
+module PI = struct
+	let bdl_offset = 0x00
+	let current = 0x04
+	let last_valid = 0x05
+	let status = 0x06
+	let control = 0x0B
 end
 
 let num_buffers = 32
 let buffer_size = 32768 (* in samples, which are 16-bit *)
 
+(* Samples queued per buffer: smaller periods mean less latency and more
+   interrupts. Takes effect from the next buffer queued. *)
+let period = ref 8192
+
+let set_period samples =
+	period := max 64 (min buffer_size samples) land (lnot 1)
+
+let interrupts = ref 0
+let underruns = ref 0 (* times the last queued buffer ran out *)
+
+(* Samples per capture buffer, fixed when capture starts; the ISR hands
+   each buffer on as it fills, so this bounds the capture latency *)
+let capture_size = 4096
+let capture_period = ref 1024
+
+let set_capture_period samples =
+	capture_period := max 64 (min capture_size samples) land (lnot 1)
+
 let create device =
 	let module C = struct
 		open Bigarray
@@ -64,115 +94,96 @@ let create device =
 		let next_buffer buffer =
 			(buffer + 1) mod num_buffers
 		
-		(* isr & output routines *)
-		let m = Mutex.create()
-		let cv = Condition.create()
+		(* isr & output routines: the producer sleeps on [cv] while every
+		   buffer is queued, and the ISR wakes it as each one completes *)
+		let m = Mutex.create ()
+		let cv = Condition.create ()
 		
-		(*let ready_queue = Queue.create ()
-		let free_queue  = Queue.create ()
+		let full () =
+			next_buffer (last_valid ()) = current ()
 		
-		let isr () =
-			if next_buffer (last_valid ()) <> current () then begin
-				(* clear the interrupt, by writing '1' to bit 3 *)
-				nabmbar.write16 R.status (nabmbar.read16 R.status lor 8);
+		let output_isr () =
+			let status = nabmbar.read16 R.status in
+			(* buffer completion, last valid buffer done, FIFO error *)
+			if status land 0x1C <> 0 then begin
+				nabmbar.write16 R.status (status land 0x1C);
+				if status land 0x04 <> 0 then incr underruns;
 				Mutex.lock m;
-				Queue.push buffers.(last_valid ()) free_queue;
 				Condition.broadcast cv;
-				Mutex.unlock m;
+				Mutex.unlock m
 			end
 		
-		let play () = ignore (Thread.create (fun () ->
-			while true do
-				Mutex.lock m;
-				while Queue.is_empty ready_queue do
-					Condition.wait cv m;
-				done;
-				let buffer = Queue.pop ready_queue in
-				Mutex.unlock m;
-				match buffer with
-				| `Full buffer ->
-					Mutex.lock m;
-					while next_buffer (last_valid ()) = current () do
-						Condition.wait cv m;
-					done;
-					Mutex.unlock m;
-					let ix = next_buffer (last_valid ()) in
-					bdl.{2*ix+1} <- Int32.logor 0x8000_0000l (Int32.of_int ((buffer_size * 2) lsr 1));
-					nabmbar.write8 R.last_valid ix;
-				| `Partial buffer ->
-					Mutex.lock m;
-					while next_buffer (last_valid ()) = current () do
-						Condition.wait cv m;
-					done;
-					Mutex.unlock m;
-					let ix = next_buffer (last_valid ()) in
-					bdl.{2*ix+1} <- Int32.logor 0x8000_0000l (Int32.of_int ((Array1.dim buffer) lsr 1));
-					nabmbar.write8 R.last_valid ix;
-			done) () "ac97")
+		(* PCM in: every descriptor stays valid, and each buffer becomes the
+		   last valid one again once the ISR has handed it on, so the engine
+		   goes round the ring for as long as capture runs *)
+		let in_buffers = Array.init num_buffers begin fun _ ->
+				Array1.create int8_unsigned c_layout (capture_size * 2)
+			end
+		let in_bdl = Array1.create int32 c_layout (num_buffers * 2)
+		let in_next = ref 0 (* the oldest buffer not yet handed on *)
+		let deliver = ref (fun (_ : BlockIO.t) -> ())
+		
+		let capture_isr () =
+			let status = nabmbar.read16 PI.status in
+			if status land 0x1C <> 0 then begin
+				nabmbar.write16 PI.status (status land 0x1C);
+				let current = nabmbar.read8 PI.current in
+				while !in_next <> current do
+					let ix = !in_next in
+					let samples = Int32.to_int (Int32.logand in_bdl.{2*ix+1} 0xFFFFl) in
+					!deliver (Array1.sub in_buffers.(ix) 0 (samples * 2));
+					nabmbar.write8 PI.last_valid ix;
+					in_next := next_buffer ix
+				done
+			end
+		
+		let isr () =
+			incr interrupts;
+			output_isr ();
+			capture_isr ()
 		
-		let get_buffer () =
+		let start_capture callback =
+			deliver := callback;
+			(* reset PCM in *)
+			nabmbar.write8 PI.control 0x02;
+			while nabmbar.read8 PI.control land 0x02 <> 0 do () done;
+			for i = 0 to num_buffers - 1 do
+				in_bdl.{2*i} <- Asm.address in_buffers.(i);
+				in_bdl.{2*i+1} <- Int32.logor 0x8000_0000l (Int32.of_int !capture_period)
+			done;
+			nabmbar.write32 PI.bdl_offset (Asm.address in_bdl);
+			in_next := nabmbar.read8 PI.current;
+			nabmbar.write8 PI.last_valid (next_buffer (num_buffers + !in_next - 2));
+			(* run, with interrupts on completion, FIFO error and running dry *)
+			nabmbar.write8 PI.control 0x1D
+		
+		(* wait for a free buffer, let [fill] write up to a period into it,
+		   and queue however many bytes it says it wrote *)
+		let render fill =
 			Mutex.lock m;
-			while Queue.is_empty free_queue do
-				Condition.wait cv m;
+			while full () do
+				Condition.wait cv m
 			done;
-			let b = Queue.pop free_queue in
 			Mutex.unlock m;
-			b
+			let ix = next_buffer (last_valid ()) in
+			let size = fill (Array1.sub buffers.(ix) 0 (!period * 2)) land (lnot 3) in
+			if size > 0 then begin
+				(* interrupt on completion, and the size in samples *)
+				bdl.{2*ix+1} <- Int32.logor 0x8000_0000l (Int32.of_int (size lsr 1));
+				nabmbar.write8 R.last_valid ix
+			end
 		
-		let put_buffer buffer =
-			Mutex.lock m;
-			Queue.push buffer ready_queue;
-			Condition.broadcast cv;
-			Mutex.unlock m*)
-
 		open BlockIO
-		(* from old ICH0 sources... *)
-		let isr () =
-			if next_buffer (last_valid ()) <> current () then begin
-				(* clear the interrupt, by writing '1' to bit 3 *)
-				nabmbar.write16 R.status (nabmbar.read16 R.status lor 8);
-				Debug.printf "waking output\n";
-				Mutex.lock m;
-				Condition.signal cv;
-				Mutex.unlock m;
-				Debug.printf "emptied a buffer\n"
-			end else Debug.printf "do nothing\n"
 		
 		let output block_input =
-			(* the length = total size of input - current position *)
 			let len = Array1.dim block_input.data in
-			(*let samples = Array1.dim block_input.data - block_input.pos in*)
-			let rec loop () =
-				if block_input.pos >= len then begin
-					(* we've finished! *)
-					Debug.printf "no more audio\n";
-				end else begin
-					(* we can shuffle more data into the card *)
-					(*Mutex.lock m;*)
-					while next_buffer (last_valid ()) = current () do
-						(* wait for a free buffer *)
-						Debug.printf "buffers full\n";
-						Thread.yield ();
-						(*Condition.wait cv m;*)
-					done;
-					(*Mutex.unlock m;*)
-					Debug.printf "adding another buffer\n";
-					(* get the next buffer *)
-					let ix = next_buffer (last_valid ()) in
-					let buffer = buffers.(ix) in
-					(* copy data into the buffer *)
-					let size = min (buffer_size * 2) (len - block_input.pos) in
-					if size < (buffer_size * 2) then
-						BlockIO.blit block_input (Array1.sub buffer 0 size)
-					else
-						BlockIO.blit block_input buffer;
-					(* send the command byte and size (in samples) *)
-					bdl.{2*ix+1} <- Int32.logor 0x8000_0000l (Int32.of_int (size lsr 1));
-					nabmbar.write8 R.last_valid ix;
-					loop ()
+			while block_input.pos < len do
+				render begin fun buffer ->
+					let size = min (Array1.dim buffer) (len - block_input.pos) in
+					BlockIO.blit block_input (Array1.sub buffer 0 size);
+					size
 				end
-			in loop ()
-
+			done
 		
 	end in
 	
@@ -196,6 +207,10 @@ let create device =
 		C.nambar.write16 x 0
 	end R.mute;
 	
+	(* record from line in, at 0dB *)
+	C.nambar.write16 R.record_select 0x0404;
+	C.nambar.write16 R.record_gain 0;
+	
 	(* program the buffer descriptor list *)
 	C.nabmbar.write32 R.bdl_offset (Asm.address C.bdl);
 	C.nabmbar.write8 R.last_valid (C.nabmbar.read8 R.current);
@@ -203,26 +218,31 @@ let create device =
     (* set sample rate to 44100 hertz (more common then default of 48000) *)
     C.nambar.write16 R.sample_rate 44100;
 	
-	(* register an interrupt handler *)
-	Interrupts.create device.request_line C.isr;
-	C.set_bit C.nabmbar R.control 4; (* interrupts for buffer completion *)
-	C.nabmbar.write8 R.control (C.nabmbar.read8 R.control lor 8);
-	Printf.printf "ich0: on request line %02X\n" device.request_line;
-	
-	(*(* add all the buffers to the free queue *)
-	for i = 0 to Array.length C.buffers - 1 do
-		Queue.push C.buffers.(i) C.free_queue;
-	done;*)
-	
-	(* start output *)
-	C.nabmbar.write8 R.control (C.nabmbar.read8 R.control lor 1);
-	
-	(* register with the audio mixer *)
+	(* register with the audio mixer before anything runs, so a refusal
+	   leaves the engine stopped and the IRQ unhooked; the mixer's first
+	   renders only queue buffers until output starts *)
 	let sample_rate = C.nambar.read16 R.sample_rate in
 	Printf.printf "ich0: sample rate = %d\n" sample_rate;
 	AudioMixer.register_device {
 		format = 16, sample_rate, 2;
 		output = C.output;
+		render = Some C.render;
+	};
+	
+	(* register an interrupt handler *)
+	let line = Interrupts.pci_line device in
+	Interrupts.create line C.isr;
+	(* interrupts on FIFO error, buffer completion and running dry *)
+	C.nabmbar.write8 R.control (C.nabmbar.read8 R.control lor 0x1C);
+	Printf.printf "ich0: on request line %02X\n" line;
+	
+	(* start output *)
+	C.nabmbar.write8 R.control (C.nabmbar.read8 R.control lor 1);
+	
+	C.nambar.write16 R.adc_rate 44100;
+	AudioMixer.register_capture {
+		capture_format = 16, C.nambar.read16 R.adc_rate, 2;
+		start = C.start_capture;
 	}
 
 let init () =
@@ -12,6 +12,12 @@ external in32 : int -> int32 = "snowflake_in32"
 external in16s : int -> int -> string = "snowflake_in16s"
 external out16s : int -> string -> int -> unit = "snowflake_out16s"
 
+(* [in16s_ba port buf words]: the bigarray must hold at least 2 * words bytes *)
+external in16s_ba : int -> (int, int8_unsigned_elt, c_layout) Array1.t -> int -> unit
+	= "snowflake_in16s_ba"
+external out16s_ba : int -> (int, int8_unsigned_elt, c_layout) Array1.t -> int -> unit
+	= "snowflake_out16s_ba"
+
 external hlt : unit -> unit = "snowflake_hlt" "noalloc"
 
 external cli : unit -> unit = "snowflake_cli" "noalloc"
@@ -20,6 +26,10 @@ external sti : unit -> unit = "snowflake_sti" "noalloc"
 (* returns a pointer to the memory chunk of the bigarray *)
 external address : ('a, 'b, c_layout) Array1.t -> int32 = "snowflake_address"
 
+(* [dma_alloc size align] allocates a bigarray suitable for bus-master DMA *)
+external dma_alloc : int -> int -> (int, int8_unsigned_elt, c_layout) Array1.t
+	= "snowflake_dma_alloc"
+
 (* given a pointer, and a size, wraps it in a bigarray *)
 
 external array8 : int32 -> int -> ('a, int8_unsigned_elt, c_layout) Array1.t
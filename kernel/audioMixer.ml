@@ -4,6 +4,7 @@
 (* Provides an interface to a sound device *)
 
 open BlockIO
+open Bigarray
 
 type bit_rate
 	= Bits8
@@ -83,79 +84,512 @@ open Wave
 type output = {
 	format: format;
 	output: BlockIO.input -> unit;
+	render: ((BlockIO.t -> int) -> unit) option;
 }
 
-(* resampling *)
-
-let resample wave new_rate =
-	failwith "resample: removed while block io worked on"(*
-	let ratio = float new_rate /. float wave.samples_per_sec in
-	let scale v = int_of_float (float v /. ratio) in
-	let last_samples = Array.make wave.channels 0 in
-	let last_t = ref 0 in
-	let last_c = ref 0 in
-	let length = int_of_float (float wave.samples *. ratio) in
-	let read () =
-		let chan = !last_c in
-		incr last_c;
-		if !last_c = 1 then
-			incr last_t;
-		if !last_c = wave.channels then
-			last_c := 0;
-		if scale !last_t = scale (!last_t - 1) && !last_t <> 1 then
-			last_samples.(chan)
-		else begin
-			if chan = 0 then begin
-				for i = 0 to wave.channels - 1 do
-					last_samples.(i) <- IO.read_i16 wave.input;
-				done;
-			end;
-			last_samples.(chan);
+(* Mixing: every stream owns a ring of 16-bit stereo at the device rate.
+   Writers copy into it, so they can reuse their buffer straight away; the
+   mixer thread sums one period from each ring and hands it to the device,
+   whose output blocks while the DMA buffers are full. *)
+
+external mix_into : BlockIO.t -> BlockIO.t -> int -> unit = "snowflake_mix_s16" "noalloc"
+external clock : unit -> int64 = "snowflake_mix_clock"
+
+let unity_gain = 0x4000
+let max_gain = 0x7FFF
+
+let period_bytes = 4096 * 4
+
+(* Resampling: a polyphase FIR. Every output frame is the dot product of
+   [taps] input frames with the row of the coefficient table nearest its
+   position between two input frames, so the cost is fixed at [taps]
+   multiply-adds per channel per output frame. The history carries over
+   from one block to the next. *)
+
+type quality
+	= Linear (* 2 taps *)
+	| Sinc16 (* Blackman-windowed sinc *)
+	| Sinc64
+
+let quality = ref Sinc16
+
+let set_quality q = quality := q
+
+let phases = 256 (* must match mixer.c *)
+let history_frames = 4096
+
+(* field order is known to mixer.c *)
+type resampler = {
+	in_channels : int;
+	in_rate : int;
+	out_rate : int;
+	taps : int;
+	table : BlockIO.t; (* phases rows of taps Q14 coefficients *)
+	history : BlockIO.t; (* planar 16-bit input frames *)
+	mutable avail : int;
+	mutable index : int; (* history frame at or before the next output *)
+	mutable frac : int; (* and how far past it, in 1/out_rate frames *)
+	scratch : BlockIO.t;
+}
+
+external feed : resampler -> BlockIO.t -> int = "snowflake_resample_feed" "noalloc"
+external run : resampler -> BlockIO.t -> int = "snowflake_resample_run" "noalloc"
+
+let pi = 4.0 *. atan 1.0
+
+let taps_of = function
+	| Linear -> 2
+	| Sinc16 -> 16
+	| Sinc64 -> 64
+
+(* row p filters for an output p/phases of a frame past the centre tap *)
+let make_table quality in_rate out_rate =
+	let taps = taps_of quality in
+	let half = taps / 2 in
+	let table = Array1.create int8_unsigned c_layout (phases * taps * 2) in
+	let row = Array.make taps 0.0 in
+	(* below both Nyquist rates, leaving room for the transition band *)
+	let cutoff = (if quality = Sinc64 then 0.97 else 0.9)
+		*. min 1.0 (float out_rate /. float in_rate) in
+	for p = 0 to phases - 1 do
+		let f = float p /. float phases in
+		for k = 0 to taps - 1 do
+			let t = float (k - half + 1) -. f in
+			row.(k) <- match quality with
+				| Linear -> 1.0 -. abs_float t
+				| Sinc16 | Sinc64 ->
+					let x = t /. float half in
+					let window = 0.42 +. 0.5 *. cos (pi *. x) +. 0.08 *. cos (2.0 *. pi *. x) in
+					let a = pi *. cutoff *. t in
+					(if a = 0.0 then 1.0 else sin a /. a) *. window
+		done;
+		(* unity gain at DC in every phase *)
+		let sum = Array.fold_left (+.) 0.0 row in
+		for k = 0 to taps - 1 do
+			let c = truncate (floor (row.(k) /. sum *. 16384.0 +. 0.5)) land 0xFFFF in
+			table.{2 * (p * taps + k)} <- c land 0xFF;
+			table.{2 * (p * taps + k) + 1} <- c lsr 8
+		done
+	done;
+	table
+
+let resampler ?(quality = !quality) channels in_rate out_rate =
+	if channels < 1 || channels > 2 then
+		failwith "AudioMixer.resampler: only mono and stereo can be converted";
+	(* at the same rate this only spreads mono over both channels *)
+	let quality = if in_rate = out_rate then Linear else quality in
+	let taps = taps_of quality in
+	let history = Array1.create int8_unsigned c_layout ((taps + history_frames) * 2 * channels) in
+	Array1.fill history 0;
+	{
+		in_channels = channels;
+		in_rate = in_rate;
+		out_rate = out_rate;
+		taps = taps;
+		table = make_table quality in_rate out_rate;
+		history = history;
+		(* silence before the first frame, so it can be the centre tap *)
+		avail = taps / 2 - 1;
+		index = taps / 2 - 1;
+		frac = 0;
+		scratch = Array1.create int8_unsigned c_layout period_bytes;
+	}
+
+let resample_cycles = ref 0L
+
+let resample r input emit =
+	let len = Array1.dim input.data in
+	let rec loop () =
+		let fed = feed r (Array1.sub input.data input.pos (len - input.pos)) in
+		input.pos <- input.pos + fed;
+		let rec drain () =
+			let start = clock () in
+			let n = run r r.scratch in
+			resample_cycles := Int64.add !resample_cycles (Int64.sub (clock ()) start);
+			if n > 0 then begin
+				emit (Array1.sub r.scratch 0 n);
+				drain ()
+			end
+		in drain ();
+		if fed > 0 && input.pos < len then loop ()
+	in loop ()
+
+type stream = {
+	name : string;
+	mutable gain : int; (* Q14 *)
+	ring : BlockIO.t;
+	mutable head : int; (* next byte the mixer takes *)
+	mutable queued : int;
+	mutable closed : bool;
+	mutable starved : int; (* periods it ran short in *)
+	mutable convert : resampler option; (* from the writer's format *)
+	mutable played : int; (* bytes taken since it opened *)
+	mutable mark : (int * int64) option; (* a byte not yet taken, and when it was captured *)
+	mutable round_trip : int64;
+	mutable worst_round_trip : int64;
+}
+
+type stats = {
+	periods : int;
+	last_cycles : int64;
+	max_cycles : int64;
+	total_cycles : int64;
+	resample_cycles : int64;
+	streams : (string * int * int) list; (* name, gain, periods starved *)
+}
+
+let device = ref None
+
+let lock = Mutex.create ()
+let more = Condition.create ()
+let space = Condition.create ()
+let streams = ref []
+
+let n_periods = ref 0
+let last_cycles = ref 0L
+let max_cycles = ref 0L
+let total_cycles = ref 0L
+
+let with_lock f =
+	Mutex.lock lock;
+	try
+		let r = f () in
+		Mutex.unlock lock;
+		r
+	with ex ->
+		Mutex.unlock lock;
+		raise ex
+
+let open_stream ?(gain = unity_gain) ?(capacity = 256 * 1024) name =
+	let s = {
+		name = name;
+		gain = max 0 (min max_gain gain);
+		ring = Array1.create int8_unsigned c_layout (capacity land (lnot 3));
+		head = 0;
+		queued = 0;
+		closed = false;
+		starved = 0;
+		convert = None;
+		played = 0;
+		mark = None;
+		round_trip = 0L;
+		worst_round_trip = 0L;
+	} in
+	with_lock (fun () -> streams := !streams @ [s]);
+	s
+
+let set_gain s gain =
+	s.gain <- max 0 (min max_gain gain)
+
+(* blocks while the ring is full. The ring only ever holds whole 4-byte
+   frames; a trailing partial frame is dropped. *)
+let queue s input =
+	let len = Array1.dim input.data in
+	let cap = Array1.dim s.ring in
+	while len - input.pos >= 4 do
+		with_lock begin fun () ->
+			while s.queued = cap && not s.closed do
+				Condition.wait space lock
+			done;
+			if s.closed then failwith ("AudioMixer.write: " ^ s.name ^ " is closed");
+			let tail = (s.head + s.queued) mod cap in
+			let n = min (len - input.pos) (min (cap - s.queued) (cap - tail)) land (lnot 3) in
+			Array1.blit (Array1.sub input.data input.pos n) (Array1.sub s.ring tail n);
+			input.pos <- input.pos + n;
+			s.queued <- s.queued + n;
+			Condition.signal more
 		end
-	in read, length*)
+	done;
+	input.pos <- len
+
+let write s input =
+	match s.convert with
+	| None -> queue s input
+	| Some r -> resample r input (fun data -> queue s (BlockIO.make data))
+
+let drain s =
+	with_lock (fun () -> while s.queued > 1 do Condition.wait space lock done)
+
+(* the stream leaves the mix once what it has queued is played *)
+let close_stream s =
+	with_lock (fun () -> s.closed <- true; Condition.broadcast space)
 
-(* Pretty much allows for only one audio device atm *)
+(* mix as much of one period as the stream has, in whole frames *)
+let take s period =
+	let cap = Array1.dim s.ring in
+	let n = min (Array1.dim period) s.queued land (lnot 3) in
+	let first = min n (cap - s.head) in
+	mix_into (Array1.sub period 0 first) (Array1.sub s.ring s.head first) s.gain;
+	if n > first then
+		mix_into (Array1.sub period first (n - first)) (Array1.sub s.ring 0 (n - first)) s.gain;
+	s.head <- (s.head + n) mod cap;
+	s.queued <- s.queued - n;
+	s.played <- s.played + n;
+	begin match s.mark with
+	| Some (pos, stamp) when s.played >= pos ->
+		let t = Int64.sub (clock ()) stamp in
+		s.round_trip <- t;
+		if t > s.worst_round_trip then s.worst_round_trip <- t;
+		s.mark <- None
+	| _ -> ()
+	end;
+	n
 
-let play_to_raw device data =
+let mix_period period =
+	with_lock begin fun () ->
+		while not (List.exists (fun s -> s.queued > 1) !streams) do
+			Condition.wait more lock
+		done;
+		let start = clock () in
+		Array1.fill period 0;
+		let filled = List.fold_left begin fun filled s ->
+				let n = take s period in
+				if n > 0 && n < Array1.dim period && not s.closed then
+					s.starved <- s.starved + 1;
+				max filled n
+			end 0 !streams in
+		streams := List.filter (fun s -> not s.closed || s.queued > 1) !streams;
+		Condition.broadcast space;
+		let cycles = Int64.sub (clock ()) start in
+		incr n_periods;
+		last_cycles := cycles;
+		if cycles > !max_cycles then max_cycles := cycles;
+		total_cycles := Int64.add !total_cycles cycles;
+		filled
+	end
+
+let rec mixer period =
 	begin try
-		device.output data
+		match !device with
+		| Some { render = Some render } ->
+			(* straight into the device's DMA buffer *)
+			render mix_period
+		| Some device ->
+			let filled = mix_period period in
+			device.output (BlockIO.make (Array1.sub period 0 filled))
+		| None -> ()
 	with ex ->
-		Printf.printf "play_to_raw: %s\n" (Printexc.to_string ex)
-	end
+		Vt100.printf "mixer: %s\n" (Printexc.to_string ex)
+	end;
+	mixer period
 
-let play_to device wave =
-	match device.format with
-	| (bits,hertz,chans)
-		when bits = wave.bits_per_sec && bits = 16
-		&& hertz = wave.samples_per_sec
-		&& chans = wave.channels ->
-		(* no conversion required; push data directly to the driver *)
-		begin try
-			device.output wave.input;
-		with ex ->
-			Printf.printf "play_to: %s\n" (Printexc.to_string ex)
-		end
-	(*| (bits,hertz,chans)
-		when bits = wave.bits_per_sec && bits = 16
-		&& chans = wave.channels ->
-		(* only sample rate conversion needed *)
-		let (read, length) = resample wave hertz in
-		device.output read length*)
-	| _ ->
-		(* wave and device formats don't match *)
-		failwith "play_to: resampling not supported"
+let stats () =
+	with_lock begin fun () -> {
+		periods = !n_periods;
+		last_cycles = !last_cycles;
+		max_cycles = !max_cycles;
+		total_cycles = !total_cycles;
+		resample_cycles = !resample_cycles;
+		streams = List.map (fun s -> s.name, s.gain, s.starved) !streams;
+	} end
 
-let device = ref None
+(* play and play_raw use a shared stream unless given their own *)
 
-let play wave = match !device with
-	| None -> failwith "No audio device present"
-	| Some device -> play_to device wave
+let default_stream = ref None
+
+let default () =
+	match !default_stream with
+	| Some s -> s
+	| None ->
+		let s = open_stream "default" in
+		default_stream := Some s;
+		s
 
-let play_raw data = match !device with
+let check_device () =
+	match !device with
 	| None -> failwith "No audio device present"
-	| Some device -> play_to_raw device data
+	| Some device -> device
+
+(* convert from what the writer has to what the device takes *)
+let set_format ?quality s channels rate =
+	let (_, hertz, chans) = (check_device ()).format in
+	s.convert <-
+		if channels = chans && rate = hertz then None
+		else Some (resampler ?quality channels rate hertz)
+
+let play ?stream wave =
+	if wave.bits_per_sec <> 16 then
+		failwith "play: only 16-bit samples are supported";
+	let s = match stream with Some s -> s | None -> default () in
+	set_format s wave.channels wave.samples_per_sec;
+	write s wave.input
 
-let stop () = failwith "not implemented"
+let play_raw ?stream data =
+	ignore (check_device ());
+	write (match stream with Some s -> s | None -> default ()) data
 
+(* drop everything queued on every stream *)
+let stop () =
+	with_lock begin fun () ->
+		List.iter (fun s -> s.head <- 0; s.queued <- 0; s.mark <- None) !streams;
+		Condition.broadcast space
+	end
+
+let has_device () = !device <> None
+
+(* the first device to register is the one used *)
 let register_device outputDevice =
-	device := Some outputDevice
+	match outputDevice.format with
+	| _ when has_device () -> failwith "AudioMixer: an output device is already registered"
+	| (16, _, 2) ->
+		ignore (Thread.create mixer
+			(Array1.create int8_unsigned c_layout period_bytes) "mixer");
+		device := Some outputDevice
+	| _ -> failwith "AudioMixer: the mixer needs a 16-bit stereo device"
+
+(* Capture: the device hands each buffer to [deliver] from its ISR as it
+   fills. Every recorder has its own single-producer, single-consumer
+   ring; the ISR only ever advances [written] and the reader [taken], so
+   neither takes a lock. The counters run freely and may wrap, hence the
+   power-of-two ring. *)
+
+type capture = {
+	capture_format : format;
+	start : (BlockIO.t -> unit) -> unit;
+}
+
+type recorder = {
+	buffer : BlockIO.t;
+	mutable written : int;
+	mutable taken : int;
+	mutable stamp : int64; (* when the newest audio landed *)
+	mutable lost : int; (* buffers dropped because the ring was full *)
+	mutable latency : int64;
+	mutable worst : int64;
+	mutable monitor : stream option; (* playing what it reads *)
+}
+
+type capture_stats = {
+	overruns : int;
+	last_latency : int64;
+	max_latency : int64;
+	last_round_trip : int64;
+	max_round_trip : int64;
+}
+
+let capture = ref None
+let recorders = ref []
+
+(* only for sleeping in wait_capture *)
+let capture_lock = Mutex.create ()
+let captured = Condition.create ()
+
+let deliver data =
+	let n = Array1.dim data in
+	let now = clock () in
+	List.iter begin fun r ->
+		let cap = Array1.dim r.buffer in
+		if n > cap - (r.written - r.taken) then
+			r.lost <- r.lost + 1
+		else begin
+			let pos = r.written land (cap - 1) in
+			let first = min n (cap - pos) in
+			Array1.blit (Array1.sub data 0 first) (Array1.sub r.buffer pos first);
+			if n > first then
+				Array1.blit (Array1.sub data first (n - first)) (Array1.sub r.buffer 0 (n - first));
+			r.stamp <- now;
+			r.written <- r.written + n
+		end
+	end !recorders;
+	Mutex.lock capture_lock;
+	Condition.broadcast captured;
+	Mutex.unlock capture_lock
+
+let register_capture inputDevice =
+	capture := Some inputDevice
+
+let capture_format () =
+	match !capture with
+	| None -> failwith "No capture device present"
+	| Some c -> c.capture_format
+
+let open_capture ?(capacity = 64 * 1024) () =
+	match !capture with
+	| None -> failwith "No capture device present"
+	| Some c ->
+		let rec size n = if n >= capacity then n else size (n * 2) in
+		let r = {
+			buffer = Array1.create int8_unsigned c_layout (size 4096);
+			written = 0;
+			taken = 0;
+			stamp = 0L;
+			lost = 0;
+			latency = 0L;
+			worst = 0L;
+			monitor = None;
+		} in
+		let first = !recorders = [] in
+		recorders := r :: !recorders;
+		if first then c.start deliver;
+		r
+
+let close_capture r =
+	recorders := List.filter (fun r' -> r' != r) !recorders
+
+let available r = r.written - r.taken
+
+(* never blocks; whole frames only *)
+let read_capture r dst =
+	let cap = Array1.dim r.buffer in
+	let n = min (r.written - r.taken) (Array1.dim dst) land (lnot 3) in
+	let pos = r.taken land (cap - 1) in
+	let first = min n (cap - pos) in
+	Array1.blit (Array1.sub r.buffer pos first) (Array1.sub dst 0 first);
+	if n > first then
+		Array1.blit (Array1.sub r.buffer 0 (n - first)) (Array1.sub dst first (n - first));
+	if n > 0 then begin
+		let latency = Int64.sub (clock ()) r.stamp in
+		r.latency <- latency;
+		if latency > r.worst then r.worst <- latency
+	end;
+	r.taken <- r.taken + n;
+	n
+
+let wait_capture r =
+	Mutex.lock capture_lock;
+	while r.written = r.taken do
+		Condition.wait captured capture_lock
+	done;
+	Mutex.unlock capture_lock
+
+let capture_stats r =
+	let round_trip, worst = match r.monitor with
+		| Some s -> with_lock (fun () -> s.round_trip, s.worst_round_trip)
+		| None -> 0L, 0L in
+	{
+		overruns = r.lost;
+		last_latency = r.latency;
+		max_latency = r.worst;
+		last_round_trip = round_trip;
+		max_round_trip = worst;
+	}
+
+(* the newest byte queued on [s] was captured at [stamp]; one mark is
+   timed at a time *)
+let mark s stamp =
+	with_lock (fun () -> if s.mark = None then s.mark <- Some (s.played + s.queued, stamp))
+
+(* Play what is captured. The stream is kept short, so the round trip is
+   the capture buffer, at most 16KiB queued on the stream and whatever
+   the device has queued. It is timed from the ISR delivering a buffer to
+   the mixer taking its last byte for the device. *)
+let monitor ?(gain = unity_gain) () =
+	let r = open_capture () in
+	let s = open_stream ~gain ~capacity:(16 * 1024) "monitor" in
+	let (_, rate, channels) = capture_format () in
+	set_format s channels rate;
+	r.monitor <- Some s;
+	let buffer = Array1.create int8_unsigned c_layout 4096 in
+	let running = ref true in
+	ignore (Thread.create begin fun () ->
+		while !running do
+			wait_capture r;
+			let stamp = r.stamp in
+			let n = read_capture r buffer in
+			write s (BlockIO.make (Array1.sub buffer 0 n));
+			if n > 0 then mark s stamp
+		done;
+		close_capture r;
+		close_stream s
+	end () "monitor");
+	(fun () -> running := false), r
@@ -21,17 +21,137 @@ module Wave : sig
 	val read : BlockIO.input -> t
 end
 
-(*val resample : Wave.t -> int -> (unit -> int)*)
+(** Sample-rate conversion of 16-bit mono or stereo to 16-bit stereo.
+    Each output frame costs [taps] multiply-adds per channel: 2 for
+    [Linear], then 16 or 64 for the windowed sinc filters. *)
 
+type quality = Linear | Sinc16 | Sinc64
+
+(** The quality of converters made from now on (default [Sinc16]) *)
+val set_quality : quality -> unit
+
+type resampler
+
+(** [resampler channels in_rate out_rate] *)
+val resampler : ?quality:quality -> int -> int -> int -> resampler
+
+(** [resample r input emit] converts the rest of [input], passing each
+    piece of output to [emit]; the filter state carries on to the next
+    call, so a stream can be fed block by block *)
+val resample : resampler -> BlockIO.input -> (BlockIO.t -> unit) -> unit
+
+(** [render fill], when a device has it, waits for a free DMA buffer,
+    lets [fill] write into it and queues the bytes [fill] returns *)
 type output = {
 	format: format;
 	output: BlockIO.input -> unit;
+	render: ((BlockIO.t -> int) -> unit) option;
+}
+
+(** Any number of streams are mixed into the one device. Each is 16-bit
+    stereo at the device's rate, with its own gain in Q14 fixed point;
+    the sum saturates rather than wraps. *)
+
+type stream
+
+val unity_gain : int
+
+(** Bytes mixed and handed to the device at a time *)
+val period_bytes : int
+
+(** [open_stream name] adds a stream that buffers [capacity] bytes
+    (default 256KiB) *)
+val open_stream : ?gain:int -> ?capacity:int -> string -> stream
+
+(** Clamped to 0 .. 2 * [unity_gain] *)
+val set_gain : stream -> int -> unit
+
+(** Copy the rest of the input into the stream, blocking while it is
+    full; the input's buffer may be reused as soon as this returns *)
+val write : stream -> BlockIO.input -> unit
+
+(** [set_format stream channels rate] converts what is written from then
+    on, if it doesn't match the device *)
+val set_format : ?quality:quality -> stream -> int -> int -> unit
+
+(** Wait until the mixer has taken everything queued on the stream *)
+val drain : stream -> unit
+
+(** The stream leaves the mix once its queued audio has been played *)
+val close_stream : stream -> unit
+
+type stats = {
+	periods : int;
+	last_cycles : int64; (* TSC cycles to mix the last period *)
+	max_cycles : int64;
+	total_cycles : int64;
+	resample_cycles : int64; (* in all, across the converters *)
+	streams : (string * int * int) list; (* name, gain, periods starved *)
 }
 
-(* Pretty much allows for only one audio device atm *)
+val stats : unit -> stats
 
-val play : Wave.t -> unit
-val play_raw : BlockIO.input -> unit
+(** The time stamp counter, which the cycle counts above are in *)
+val clock : unit -> int64
+
+(** [play] and [play_raw] queue onto [stream], or a shared default one;
+    [play] sets the stream's format from the wave header *)
+
+val play : ?stream:stream -> Wave.t -> unit
+val play_raw : ?stream:stream -> BlockIO.input -> unit
+
+(** Discard whatever every stream has queued *)
 val stop : unit -> unit
 
+(** The first device to register is the one played through; registering
+    a second fails. Drivers probe only if [has_device] is false. *)
+val has_device : unit -> bool
 val register_device : output -> unit
+
+(** Capture, from whichever device registers for it. Each recorder gets
+    its own lock-free ring, filled from the device's ISR one DMA buffer
+    at a time. *)
+
+type capture = {
+	capture_format : format;
+	start : (BlockIO.t -> unit) -> unit; (* pass each filled buffer on *)
+}
+
+val register_capture : capture -> unit
+
+val capture_format : unit -> format
+
+type recorder
+
+(** Capture starts with the first recorder; [capacity] is rounded up to
+    a power of two (default 64KiB) *)
+val open_capture : ?capacity:int -> unit -> recorder
+val close_capture : recorder -> unit
+
+(** Bytes waiting to be read *)
+val available : recorder -> int
+
+(** [read_capture r dst] copies what is waiting, in whole frames, without
+    blocking *)
+val read_capture : recorder -> BlockIO.t -> int
+
+(** Sleep until something has been captured *)
+val wait_capture : recorder -> unit
+
+(** Latency is TSC cycles from the ISR delivering the newest buffer to
+    [read_capture] taking it. The round trip, kept only for a {!monitor}
+    recorder, is TSC cycles from the ISR delivering a buffer to the mixer
+    handing its last byte to the device. *)
+type capture_stats = {
+	overruns : int;
+	last_latency : int64;
+	max_latency : int64;
+	last_round_trip : int64;
+	max_round_trip : int64;
+}
+
+val capture_stats : recorder -> capture_stats
+
+(** Play whatever is captured, through a short stream; returns a function
+    that stops it and the recorder, for its latency and round trip *)
+val monitor : ?gain:int -> unit -> (unit -> unit) * recorder
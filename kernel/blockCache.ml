@@ -0,0 +1,438 @@
+
+(* Shared block cache: 2Q eviction, sequential read-ahead, dirty tracking *)
+
+open Bigarray
+
+let block_size = 4096
+let block_sectors = block_size / 512
+
+(* 128KiB, one bus-master transfer *)
+let max_readahead = 32
+
+type device = {
+	id : int;
+	name : string;
+	read_fn : int -> int -> BlockIO.t -> unit;
+	write_fn : (int -> int -> BlockIO.t -> unit) option;
+	flush_fn : unit -> unit;
+	mutable expected : int; (* the block just past the last miss *)
+	mutable window : int;
+}
+
+type queue = In | Main
+
+(* entries live on one of two circular lists with a sentinel head; a
+   busy entry has device I/O in flight and must be waited for *)
+type entry = {
+	mutable owner : device;
+	mutable block : int;
+	data : BlockIO.t;
+	mutable dirty : bool;
+	mutable busy : bool;
+	mutable queue : queue;
+	mutable prev : entry;
+	mutable next : entry;
+}
+
+type stats = {
+	hits : int;
+	misses : int;
+	readahead : int;
+	evictions : int;
+	writebacks : int;
+	resident : int;
+}
+
+let no_device = {
+	id = -1; name = ""; read_fn = (fun _ _ _ -> ()); write_fn = None;
+	flush_fn = ignore;
+	expected = -1; window = 1;
+}
+
+let make_entry data =
+	let rec e = {
+		owner = no_device; block = -1; data = data;
+		dirty = false; busy = false; queue = In; prev = e; next = e;
+	} in e
+
+let make_list () = make_entry (Array1.create int8_unsigned c_layout 0)
+
+let unlink e =
+	e.prev.next <- e.next;
+	e.next.prev <- e.prev;
+	e.prev <- e;
+	e.next <- e
+
+let push_front head e =
+	e.next <- head.next;
+	e.prev <- head;
+	head.next.prev <- e;
+	head.next <- e
+
+let capacity = ref 1024
+let table : (int * int, entry) Hashtbl.t = Hashtbl.create 1024
+
+(* A1in: referenced once, FIFO; Am: referenced again, LRU *)
+let a1in = make_list ()
+let a1in_count = ref 0
+let am = make_list ()
+let am_count = ref 0
+
+(* A1out: keys recently evicted from A1in, without their data. A stale
+   queue entry is one whose stamp no longer matches the table. *)
+let ghosts : (int * int, int) Hashtbl.t = Hashtbl.create 512
+let ghost_queue = Queue.create ()
+let ghost_stamp = ref 0
+
+let n_hits = ref 0
+let n_misses = ref 0
+let n_readahead = ref 0
+let n_evictions = ref 0
+let n_writebacks = ref 0
+
+let lock = Mutex.create ()
+
+let with_lock f =
+	Mutex.lock lock;
+	try
+		let r = f () in
+		Mutex.unlock lock;
+		r
+	with ex ->
+		Mutex.unlock lock;
+		raise ex
+
+(* Device I/O runs with the lock dropped, so misses from several threads
+   can be queued at the device together; [io_done] is broadcast whenever
+   an entry stops being busy *)
+let io_done = Condition.create ()
+
+let unlocked f =
+	Mutex.unlock lock;
+	let r = try f () with ex -> Mutex.lock lock; raise ex in
+	Mutex.lock lock;
+	r
+
+let wait_io () = Condition.wait io_done lock
+
+let next_id = ref 0
+let devices = ref []
+
+let register ?write ?(flush = ignore) name read =
+	incr next_id;
+	let dev = {
+		id = !next_id;
+		name = name;
+		read_fn = read;
+		write_fn = write;
+		flush_fn = flush;
+		expected = -1;
+		window = 1;
+	} in
+	devices := dev :: !devices;
+	dev
+
+let name dev = dev.name
+
+let writeback e =
+	if e.dirty then begin
+		match e.owner.write_fn with
+		| Some f ->
+			e.busy <- true;
+			let finish () =
+				e.busy <- false;
+				Condition.broadcast io_done in
+			(try unlocked (fun () -> f (e.block * block_sectors) block_sectors e.data)
+			with ex -> finish (); raise ex);
+			e.dirty <- false;
+			incr n_writebacks;
+			finish ()
+		| None ->
+			failwith ("blockcache: " ^ e.owner.name ^ " is read-only")
+	end
+
+let remember_ghost key =
+	incr ghost_stamp;
+	Hashtbl.replace ghosts key !ghost_stamp;
+	Queue.add (key, !ghost_stamp) ghost_queue;
+	while Queue.length ghost_queue > !capacity / 2 do
+		let key, stamp = Queue.take ghost_queue in
+		if (try Hashtbl.find ghosts key = stamp with Not_found -> false) then
+			Hashtbl.remove ghosts key
+	done
+
+let remove e =
+	unlink e;
+	decr (if e.queue = Main then am_count else a1in_count);
+	Hashtbl.remove table (e.owner.id, e.block)
+
+(* the least recently used entry of a list with no I/O in flight *)
+let rec idle_tail head e =
+	if e == head then None
+	else if e.busy then idle_tail head e.prev
+	else Some e
+
+(* Take an entry out of the cache: from A1in if that list is over its
+   share, else from Am. A dirty one is written back first, which drops the
+   lock, so the choice is made again afterwards. *)
+let rec evict_one () =
+	let first, second =
+		if !a1in_count > !capacity / 4 || !am_count = 0 then a1in, am else am, a1in in
+	let victim =
+		match idle_tail first first.prev with
+		| None -> idle_tail second second.prev
+		| found -> found
+	in
+	match victim with
+	| None -> wait_io (); evict_one ()
+	| Some e when e.dirty -> writeback e; evict_one ()
+	| Some e ->
+		remove e;
+		incr n_evictions;
+		if e.queue = In then remember_ghost (e.owner.id, e.block);
+		e
+
+(* an entry to reuse: a fresh one while under capacity, otherwise an
+   evicted one; may drop the lock *)
+let reclaim () =
+	if !a1in_count + !am_count < !capacity then
+		make_entry (Array1.create int8_unsigned c_layout block_size)
+	else
+		evict_one ()
+
+let insert e dev block =
+	let key = (dev.id, block) in
+	e.owner <- dev;
+	e.block <- block;
+	e.dirty <- false;
+	e.busy <- false;
+	if Hashtbl.mem ghosts key then begin
+		Hashtbl.remove ghosts key;
+		e.queue <- Main;
+		push_front am e;
+		incr am_count
+	end else begin
+		e.queue <- In;
+		push_front a1in e;
+		incr a1in_count
+	end;
+	Hashtbl.replace table key e;
+	e
+
+let touch e =
+	incr n_hits;
+	if e.queue = Main then begin
+		unlink e;
+		push_front am e
+	end
+
+let find dev block =
+	try Some (Hashtbl.find table (dev.id, block)) with Not_found -> None
+
+(* read buffers for [fill], one per read in flight *)
+let scratch_pool = ref []
+
+let take_scratch () =
+	match !scratch_pool with
+	| s :: rest -> scratch_pool := rest; s
+	| [] -> Array1.create int8_unsigned c_layout (block_size * max_readahead)
+
+let give_scratch s = scratch_pool := s :: !scratch_pool
+
+(* Read [block] and, if this miss continues the previous run, the blocks
+   after it too. The window doubles on every sequential miss and drops
+   back to one block otherwise. The blocks sit in the table, busy, while
+   the read is out, so other misses on them wait instead of reading them
+   again. None if another thread brought [block] in meanwhile. *)
+let fill dev block =
+	let absent n = not (Hashtbl.mem table (dev.id, block + n)) in
+	let rec run limit n = if n < limit && absent n then run limit (n + 1) else n in
+	let window =
+		if block = dev.expected then min max_readahead (dev.window * 2) else 1 in
+	(* reclaiming can drop the lock, so look at the table again afterwards *)
+	let spare = Array.init (run window 1) (fun _ -> reclaim ()) in
+	if not (absent 0) then None else begin
+		incr n_misses;
+		dev.window <- window;
+		let n = run (Array.length spare) 1 in
+		dev.expected <- block + n;
+		(* insert backwards so the demanded block is the newest *)
+		for i = n - 1 downto 0 do
+			(insert spare.(i) dev (block + i)).busy <- true
+		done;
+		let scratch = take_scratch () in
+		let finish got =
+			for i = 0 to n - 1 do
+				let e = spare.(i) in
+				if i < got then
+					Array1.blit (Array1.sub scratch (i * block_size) block_size) e.data
+				else
+					remove e;
+				e.busy <- false
+			done;
+			give_scratch scratch;
+			Condition.broadcast io_done
+		in
+		let read count = dev.read_fn (block * block_sectors) (count * block_sectors) scratch in
+		let got =
+			try
+				unlocked begin fun () ->
+					try read n; n
+					with _ when n > 1 ->
+						(* most likely ran off the end of the device *)
+						read 1; 1
+				end
+			with ex -> finish 0; raise ex
+		in
+		finish got;
+		dev.expected <- block + got;
+		n_readahead := !n_readahead + got - 1;
+		Some spare.(0)
+	end
+
+let rec lookup dev block =
+	match find dev block with
+	| Some e when e.busy -> wait_io (); lookup dev block
+	| Some e -> touch e; e
+	| None ->
+		match fill dev block with
+		| Some e -> e
+		| None -> lookup dev block
+
+let set_capacity n =
+	with_lock begin fun () ->
+		capacity := max n (4 * max_readahead);
+		while !a1in_count + !am_count > !capacity do
+			ignore (evict_one ())
+		done
+	end
+
+(* [copy e off n pos] for each piece of [len] bytes from byte [ofs] of
+   [block]; the offset may run past the block *)
+let copy_out dev block ofs len copy =
+	with_lock begin fun () ->
+		let rec loop block off pos len =
+			if len > 0 then begin
+				let n = min len (block_size - off) in
+				copy (lookup dev block) off n pos;
+				loop (block + 1) 0 (pos + n) (len - n)
+			end
+		in loop (block + ofs / block_size) (ofs mod block_size) 0 len
+	end
+
+let read_bytes dev ofs buf pos len =
+	copy_out dev 0 ofs len (fun e off n p ->
+		Array1.blit_to_string (Array1.sub e.data off n) buf (pos + p))
+
+let blit dev sector ofs dst =
+	let ofs = (sector mod block_sectors) * 512 + ofs in
+	copy_out dev (sector / block_sectors) ofs (Array1.dim dst) (fun e off n p ->
+		Array1.blit (Array1.sub e.data off n) (Array1.sub dst p n))
+
+let read dev sector count =
+	let data = String.create (512 * count) in
+	read_bytes dev (512 * sector) data 0 (512 * count);
+	data
+
+let get_byte dev ofs =
+	with_lock (fun () -> (lookup dev (ofs / block_size)).data.{ofs mod block_size})
+
+let entries dev =
+	Hashtbl.fold (fun (id, _) e acc -> if id = dev.id then e :: acc else acc) table []
+
+(* Dirty blocks go out in block order. Each write drops the lock, so an
+   entry may have been written back or reused by the time its turn comes;
+   those are skipped. *)
+let flush dev =
+	let wrote =
+		with_lock begin fun () ->
+			let dirty = List.filter (fun e -> e.dirty) (entries dev) in
+			let dirty = List.map (fun e -> (e, e.block))
+				(List.sort (fun a b -> compare a.block b.block) dirty) in
+			List.iter (fun (e, block) ->
+				while e.busy do wait_io () done;
+				if e.owner == dev && e.block = block then writeback e) dirty;
+			dirty <> []
+		end
+	in
+	if wrote then dev.flush_fn ()
+
+(* Periodic write-back: dirty blocks reach the disk within one interval
+   even if nothing evicts or flushes them *)
+
+let flush_interval = ref 50_000
+
+let set_flush_interval ticks = flush_interval := max 1 ticks
+
+(* Set by [write] when it dirties a block; the flusher sleeps on [dirtied]
+   until then, so an idle cache leaves the CPU idle *)
+let pending = ref false
+let dirtied = Condition.create ()
+
+let rec flusher () =
+	with_lock (fun () ->
+		while not !pending do Condition.wait dirtied lock done;
+		pending := false);
+	Thread.usleep !flush_interval;
+	List.iter (fun dev ->
+		if dev.write_fn <> None then
+			try flush dev with ex ->
+				Vt100.printf "blockcache: flushing %s: %s\n" dev.name (Printexc.to_string ex))
+		!devices;
+	flusher ()
+
+let flusher_thread = ref None
+
+let start_flusher () =
+	if !flusher_thread = None then
+		flusher_thread := Some (Thread.create flusher () "blockcache")
+
+let write dev sector count data =
+	if String.length data < 512 * count then invalid_arg "BlockCache.write";
+	start_flusher ();
+	with_lock begin fun () ->
+		let rec loop ofs pos len =
+			if len > 0 then begin
+				let block = ofs / block_size in
+				let off = ofs mod block_size in
+				let n = min len (block_size - off) in
+				(* a whole block doesn't need its old contents read first *)
+				let e =
+					if n < block_size then lookup dev block
+					else match find dev block with
+						| Some e when not e.busy -> touch e; e
+						| Some _ -> lookup dev block
+						| None ->
+							let e = reclaim () in
+							(* reclaiming may have let a reader bring it in *)
+							if find dev block <> None then lookup dev block
+							else (incr n_misses; insert e dev block)
+				in
+				Array1.blit_from_string (String.sub data pos n) (Array1.sub e.data off n);
+				e.dirty <- true;
+				if not !pending then begin
+					pending := true;
+					Condition.signal dirtied
+				end;
+				loop (ofs + n) (pos + n) (len - n)
+			end
+		in loop (512 * sector) 0 (512 * count)
+	end
+
+let invalidate dev =
+	flush dev;
+	with_lock begin fun () ->
+		while List.exists (fun e -> e.busy) (entries dev) do wait_io () done;
+		List.iter remove (entries dev);
+		dev.expected <- -1;
+		dev.window <- 1
+	end
+
+let stats () = {
+	hits = !n_hits;
+	misses = !n_misses;
+	readahead = !n_readahead;
+	evictions = !n_evictions;
+	writebacks = !n_writebacks;
+	resident = !a1in_count + !am_count;
+}
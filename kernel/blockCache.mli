@@ -0,0 +1,74 @@
+
+(* Shared block cache for disk-like devices *)
+
+(** Sectors are cached in 4KiB blocks keyed by (device, block). Eviction
+    is 2Q: blocks seen once sit in a short FIFO and only move to the main
+    LRU list when they are referenced again after falling out of it, so a
+    long sequential scan can't flush the working set. A miss that follows
+    on from the previous one reads ahead, doubling the window up to
+    [max_readahead] blocks in a single device command. The cache lock is
+    not held across device I/O, so misses from different threads reach
+    the device together; blocks being read or written back are marked
+    in flight and anyone else who wants them waits. *)
+
+type device
+
+val block_size : int
+val block_sectors : int
+val max_readahead : int
+
+(** [register name read] adds a device whose [read sector count buf]
+    fills the start of [buf] with [count] 512-byte sectors. Without
+    [write] the device is read-only and {!flush} of dirty blocks fails.
+    [flush] is called after {!flush} has written blocks back, to make
+    them durable. *)
+val register :
+	?write:(int -> int -> BlockIO.t -> unit) ->
+	?flush:(unit -> unit) ->
+	string -> (int -> int -> BlockIO.t -> unit) -> device
+
+val name : device -> string
+
+(** Resize the cache, in blocks (default 1024, i.e. 4MiB) *)
+val set_capacity : int -> unit
+
+(** [read dev sector count] returns [count] sectors, like [IDE.read_disk] *)
+val read : device -> int -> int -> string
+
+(** [read_bytes dev ofs buf pos len] copies [len] bytes starting at byte
+    offset [ofs] on the device into [buf] at [pos] *)
+val read_bytes : device -> int -> string -> int -> int -> unit
+
+(** [blit dev sector ofs buf] fills [buf] from byte [ofs] past [sector],
+    without going through a string *)
+val blit : device -> int -> int -> BlockIO.t -> unit
+
+(** The byte at byte offset [ofs] on the device *)
+val get_byte : device -> int -> int
+
+(** [write dev sector count data] updates the cache and marks the blocks
+    dirty; nothing reaches the device until {!flush}, eviction or the
+    next periodic write-back. *)
+val write : device -> int -> int -> string -> unit
+
+(** Write back the device's dirty blocks in block order *)
+val flush : device -> unit
+
+(** How often, in [Thread.usleep] ticks, a background thread flushes
+    every writable device. It starts with the first {!write} and sleeps
+    while no block is dirty. *)
+val set_flush_interval : int -> unit
+
+(** Drop every clean block of the device (dirty ones are written first) *)
+val invalidate : device -> unit
+
+type stats = {
+	hits : int;
+	misses : int;
+	readahead : int; (* blocks brought in ahead of a demand miss *)
+	evictions : int;
+	writebacks : int;
+	resident : int;
+}
+
+val stats : unit -> stats
@@ -71,3 +71,16 @@ let make_io input = IO.from_in_chars (object
 			char_of_int input.data.{input.pos - 1}
 		method close_in () = ()
 	end)
+
+(* Vfs can't name the bigarray type; these cross over *)
+external of_vfs : Vfs.bigarray -> t = "%identity"
+external to_vfs : t -> Vfs.bigarray = "%identity"
+
+(* [input_channel ic dst ofs len] reads up to [len] bytes from [ic]
+   straight into [dst], for channels on file systems that support it *)
+let input_channel (ic : in_channel) dst ofs len =
+	let ic : Vfs.io_channel = Obj.magic ic in
+	Vfs.input_bigarray ic (to_vfs dst) ofs len
+
+(* [map name] is a whole file as one array, to be treated as read-only *)
+let map name = of_vfs (Vfs.map name)
@@ -19,3 +19,14 @@ val blit : input -> t -> unit
 val blit_from_string : string -> input -> unit
 
 val make_io : input -> IO.input
+
+external of_vfs : Vfs.bigarray -> t = "%identity"
+external to_vfs : t -> Vfs.bigarray = "%identity"
+
+(** [input_channel ic dst ofs len] reads up to [len] bytes from [ic]
+    straight into [dst] at [ofs]; 0 at end of file *)
+val input_channel : in_channel -> t -> int -> int -> int
+
+(** [map name] is the whole of a file as one array, to be treated as
+    read-only; see [Vfs.map] *)
+val map : string -> t
@@ -115,22 +115,43 @@ type dir_entry = {
 	inode : int32;
 }
 
+(* free counts as they stand now; the descriptors in [t] are as mounted *)
+type group = {
+	mutable g_free_blocks : int;
+	mutable g_free_inodes : int;
+	mutable g_used_dirs : int;
+}
+
 type t = {
 	p : Partitions.partition_t;
 	s : superblock;
 	t : block_group_descriptor array;
 	r : inode;
 	bs : int;
+	indirect : (int, int array) Hashtbl.t; (* decoded indirect blocks *)
+	id : int; (* tells file systems apart in the dentry cache *)
+	groups : group array;
+	mutable free_blocks : int;
+	mutable free_inodes : int;
+	wlock : Mutex.t; (* one writer at a time *)
 }
 
 type fs = {
 	metadata : t;
 	read_dir : inode -> dir_entry list;
 	read_inode : int32 -> inode;
+	lookup : int32 -> string -> int32;
+	resolve : int32 -> string -> int32;
 	read_file : inode -> string;
 	read_file_ba : inode -> (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t;
 	read_file_range_ba : inode -> int -> int -> (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t;
 	read_file_range_with_buffer : inode -> (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t -> int -> int;
+	(* [create_file dir name] makes an empty file and returns its inode number *)
+	create_file : int32 -> string -> int32;
+	append_file : int32 -> string -> unit;
+	truncate_file : int32 -> int -> unit;
+	unlink : int32 -> string -> unit;
+	sync : unit -> unit;
 }
 
 (* IO helper function *)
@@ -291,25 +312,31 @@ let null_inode = {
 		i_osd2 = [];
 	}
 
-let inode fs x =
+let inode_size fs =
+	if fs.s.s_rev_level >= 1 (* ext2_dynamic_rev *)
+	then fs.s.s_inode_size
+	else 128
+
+(* the sector holding inode [x] and its byte offset within it *)
+let inode_location fs x =
 	let x = Int32.to_int x in (* maybe it doesn't have to be an int32 afterall... *)
 	let block_group = (x - 1) / fs.s.s_inodes_per_group in
 	let inode_index = (x - 1) mod fs.s.s_inodes_per_group in
 	let descr = fs.t.(block_group) in
 	(*Vt100.printf "#%ld, group %d, index %d, inodes per group %d, inode_table %d\n"
 		z block_group inode_index s.s_inodes_per_group descr.bg_inode_table;*)
-	let inode_size =
-		if fs.s.s_rev_level >= 1 (* ext2_dynamic_rev *)
-		then fs.s.s_inode_size
-		else 128 in
+	let inode_size = inode_size fs in
 	(* bg_inode_table is the first block of the inode table *)
 	let sector = descr.bg_inode_table lsl (fs.s.s_log_block_size + 1) in
 	let sector = sector + ((inode_index * inode_size) / 512) in
 	(*Vt100.printf "inode %d located at offset %d, block group = %d, inode index = %d\n" x sector block_group inode_index;
 	Vt100.printf "inode table = %x, block size = %d (log = %d), inode_size = %d\n" descr.bg_inode_table (1024 lsl s.s_log_block_size) s.s_log_block_size inode_size;*)
+	sector, (inode_index * inode_size) mod 512
+
+let inode fs x =
+	let sector, offset = inode_location fs x in
 	(* an inode always fits within a sector, so it works okay *)
 	let sector = fs.p.read sector 1 in
-	let offset = (inode_index * inode_size) mod 512 in
 	let i = IO.input_string sector in
 	(*let read_i32 x = Vt100.printf "x"; read_i32 x in*)
 	ignore (read_bytes i offset);
@@ -334,371 +361,735 @@ let inode fs x =
 		i_osd2 = read_bytes i 12;
 	}
 
-let readdir fs inode =
-	let block_size = 1024 lsl fs.s.s_log_block_size in (* not using this as yet *)
-	(*let inode_size = ref inode.i_size in*)
-	(*Vt100.printf "block size: %d, inode size: %d, iterations: %d\n"
-		block_size !inode_size (!inode_size / block_size);*)
-	(* copy the data into the buffer *)
-	let buffer = fs.p.read (to_sector fs.s inode.i_block.(0)) (2 lsl fs.s.s_log_block_size) in
-	let i, o = IO.pipe () in
-	(*let n = ref 1 in (* unused *)*)
-	(* fill buffer *)
-	IO.nwrite o buffer;
-	let total_length = ref 0 in
-	let rec loop acc =
-		let entry = {
-			inode = read_real_i32 i;
-			rec_len = read_i16 i;
-			name_len = read_byte i;
-			file_type = read_byte i;
-			name = "";
-		} in
-		total_length := !total_length + entry.rec_len;
-		let entry = { entry with name = ExtString.String.implode (List.map Char.chr (read_bytes i entry.name_len)) } in
-		(*Vt100.printf "dir_entry: inode = %ld, rec_len = %d, name_len = %d, file_type = %d, name = %s\n"
-			entry.inode entry.rec_len entry.name_len entry.file_type entry.name;*)
-		if !total_length >= block_size then begin
-			(* this record is pointing to the next block *)
-			(*if inode.i_block.(!n) = 0 then begin
-				(* we're finished *)
-				List.rev (entry :: acc)
-			end else begin
-				(* we have another block to read *)
-				total_length := 0;
-				ignore (IO.read_all i); (* consume remaining input we can discard *)
-				IO.write_string o (p.read (to_sector s inode.i_block.(!n)) (2 lsl s.s_log_block_size));
-				incr n;
-				loop (entry :: acc)
-			end*)List.rev (entry :: acc)
+(* Block mapping. Indirect blocks are decoded once into int arrays and
+   kept, keyed by their block number, so walking a file touches each one
+   a single time instead of once per data block. *)
+
+let le32 s i =
+	Char.code s.[i] lor (Char.code s.[i + 1] lsl 8)
+	lor (Char.code s.[i + 2] lsl 16) lor (Char.code s.[i + 3] lsl 24)
+
+let indirect_cache_limit = 256
+
+let indirect fs block =
+	try Hashtbl.find fs.indirect block
+	with Not_found ->
+		let raw = fs.p.read (to_sector fs.s block) (fs.bs / 512) in
+		let entries = Array.init (fs.bs / 4) (fun i -> le32 raw (4 * i)) in
+		if Hashtbl.length fs.indirect >= indirect_cache_limit then
+			Hashtbl.clear fs.indirect;
+		Hashtbl.add fs.indirect block entries;
+		entries
+
+(* the disk block holding logical block [n] of the file, 0 for a hole *)
+let map_block fs inode n =
+	let per = fs.bs / 4 in
+	let follow block i = if block = 0 then 0 else (indirect fs block).(i) in
+	if n < 12 then inode.i_block.(n)
+	else let n = n - 12 in
+	if n < per then follow inode.i_block.(12) n
+	else let n = n - per in
+	if n < per * per then
+		follow (follow inode.i_block.(13) (n / per)) (n mod per)
+	else let n = n - per * per in
+	follow (follow (follow inode.i_block.(14) (n / (per * per))) (n / per mod per)) (n mod per)
+
+(* [f disk logical count] for each run of logical blocks [first,
+   first+count) that is contiguous on disk; holes come through with a
+   disk block of 0 *)
+let iter_runs fs inode first count f =
+	let rec loop n start disk len =
+		if n = first + count then begin
+			if len > 0 then f disk start len
 		end else begin
-			(* need to actually read the padding... *)
-			(*Vt100.printf "skipping %dbytes of padding...\n"
-				(entry.rec_len - 8 - String.length entry.name);*)
-			ignore (read_bytes i (entry.rec_len - 8 - String.length entry.name));
-			loop (entry :: acc)
+			let b = map_block fs inode n in
+			if len > 0 && ((disk = 0 && b = 0) || (disk <> 0 && b = disk + len)) then
+				loop (n + 1) start disk (len + 1)
+			else begin
+				if len > 0 then f disk start len;
+				loop (n + 1) n b 1
+			end
 		end
-	in loop []
+	in loop first first 0 0
 
-let readfile fs inode =
-	(* just read the first 8 blocks *)
-	let indirect_entries = (1024 lsl fs.s.s_log_block_size) / 4 in
-	let num_sectors = 2 lsl fs.s.s_log_block_size in
-	let read ofs = fs.p.read (to_sector fs.s ofs) num_sectors in
-	let o = IO.output_string () in
-	for i = 0 to 11 do
-		if inode.i_block.(i) <> 0 then begin
-			(* we have some data! *)
-			IO.nwrite o (read inode.i_block.(i));
-		end;
-	done;
-	if inode.i_block.(12) <> 0 then begin
-		(* need to start reading data from indirect blocks... *)
-		let i2 = IO.input_string (read inode.i_block.(12)) in
-		for i = 0 to (1024 lsl fs.s.s_log_block_size) / 4 - 1 do
-			let x = IO.read_i32 i2 in
-			if x <> 0 then begin
-				IO.nwrite o (read x);
-			end
-		done;
-	end;
-	if inode.i_block.(13) <> 0 then begin
-		(* need to read doubly-indirect blocks... fun... *)
-		let i3 = IO.input_string (read inode.i_block.(13)) in
-		(* just do first one *)
-		for i = 0 to indirect_entries / 8 - 1 do
-			let x = IO.read_i32 i3 in
-			if x <> 0 then begin
-				let i4 = IO.input_string (read x) in
-				for i = 0 to indirect_entries - 1 do
-					let y = IO.read_i32 i4 in
-					if y <> 0 then begin
-						IO.nwrite o (read y);
-					end;
-				done;
-			end;
-		done;
+(* read from byte [ofs] of the file straight into [dst]; returns the
+   number of bytes read, which is short only at the end of the file *)
+let read_into fs inode ofs dst =
+	let bs = fs.bs in
+	let len = max 0 (min (inode.i_size - ofs) (Bigarray.Array1.dim dst)) in
+	if len > 0 then begin
+		let first = ofs / bs in
+		let last = (ofs + len - 1) / bs in
+		iter_runs fs inode first (last - first + 1) (fun disk logical count ->
+			let lo = max ofs (logical * bs) in
+			let hi = min (ofs + len) ((logical + count) * bs) in
+			let part = Bigarray.Array1.sub dst (lo - ofs) (hi - lo) in
+			if disk = 0 then
+				Bigarray.Array1.fill part 0
+			else
+				fs.p.blit (to_sector fs.s disk) (lo - logical * bs) part)
 	end;
-	let s = IO.close_out o in
-	Vt100.printf "ext2fs: read %d bytes from disk\n" (String.length s);
-	String.sub s 0 (min inode.i_size (String.length s))
-
-let loop_until limit f =
-	let rec loop n =
-		if n = limit then
-			()
+	len
+
+let read_file_range_ba fs inode ofs len =
+	let len = max 0 (min (inode.i_size - ofs) len) in
+	let ba = Bigarray.Array1.create Bigarray.int8_unsigned Bigarray.c_layout len in
+	ignore (read_into fs inode ofs ba);
+	ba
+
+let read_file_range_with_buffer fs inode ba ofs =
+	read_into fs inode ofs ba
+
+let readfile_ba fs inode =
+	read_file_range_ba fs inode 0 inode.i_size
+
+let readfile fs inode =
+	Bigarray.Array1.to_string (readfile_ba fs inode)
+
+(* Directories *)
+
+let le16 s i = Char.code s.[i] lor (Char.code s.[i + 1] lsl 8)
+
+let le32l s i =
+	Int32.logor (Int32.of_int (le16 s i)) (Int32.shift_left (Int32.of_int (le16 s (i + 2))) 16)
+
+(* fold over the live entries in [data]; inode 0 marks an unused slot,
+   which is also how htree index blocks hide from plain readers *)
+let fold_entries f data acc =
+	let rec loop ofs acc =
+		if ofs + 8 > String.length data then acc
 		else begin
-			if f n then loop (n+1) else ()
+			let rec_len = le16 data (ofs + 4) in
+			let name_len = Char.code data.[ofs + 6] in
+			if rec_len < 8 || ofs + 8 + name_len > String.length data then acc
+			else begin
+				let inode = le32l data ofs in
+				let acc =
+					if inode = 0l then acc
+					else f {
+						inode = inode;
+						rec_len = rec_len;
+						name_len = name_len;
+						file_type = Char.code data.[ofs + 7];
+						name = String.sub data (ofs + 8) name_len;
+					} acc
+				in loop (ofs + rec_len) acc
+			end
 		end
-	in loop 0
+	in loop 0 acc
+
+let readdir fs inode =
+	List.rev (fold_entries (fun e acc -> e :: acc) (readfile fs inode) [])
 
-type blockIndex
-	= Direct of int
-	| Indirect of int
-	| DoubleIndirect of int * int
-	| TripleIndirect of int * int * int
+let dir_block fs inode n =
+	let ba = Bigarray.Array1.create Bigarray.int8_unsigned Bigarray.c_layout fs.bs in
+	ignore (read_into fs inode (n * fs.bs) ba);
+	Bigarray.Array1.to_string ba
 
-let divmod x y = (x / y, x mod y)
+let find_in data name =
+	fold_entries (fun e acc -> if e.name = name then Some e.inode else acc) data None
 
-let read_file_range_ba fs inode ofs len =
-	(* trim len to inode.i_size *)
-	let len = min (inode.i_size - ofs) len in
-	(* some "constants", should be already calculated .... *)
-	let indirect_entries = (1024 lsl fs.s.s_log_block_size) / 4 in
-	let num_sectors = 2 lsl fs.s.s_log_block_size in
-	let block_size = 1024 lsl fs.s.s_log_block_size in
-	(* read a "block" from disk *)
-	let read ofs = fs.p.read (to_sector fs.s ofs) num_sectors in
-	(* the bigarray "buffer", note padding added; we'll extract sub-array at the end *)
-	let ba = Bigarray.Array1.create Bigarray.int8_unsigned Bigarray.c_layout (len + block_size + block_size) in
-	(* writing function and bookkeeping *)
-	let pos = ref 0 in
-	let write ofs =
-		(* get the disk data *)
-		let data = read ofs in
-		let len = if inode.i_size - !pos < block_size
-			then inode.i_size - !pos
-			else block_size
+(* htree (dir_index) lookup. Block 0 of an indexed directory holds "."
+   and "..", then the root info and a sorted array of (hash, block)
+   pairs; each indirect level is another such array. Hashes are compared
+   unsigned, and bit 0 of an index hash says the run of equal hashes
+   carries on into the next leaf. *)
+
+let ext2_index_fl = 0x1000l
+let feature_dir_index = 0x20l
+let flag_unsigned_hash = 0x2
+
+external dx_hash : string -> int -> string -> int32 = "snowflake_ext2_dx_hash"
+
+let ucompare a b = compare (Int32.logxor a Int32.min_int) (Int32.logxor b Int32.min_int)
+
+let indexed fs inode =
+	Int32.logand fs.s.s_feature_compat feature_dir_index <> 0l
+	&& Int32.logand inode.i_flags ext2_index_fl <> 0l
+
+let hash_seed fs =
+	let seed = String.create 16 in
+	ignore (List.fold_left (fun i b -> seed.[i] <- Char.chr b; i + 1) 0 fs.s.hash_seed);
+	seed
+
+(* s_flags sits 88 bytes into the tail kept as reserved_3 *)
+let hash_version fs root_version =
+	if root_version <= 2 && List.nth fs.s.reserved_3 88 land flag_unsigned_hash <> 0
+		then root_version + 3
+		else root_version
+
+exception Not_indexed
+
+let dx_lookup fs inode name =
+	let root = dir_block fs inode 0 in
+	let info_length = Char.code root.[0x1D] in
+	let levels = Char.code root.[0x1E] in
+	if info_length <> 8 || levels > 2 then raise Not_indexed;
+	let hash = dx_hash name (hash_version fs (Char.code root.[0x1C])) (hash_seed fs) in
+	(* the last entry whose hash is <= ours; entry 0 has an implied hash of 0 *)
+	let search node ofs =
+		let count = le16 node (ofs + 2) in
+		let entry_hash i = le32l node (ofs + 8 * i) in
+		let rec bsearch lo hi =
+			if lo >= hi then lo
+			else
+				let mid = (lo + hi + 1) / 2 in
+				if ucompare (entry_hash mid) hash <= 0 then bsearch mid hi else bsearch lo (mid - 1)
 		in
-		begin try
-			Bigarray.Array1.blit_from_string
-				(if len = block_size then data else String.sub data 0 len)
-				(Bigarray.Array1.sub ba !pos len);
-		with exn ->
-			(* print a debugging message for why we failed *)
-			Vt100.printf "ext2fs fail: pos = %d, block size = %d, len = %d, total len = %d\n"
-				!pos block_size len inode.i_size;
-			raise exn;
-		end;
-		(* update bookkeeping *)
-		pos := !pos + len;
+		let i = bsearch 0 (count - 1) in
+		let block i = Int32.to_int (Int32.logand (le32l node (ofs + 8 * i + 4)) 0x00FF_FFFFl) in
+		let continues i =
+			i < count && Int32.logand (entry_hash i) (-2l) = hash
+			&& Int32.logand (entry_hash i) 1l <> 0l in
+		block, continues, i
 	in
-	(* calculate the block ranges (in bytes) *)
-	let direct_range = block_size * 12 in
-	let indirect_range = block_size * block_size / 4 in
-	let doubly_indirect_range = block_size * block_size * block_size / 16 in
-	let triply_indirect_range = block_size * block_size * block_size * block_size / 64 in
-	(* and map a block into an index *)
-	let block_to_block_indices = function
-		| n when n < 12 ->
-			n, Direct n
-		| n when (n - 12) < (block_size / 4) ->
-			n, Indirect (n - 12)
-		| n when (n - 12 - block_size / 4) < (block_size * block_size / 16) ->
-			let n1, n2 = divmod (n - 12 - block_size / 4) (block_size / 4) in
-			n, DoubleIndirect (n1, n2)
-		| n when (n - 12) < (block_size / 64 * block_size) ->
-			let n1, r = divmod (n - 12) (block_size / 4) in
-			let n2, n3 = divmod r (block_size / 4) in
-			n, TripleIndirect (n1, n2, n3)
-		| n ->
-			Vt100.printf "byte_to_block_indices: n = %d (%d, %d, %d, %d)\n" n
-				direct_range indirect_range doubly_indirect_range triply_indirect_range;
-			failwith "ext2fs: file too big"
+	let rec descend node ofs level =
+		let block, continues, i = search node ofs in
+		if level = 0 then begin
+			let rec scan i =
+				match find_in (dir_block fs inode (block i)) name with
+				| Some ino -> ino
+				| None -> if continues (i + 1) then scan (i + 1) else raise Not_found
+			in scan i
+		end else
+			descend (dir_block fs inode (block i)) 8 (level - 1)
 	in
-	(* find the start and end block indices *)
-	let start = block_to_block_indices (ofs / block_size) in
-	let finish = block_to_block_indices ((ofs + len + block_size) / block_size) in
-	(* now we need a reading loop (and probably a cache) *)
-	let rec read_loop = function
-		| _, blk when blk = snd finish -> (* we're done I guess *) ()
-		| x, Direct n ->
-			if inode.i_block.(n) <> 0 then begin
-				write inode.i_block.(n);
-				read_loop (block_to_block_indices (x + 1))
-			end
-		| x, Indirect n ->
-			(* now what...? :P *)
-			let s = read inode.i_block.(12) in (* the indirect block *)
-			let inp = IO.input_string (String.sub s (n * 4) 4) in (* only the block we want *)
-			let block = IO.read_i32 inp in
-			if block <> 0 then begin
-				write block;
-				read_loop (block_to_block_indices (x + 1))
-			end
-		| x, DoubleIndirect (n, o) ->
-			let s1 = read inode.i_block.(13) in (* the first indirect block *)
-			let inp = IO.input_string (String.sub s1 (n * 4) 4) in
-			let s2 = read (IO.read_i32 inp) in
-			let inp = IO.input_string (String.sub s2 (o * 4) 4) in
-			let block = IO.read_i32 inp in
-			if block <> 0 then begin
-				write block;
-				read_loop (block_to_block_indices (x + 1))
-			end
-		| x, TripleIndirect (n, o, p) ->
-			let s1 = read inode.i_block.(14) in (* first indirect block *)
-			let inp = IO.input_string (String.sub s1 (n * 4) 4) in
-			let s2 = read (IO.read_i32 inp) in (* second indirect block *)
-			let inp = IO.input_string (String.sub s2 (o * 4) 4) in
-			let s3 = read (IO.read_i32 inp) in (* third indirect block *)
-			let inp = IO.input_string (String.sub s3 (p * 4) 4) in
-			let block = IO.read_i32 inp in
-			if block <> 0 then begin
-				write block;
-				read_loop (block_to_block_indices (x + 1))
-			end
-		| _ -> failwith "ext2fs: reading loop failed"
-	in
-	(* do the reading... *)
-	read_loop start;
-	(* return the trimmed bigarray result *)
-	Bigarray.Array1.sub ba (ofs mod block_size) len
+	descend root (0x18 + info_length) levels
 
-let read_file_range_with_buffer fs inode ba ofs =
-	(* trim len to inode.i_size *)
-	let len = min (inode.i_size - ofs) (Bigarray.Array1.dim ba) in
-	(* some "constants", should be already calculated .... *)
-	let indirect_entries = (1024 lsl fs.s.s_log_block_size) / 4 in
-	let num_sectors = 2 lsl fs.s.s_log_block_size in
-	let block_size = 1024 lsl fs.s.s_log_block_size in
-	(* read a "block" from disk *)
-	let read ofs = fs.p.read (to_sector fs.s ofs) num_sectors in
-	(* writing function and bookkeeping *)
-	let pos = ref 0 in
-	let write ofs =
-		(* get the disk data *)
-		let data = read ofs in
-		let len = if inode.i_size - !pos < block_size
-			then inode.i_size - !pos
-			else block_size
+let linear_lookup fs inode name =
+	match find_in (readfile fs inode) name with
+	| Some ino -> ino
+	| None -> raise Not_found
+
+(* Dentry cache: (file system, directory inode, name) to the inode it
+   names, or to None when it names nothing. *)
+
+let dentries : (int * int32 * string, int32 option) Hashtbl.t = Hashtbl.create 1024
+let dentry_limit = 4096
+
+let lookup fs dir name =
+	let key = (fs.id, dir, name) in
+	let cached = try Some (Hashtbl.find dentries key) with Not_found -> None in
+	match cached with
+	| Some (Some ino) -> ino
+	| Some None -> raise Not_found
+	| None ->
+		let inode = inode fs dir in
+		let result =
+			try
+				Some (if indexed fs inode
+					then (try dx_lookup fs inode name with Not_indexed -> linear_lookup fs inode name)
+					else linear_lookup fs inode name)
+			with Not_found -> None
 		in
-		begin try
-			Bigarray.Array1.blit_from_string
-				(if len = block_size then data else String.sub data 0 len)
-				(Bigarray.Array1.sub ba !pos len);
-		with exn ->
-			(* print a debugging message for why we failed *)
-			Vt100.printf "ext2fs fail: pos = %d, block size = %d, len = %d, total len = %d\n"
-				!pos block_size len inode.i_size;
-			raise exn;
-		end;
-		(* update bookkeeping *)
-		pos := !pos + len;
+		if Hashtbl.length dentries >= dentry_limit then Hashtbl.clear dentries;
+		Hashtbl.add dentries key result;
+		match result with
+		| Some ino -> ino
+		| None -> raise Not_found
+
+(* walk a slash-separated path from [dir]; a leading slash starts at the root *)
+let resolve fs dir path =
+	let start = if String.length path > 0 && path.[0] = '/' then 2l else dir in
+	List.fold_left (fun dir name -> if name = "" then dir else lookup fs dir name)
+		start (ExtString.String.nsplit path "/")
+
+(* Writing. Everything goes through the partition's read and write, so
+   with a cached device it lands in the block cache and reaches the disk
+   on the next periodic or explicit flush. Bitmaps, descriptors and the
+   superblock are patched in place with read-modify-write; the per-group
+   free counts are kept in [fs.groups] so the allocator can skip full
+   groups without reading their bitmaps. *)
+
+let put_le16 s i v =
+	s.[i] <- Char.unsafe_chr (v land 0xFF);
+	s.[i + 1] <- Char.unsafe_chr ((v lsr 8) land 0xFF)
+
+let put_le32 s i v =
+	put_le16 s i (v land 0xFFFF);
+	put_le16 s (i + 2) ((v lsr 16) land 0xFFFF)
+
+let put_le32l s i v =
+	put_le16 s i (Int32.to_int (Int32.logand v 0xFFFFl));
+	put_le16 s (i + 2) (Int32.to_int (Int32.shift_right_logical v 16))
+
+let update_sectors fs sector count f =
+	let data = fs.p.read sector count in
+	f data;
+	fs.p.write sector count data
+
+let with_wlock fs f =
+	Mutex.lock fs.wlock;
+	try
+		let r = f () in
+		Mutex.unlock fs.wlock;
+		r
+	with ex ->
+		Mutex.unlock fs.wlock;
+		raise ex
+
+let now () = Int64.to_int32 (Time.unix_time ())
+
+let format_bits = function
+	| Socket -> 0xC000
+	| Symlink -> 0xA000
+	| File -> 0x8000
+	| Block_device -> 0x6000
+	| Directory -> 0x4000
+	| Char_device -> 0x2000
+	| FIFO -> 0x1000
+	| Unknown -> 0
+
+(* the inverse of [inode]; the setuid, setgid and sticky bits that
+   [to_imode] drops are kept from what is on disk. [fresh] clears the
+   whole slot first, for a newly allocated inode. *)
+let write_inode ?(fresh = false) fs x inode =
+	let sector, o = inode_location fs x in
+	update_sectors fs sector 1 (fun d ->
+		let special = le16 d o land 0xE00 in
+		if fresh then String.fill d o (inode_size fs) '\000';
+		let format, rights = inode.i_mode in
+		put_le16 d o (format_bits format lor rights lor (if fresh then 0 else special));
+		put_le16 d (o + 2) inode.i_uid;
+		put_le32 d (o + 4) inode.i_size;
+		put_le32l d (o + 8) inode.i_atime;
+		put_le32l d (o + 12) inode.i_ctime;
+		put_le32l d (o + 16) inode.i_mtime;
+		put_le32l d (o + 20) inode.i_dtime;
+		put_le16 d (o + 24) inode.i_gid;
+		put_le16 d (o + 26) inode.i_links_count;
+		put_le32 d (o + 28) inode.i_blocks;
+		put_le32l d (o + 32) inode.i_flags;
+		put_le32l d (o + 36) inode.i_osd1;
+		Array.iteri (fun i b -> put_le32 d (o + 40 + 4 * i) b) inode.i_block;
+		put_le32l d (o + 100) inode.i_generation;
+		put_le32l d (o + 104) inode.i_file_acl;
+		put_le32l d (o + 108) inode.i_dir_acl;
+		put_le32l d (o + 112) inode.i_faddr;
+		ignore (List.fold_left (fun i b -> d.[i] <- Char.chr b; i + 1) (o + 116) inode.i_osd2))
+
+(* the group descriptor table starts in the block after the superblock *)
+let descriptor_sector fs = to_sector fs.s (fs.s.s_first_data_block + 1)
+
+let save_counts fs g =
+	let c = fs.groups.(g) in
+	let sector = descriptor_sector fs + g * 32 / 512 and o = g * 32 mod 512 in
+	update_sectors fs sector 1 (fun d ->
+		put_le16 d (o + 12) c.g_free_blocks;
+		put_le16 d (o + 14) c.g_free_inodes;
+		put_le16 d (o + 16) c.g_used_dirs);
+	(* the superblock is at byte 1024 of the partition *)
+	update_sectors fs 2 1 (fun d ->
+		put_le32 d 12 fs.free_blocks;
+		put_le32 d 16 fs.free_inodes)
+
+let bit_set d i = Char.code d.[i lsr 3] land (1 lsl (i land 7)) <> 0
+
+let set_bit d i v =
+	let c = Char.code d.[i lsr 3] and m = 1 lsl (i land 7) in
+	d.[i lsr 3] <- Char.unsafe_chr (if v then c lor m else c land (lnot m))
+
+(* the first clear bit in [start, limit), else in [0, start) *)
+let find_clear d start limit =
+	let rec scan i stop =
+		if i >= stop then None
+		else if i land 7 = 0 && i + 8 <= stop && d.[i lsr 3] = '\255' then scan (i + 8) stop
+		else if not (bit_set d i) then Some i
+		else scan (i + 1) stop
 	in
-	(* calculate the block ranges (in bytes) *)
-	let direct_range = block_size * 12 in
-	let indirect_range = block_size * block_size / 4 in
-	let doubly_indirect_range = block_size * block_size * block_size / 16 in
-	let triply_indirect_range = block_size * block_size * block_size * block_size / 64 in
-	(* and map a block into an index *)
-	let block_to_block_indices = function
-		| n when n < 12 ->
-			n, Direct n
-		| n when (n - 12) < (block_size / 4) ->
-			n, Indirect (n - 12)
-		| n when (n - 12 - block_size / 4) < (block_size * block_size / 16) ->
-			let n1, n2 = divmod (n - 12 - block_size / 4) (block_size / 4) in
-			n, DoubleIndirect (n1, n2)
-		| n when (n - 12) < (block_size / 64 * block_size) ->
-			let n1, r = divmod (n - 12) (block_size / 4) in
-			let n2, n3 = divmod r (block_size / 4) in
-			n, TripleIndirect (n1, n2, n3)
-		| n ->
-			Vt100.printf "byte_to_block_indices: n = %d (%d, %d, %d, %d)\n" n
-				direct_range indirect_range doubly_indirect_range triply_indirect_range;
-			failwith "ext2fs: file too big"
+	match scan start limit with
+	| Some i -> Some i
+	| None -> scan 0 (min start limit)
+
+(* Set a clear bit in some group's bitmap, trying [first]'s bitmap from
+   bit [start] before moving on to the groups after it. Groups whose
+   count says they are full are skipped unread. *)
+let allocate fs bitmap free bits first start =
+	let groups = Array.length fs.t in
+	let rec try_group k =
+		if k = groups then raise Not_found
+		else begin
+			let g = (first + k) mod groups in
+			let found =
+				if free g = 0 then None
+				else begin
+					let sector = to_sector fs.s (bitmap g) and n = fs.bs / 512 in
+					let d = fs.p.read sector n in
+					match find_clear d (if k = 0 then start else 0) (bits g) with
+					| Some bit -> set_bit d bit true; fs.p.write sector n d; Some (g, bit)
+					| None -> None
+				end
+			in
+			match found with
+			| Some r -> r
+			| None -> try_group (k + 1)
+		end
+	in try_group 0
+
+let blocks_in_group fs g =
+	let s = fs.s in
+	min s.s_blocks_per_group (s.s_blocks_count - s.s_first_data_block - g * s.s_blocks_per_group)
+
+(* a free block as close after [goal] as there is *)
+let alloc_block fs goal =
+	let s = fs.s in
+	let goal =
+		if goal < s.s_first_data_block || goal >= s.s_blocks_count
+		then 0 else goal - s.s_first_data_block in
+	let g, bit =
+		try
+			allocate fs (fun g -> fs.t.(g).bg_block_bitmap)
+				(fun g -> fs.groups.(g).g_free_blocks) (blocks_in_group fs)
+				(goal / s.s_blocks_per_group) (goal mod s.s_blocks_per_group)
+		with Not_found -> failwith "ext2fs: no free blocks"
 	in
-	(* find the start and end block indices *)
-	let start = block_to_block_indices (ofs / block_size) in
-	let finish = block_to_block_indices ((ofs + len + block_size - 1) / block_size) in
-	(* now we need a reading loop (and probably a cache) *)
-	let rec read_loop = function
-		| _, blk when blk = snd finish -> (* we're done I guess *) ()
-		| x, Direct n ->
-			if inode.i_block.(n) <> 0 then begin
-				write inode.i_block.(n);
-				read_loop (block_to_block_indices (x + 1))
-			end
-		| x, Indirect n ->
-			(* now what...? :P *)
-			let s = read inode.i_block.(12) in (* the indirect block *)
-			let inp = IO.input_string (String.sub s (n * 4) 4) in (* only the block we want *)
-			let block = IO.read_i32 inp in
-			if block <> 0 then begin
-				write block;
-				read_loop (block_to_block_indices (x + 1))
-			end
-		| x, DoubleIndirect (n, o) ->
-			let s1 = read inode.i_block.(13) in (* the first indirect block *)
-			let inp = IO.input_string (String.sub s1 (n * 4) 4) in
-			let s2 = read (IO.read_i32 inp) in
-			let inp = IO.input_string (String.sub s2 (o * 4) 4) in
-			let block = IO.read_i32 inp in
-			if block <> 0 then begin
-				write block;
-				read_loop (block_to_block_indices (x + 1))
-			end
-		| x, TripleIndirect (n, o, p) ->
-			let s1 = read inode.i_block.(14) in (* first indirect block *)
-			let inp = IO.input_string (String.sub s1 (n * 4) 4) in
-			let s2 = read (IO.read_i32 inp) in (* second indirect block *)
-			let inp = IO.input_string (String.sub s2 (o * 4) 4) in
-			let s3 = read (IO.read_i32 inp) in (* third indirect block *)
-			let inp = IO.input_string (String.sub s3 (p * 4) 4) in
-			let block = IO.read_i32 inp in
-			if block <> 0 then begin
-				write block;
-				read_loop (block_to_block_indices (x + 1))
-			end
-		| _ -> failwith "ext2fs: reading loop failed"
+	let c = fs.groups.(g) in
+	c.g_free_blocks <- c.g_free_blocks - 1;
+	fs.free_blocks <- fs.free_blocks - 1;
+	save_counts fs g;
+	s.s_first_data_block + g * s.s_blocks_per_group + bit
+
+let free_block fs block =
+	let s = fs.s in
+	let g = (block - s.s_first_data_block) / s.s_blocks_per_group in
+	let bit = (block - s.s_first_data_block) mod s.s_blocks_per_group in
+	update_sectors fs (to_sector s fs.t.(g).bg_block_bitmap) (fs.bs / 512)
+		(fun d -> set_bit d bit false);
+	Hashtbl.remove fs.indirect block;
+	let c = fs.groups.(g) in
+	c.g_free_blocks <- c.g_free_blocks + 1;
+	fs.free_blocks <- fs.free_blocks + 1;
+	save_counts fs g
+
+(* a free inode, preferably in the same group as [dir]; the reserved
+   inodes below s_first_ino are already marked in the bitmap *)
+let alloc_inode fs dir is_dir =
+	let s = fs.s in
+	let g, bit =
+		try
+			allocate fs (fun g -> fs.t.(g).bg_inode_bitmap)
+				(fun g -> fs.groups.(g).g_free_inodes) (fun _ -> s.s_inodes_per_group)
+				((Int32.to_int dir - 1) / s.s_inodes_per_group) 0
+		with Not_found -> failwith "ext2fs: no free inodes"
 	in
-	(* do the reading... *)
-	read_loop start;
-	(* return the number of bytes actually written to ba *)
-	len
+	let c = fs.groups.(g) in
+	c.g_free_inodes <- c.g_free_inodes - 1;
+	if is_dir then c.g_used_dirs <- c.g_used_dirs + 1;
+	fs.free_inodes <- fs.free_inodes - 1;
+	save_counts fs g;
+	Int32.of_int (g * s.s_inodes_per_group + bit + 1)
 
-let readfile_ba fs inode =
-	let indirect_entries = (1024 lsl fs.s.s_log_block_size) / 4 in
-	let num_sectors = 2 lsl fs.s.s_log_block_size in
-	let block_size = 1024 lsl fs.s.s_log_block_size in
-	let read ofs = fs.p.read (to_sector fs.s ofs) num_sectors in
-	let ba = Bigarray.Array1.create Bigarray.int8_unsigned Bigarray.c_layout inode.i_size in
-	let pos = ref 0 in
-	let write ofs =
-		let s = read ofs in
-		let len = if inode.i_size - !pos < block_size
-			then inode.i_size - !pos
-			else block_size
-		in
-		begin try
-			Bigarray.Array1.blit_from_string
-				(if len = block_size then s else String.sub s 0 len)
-				(Bigarray.Array1.sub ba !pos len);
-		with exn ->
-			Vt100.printf "ext2fs fail: pos = %d, block size = %d, len = %d, total len = %d\n"
-				!pos block_size len inode.i_size;
-			raise exn;
-		end;
-		pos := !pos + len;
+let free_inode fs x is_dir =
+	let s = fs.s in
+	let g = (Int32.to_int x - 1) / s.s_inodes_per_group in
+	let bit = (Int32.to_int x - 1) mod s.s_inodes_per_group in
+	update_sectors fs (to_sector s fs.t.(g).bg_inode_bitmap) (fs.bs / 512)
+		(fun d -> set_bit d bit false);
+	let c = fs.groups.(g) in
+	c.g_free_inodes <- c.g_free_inodes + 1;
+	if is_dir then c.g_used_dirs <- c.g_used_dirs - 1;
+	fs.free_inodes <- fs.free_inodes + 1;
+	save_counts fs g
+
+(* write [entries] out as indirect block [block], keeping the decoded
+   copy in the cache *)
+let write_indirect fs block entries =
+	let data = String.create fs.bs in
+	Array.iteri (fun i v -> put_le32 data (4 * i) v) entries;
+	Hashtbl.replace fs.indirect block entries;
+	fs.p.write (to_sector fs.s block) (fs.bs / 512) data
+
+(* Give logical block [n] of the file a newly allocated disk block,
+   allocating any missing indirect blocks on the way first so that they
+   sit just ahead of the data they map. [goal] is where the next block
+   should go and moves past each one allocated. Returns the data block
+   and how many blocks were allocated in all. *)
+let map_new_block fs inode n goal =
+	let per = fs.bs / 4 in
+	let added = ref 0 in
+	let fresh () =
+		let b = alloc_block fs !goal in
+		goal := b + 1;
+		incr added;
+		b in
+	let new_index () =
+		let b = fresh () in
+		write_indirect fs b (Array.make per 0);
+		b in
+	let top slot =
+		if inode.i_block.(slot) = 0 then inode.i_block.(slot) <- new_index ();
+		inode.i_block.(slot) in
+	let set block i b =
+		let entries = indirect fs block in
+		entries.(i) <- b;
+		write_indirect fs block entries in
+	let below block i =
+		let b = (indirect fs block).(i) in
+		if b <> 0 then b
+		else begin
+			let b = new_index () in
+			set block i b;
+			b
+		end in
+	let data = fresh in
+	let b =
+		if n < 12 then begin
+			let b = data () in
+			inode.i_block.(n) <- b;
+			b
+		end else let n = n - 12 in
+		if n < per then begin
+			let index = top 12 in
+			let b = data () in
+			set index n b;
+			b
+		end else let n = n - per in
+		if n < per * per then begin
+			let index = below (top 13) (n / per) in
+			let b = data () in
+			set index (n mod per) b;
+			b
+		end else
+			failwith "ext2fs: file too big (no triple indirect writes)"
 	in
-	(* read indirect block data into the bigarray *)
-	let rec read_indirect indirect_block levels =
-		let inp = IO.input_string (read indirect_block) in
-		if levels = 0 then begin
-			(* the int32 values point to blocks of data *)
-			loop_until indirect_entries (fun _ ->
-				let block = IO.read_i32 inp in
-				if block <> 0 then begin
-					write block; true
-				end else false)
-		end else begin
-			loop_until indirect_entries (fun _ ->
-				let indirect_block = IO.read_i32 inp in
-				if indirect_block <> 0 then begin
-					read_indirect indirect_block (levels - 1); true
-				end else false)
+	b, !added
+
+let append_locked fs x data =
+	let inode = inode fs x in
+	let bs = fs.bs and len = String.length data in
+	let size = inode.i_size in
+	(* carry on from the last block, or start in the inode's own group *)
+	let goal = ref begin
+		let last = if size > 0 then map_block fs inode ((size - 1) / bs) else 0 in
+		if last <> 0 then last + 1
+		else fs.s.s_first_data_block
+			+ (Int32.to_int x - 1) / fs.s.s_inodes_per_group * fs.s.s_blocks_per_group
+	end in
+	let added = ref 0 in
+	let rec loop pos =
+		if pos < len then begin
+			let ofs = size + pos in
+			let n = ofs / bs and off = ofs mod bs in
+			let chunk = min (len - pos) (bs - off) in
+			let existing = map_block fs inode n in
+			if existing <> 0 then begin
+				(* the partly filled last block: rewrite just its sectors *)
+				let first = off / 512 in
+				let count = (off + chunk + 511) / 512 - first in
+				update_sectors fs (to_sector fs.s existing + first) count (fun d ->
+					String.blit data pos d (off mod 512) chunk)
+			end else begin
+				let b, n = map_new_block fs inode n goal in
+				added := !added + n;
+				let block = String.make bs '\000' in
+				String.blit data pos block off chunk;
+				fs.p.write (to_sector fs.s b) (bs / 512) block
+			end;
+			loop (pos + chunk)
 		end
 	in
-	loop_until 12 (fun i ->
-		if inode.i_block.(i) <> 0 then begin
-			write inode.i_block.(i); true
-		end else false);
-	if inode.i_block.(12) <> 0 then read_indirect inode.i_block.(12) 0;
-	if inode.i_block.(13) <> 0 then read_indirect inode.i_block.(13) 1;
-	if inode.i_block.(14) <> 0 then read_indirect inode.i_block.(14) 2;
-	(* return the bigarray result *)
-	ba
+	loop 0;
+	let t = now () in
+	write_inode fs x { inode with
+		i_size = size + len;
+		i_blocks = inode.i_blocks + !added * (bs / 512);
+		i_mtime = t;
+		i_ctime = t;
+	}
+
+(* Shrink (or grow, sparsely) to [size] bytes. Blocks wholly past the
+   end are freed, along with any indirect block left mapping nothing;
+   the tail of the new last block is zeroed so growing it again later
+   reads back zeros. *)
+let truncate_locked fs x size =
+	let inode = inode fs x in
+	let bs = fs.bs and per = fs.bs / 4 in
+	let keep = (size + bs - 1) / bs in
+	let freed = ref 0 in
+	let release b = free_block fs b; incr freed in
+	(* a fast symlink keeps its target in i_block and owns no blocks *)
+	if size < inode.i_size && inode.i_blocks > 0 then begin
+		for i = keep to 11 do
+			if inode.i_block.(i) <> 0 then begin
+				release inode.i_block.(i);
+				inode.i_block.(i) <- 0
+			end
+		done;
+		(* each entry of [block] maps [span] logical blocks, the first
+		   from [base]; true if [block] itself was freed *)
+		let rec trim block span base =
+			let entries = Array.copy (indirect fs block) in
+			let changed = ref false in
+			Array.iteri (fun i b ->
+				let first = base + i * span in
+				if b <> 0 && first + span > keep then begin
+					if span = 1 || trim b (span / per) first then begin
+						if span = 1 then release b;
+						entries.(i) <- 0;
+						changed := true
+					end
+				end) entries;
+			if base >= keep then begin
+				release block;
+				true
+			end else begin
+				if !changed then write_indirect fs block entries;
+				false
+			end
+		in
+		let top slot span base =
+			let b = inode.i_block.(slot) in
+			if b <> 0 && trim b span base then inode.i_block.(slot) <- 0 in
+		top 12 1 12;
+		top 13 per (12 + per);
+		top 14 (per * per) (12 + per + per * per);
+		let off = size mod bs in
+		if off <> 0 then begin
+			let b = map_block fs inode (keep - 1) in
+			if b <> 0 then
+				update_sectors fs (to_sector fs.s b) (bs / 512)
+					(fun d -> String.fill d off (bs - off) '\000')
+		end
+	end;
+	let t = now () in
+	write_inode fs x { inode with
+		i_size = size;
+		i_blocks = inode.i_blocks - !freed * (bs / 512);
+		i_mtime = t;
+		i_ctime = t;
+	}
+
+let feature_filetype = 0x2l
+
+(* Put an entry for [x] in directory [dir]: into the slack of an existing
+   entry if one has room, else in a new block on the end *)
+let add_entry fs dir name x file_type =
+	let bs = fs.bs in
+	let name_len = String.length name in
+	let need = (8 + name_len + 3) land (lnot 3) in
+	let file_type =
+		if Int32.logand fs.s.s_feature_incompat feature_filetype <> 0l then file_type else 0 in
+	let write_entry d at rec_len =
+		put_le32l d at x;
+		put_le16 d (at + 4) rec_len;
+		d.[at + 6] <- Char.chr name_len;
+		d.[at + 7] <- Char.chr file_type;
+		String.blit name 0 d (at + 8) name_len in
+	let inode = inode fs dir in
+	let blocks = inode.i_size / bs in
+	let rec try_block n =
+		if n = blocks then begin
+			let d = String.make bs '\000' in
+			write_entry d 0 bs;
+			append_locked fs dir d
+		end else begin
+			let b = map_block fs inode n in
+			let d = if b = 0 then "" else fs.p.read (to_sector fs.s b) (bs / 512) in
+			let rec scan ofs =
+				if ofs + 8 > String.length d then false
+				else begin
+					let rec_len = le16 d (ofs + 4) in
+					if rec_len < 8 then false
+					else begin
+						let used =
+							if le32l d ofs = 0l then 0
+							else (8 + Char.code d.[ofs + 6] + 3) land (lnot 3) in
+						if rec_len - used >= need then begin
+							if used > 0 then put_le16 d (ofs + 4) used;
+							write_entry d (ofs + used) (rec_len - used);
+							fs.p.write (to_sector fs.s b) (bs / 512) d;
+							true
+						end else
+							scan (ofs + rec_len)
+					end
+				end
+			in
+			if not (scan 0) then try_block (n + 1)
+		end
+	in try_block 0
+
+let create_file fs dir name =
+	with_wlock fs begin fun () ->
+		if String.length name = 0 || String.length name > 255 || String.contains name '/' then
+			invalid_arg "Ext2fs.create_file";
+		if (try ignore (lookup fs dir name); true with Not_found -> false) then
+			failwith ("ext2fs: " ^ name ^ " exists");
+		let parent = inode fs dir in
+		if fst parent.i_mode <> Directory then failwith "ext2fs: not a directory";
+		let x = alloc_inode fs dir false in
+		let t = now () in
+		write_inode ~fresh:true fs x { null_inode with
+			i_mode = File, 0o644;
+			i_links_count = 1;
+			i_atime = t;
+			i_ctime = t;
+			i_mtime = t;
+			i_block = Array.make 15 0;
+		};
+		(* entries go in without touching the hash index, so stop it
+		   being used, the way old kernels do *)
+		if indexed fs parent then
+			write_inode fs dir { parent with
+				i_flags = Int32.logand parent.i_flags (Int32.lognot ext2_index_fl) };
+		add_entry fs dir name x 1;
+		Hashtbl.replace dentries (fs.id, dir, name) (Some x);
+		x
+	end
+
+let append fs x data =
+	with_wlock fs (fun () -> append_locked fs x data)
+
+let truncate fs x size =
+	with_wlock fs (fun () -> truncate_locked fs x size)
+
+(* Remove [name] from [dir], folding its record into the one before it
+   (or just clearing the inode number if it is first in its block); the
+   file goes when its last link does. Directories are refused. *)
+let unlink fs dir name =
+	with_wlock fs begin fun () ->
+		let x = lookup fs dir name in
+		let target = inode fs x in
+		if fst target.i_mode = Directory then failwith "ext2fs: is a directory";
+		let bs = fs.bs in
+		let parent = inode fs dir in
+		let rec try_block n =
+			if n >= parent.i_size / bs then raise Not_found
+			else begin
+				let b = map_block fs parent n in
+				let d = if b = 0 then "" else fs.p.read (to_sector fs.s b) (bs / 512) in
+				let rec scan prev ofs =
+					if ofs + 8 > String.length d then false
+					else begin
+						let rec_len = le16 d (ofs + 4) in
+						let name_len = Char.code d.[ofs + 6] in
+						if rec_len < 8 then false
+						else if le32l d ofs = x && name_len = String.length name
+							&& String.sub d (ofs + 8) name_len = name then begin
+							if prev < 0 then put_le32l d ofs 0l
+							else put_le16 d (prev + 4) (ofs + rec_len - prev);
+							fs.p.write (to_sector fs.s b) (bs / 512) d;
+							true
+						end else
+							scan ofs (ofs + rec_len)
+					end
+				in
+				if not (scan (-1) 0) then try_block (n + 1)
+			end
+		in
+		try_block 0;
+		Hashtbl.replace dentries (fs.id, dir, name) None;
+		if target.i_links_count > 1 then
+			write_inode fs x { target with
+				i_links_count = target.i_links_count - 1;
+				i_ctime = now () }
+		else begin
+			truncate_locked fs x 0;
+			write_inode fs x { (inode fs x) with i_links_count = 0; i_dtime = now () };
+			free_inode fs x false
+		end
+	end
+
+let sync fs = fs.p.Partitions.sync ()
 
 module KB = KernelBuffer
 
@@ -723,18 +1114,33 @@ let open_file fs inode =
 			end;
 	} in src
 
+let next_id = ref 0
+
+let groups_of t =
+	Array.map (fun d -> {
+		g_free_blocks = d.bg_free_blocks_count;
+		g_free_inodes = d.bg_free_inodes_count;
+		g_used_dirs = d.bg_used_dirs_count;
+	}) t
+
 let make p =
 	let s = superblock p in
 	let t = block_group_descriptor_table p s in
-	let bs = 1024 lsl s.s_log_block_size in
-	let i = inode { p = p; s = s; t = t; r = null_inode; bs = bs } 2l in
-	{
+	incr next_id;
+	let fs = {
 		p = p;
 		s = s;
 		t = t;
-		r = i;
-		bs = bs (* sick of perpetually calculating this *)
-	}
+		r = null_inode;
+		bs = 1024 lsl s.s_log_block_size; (* sick of perpetually calculating this *)
+		indirect = Hashtbl.create 64;
+		id = !next_id;
+		groups = groups_of t;
+		free_blocks = s.s_free_blocks_count;
+		free_inodes = s.s_free_inodes_count;
+		wlock = Mutex.create ();
+	} in
+	{ fs with r = inode fs 2l }
 
 let create p =
 	let m = make p in
@@ -742,10 +1148,17 @@ let create p =
 		metadata = m;
 		read_dir = readdir m;
 		read_inode = inode m;
+		lookup = lookup m;
+		resolve = resolve m;
 		read_file = readfile m;
 		read_file_ba = readfile_ba m;
 		read_file_range_ba = read_file_range_ba m;
 		read_file_range_with_buffer = read_file_range_with_buffer m;
+		create_file = create_file m;
+		append_file = append m;
+		truncate_file = truncate m;
+		unlink = unlink m;
+		sync = (fun () -> sync m);
 	}
 		
 let init p =
@@ -790,7 +1203,10 @@ let init p =
 		d.bg_block_bitmap d.bg_inode_bitmap d.bg_inode_table;
 	Vt100.printf "free blocks: %d; free inodes: %d; used dirs: %d\n"
 		d.bg_free_blocks_count d.bg_free_inodes_count d.bg_used_dirs_count;
-	let fs = { p = p; s = s; t = t; r = null_inode; bs = 1024 lsl s.s_log_block_size } in
+	let fs = { p = p; s = s; t = t; r = null_inode; bs = 1024 lsl s.s_log_block_size;
+		indirect = Hashtbl.create 64; id = 0; groups = groups_of t;
+		free_blocks = s.s_free_blocks_count; free_inodes = s.s_free_inodes_count;
+		wlock = Mutex.create () } in
 	let root_dir_inode = inode fs 2l in
 	let fs = { fs with r = root_dir_inode } in
 	Vt100.printf "root dir inode: %s, size = %d, flags = %lx, uid = %d, gid = %d\n"
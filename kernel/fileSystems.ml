@@ -8,25 +8,28 @@ let fs = ref None
 
 let set_fs x = fs := Some x
 
-let dirs = ref []
+(* the directory ls last listed; names are resolved relative to it *)
+let cwd = ref 2l
 
 let init () =
 	match !fs with
 	| None -> ()
 	| Some fs ->
 		let did_it = ref false in
+		let find name format =
+			let ino = fs.resolve !cwd name in
+			let inode = fs.read_inode ino in
+			if fst inode.i_mode <> format then raise Not_found;
+			ino, inode
+		in
 		let dirlist name =
 			begin try
-				let inode = fs.read_inode begin
-					(List.find begin fun entry ->
-							entry.name = name && entry.file_type = 2
-						end !dirs).inode
-					end in
-				dirs := fs.read_dir inode;
+				let ino, inode = find name Ext2fs.Directory in
+				cwd := ino;
 				Vt100.printf "Directory Listing for %s:\n" name;
 				List.iter begin fun entry ->
 						Vt100.printf " %s\n" entry.name
-					end !dirs
+					end (fs.read_dir inode)
 			with Not_found ->
 				Vt100.printf "ls: directory not found, or not a directory\n"
 			end;
@@ -39,11 +42,7 @@ let init () =
 		in
 		let catfile name =
 			begin try
-				let inode = fs.read_inode begin
-					(List.find begin fun entry ->
-							entry.name = name && entry.file_type = 1
-						end !dirs).inode
-					end in
+				let _, inode = find name Ext2fs.File in
 				let contents = fs.read_file inode in
 				Vt100.printf "%s\n" contents
 			with Not_found ->
@@ -56,9 +55,43 @@ let init () =
 				Vt100.printf "cat: require a filename\n";
 			did_it := false
 		in
+		(* write NAME LINE...: append the lines to NAME, making it if need be *)
+		let write_args = ref [] in
+		let write_trunc = ref false in
+		let writefile () =
+			let args = List.rev !write_args and trunc = !write_trunc in
+			write_args := [];
+			write_trunc := false;
+			match args with
+			| [] -> Vt100.printf "write: require a filename\n"
+			| name :: lines ->
+				let ino =
+					try fst (find name Ext2fs.File)
+					with Not_found -> fs.create_file !cwd name
+				in
+				if trunc then fs.truncate_file ino 0;
+				List.iter (fun line -> fs.append_file ino (line ^ "\n")) lines;
+				fs.sync ()
+		in
+		let rmfile name =
+			begin try
+				fs.unlink !cwd name;
+				fs.sync ()
+			with Not_found ->
+				Vt100.printf "rm: %s: file not found\n" name
+			end;
+			did_it := true
+		in
+		let rm_def () =
+			if !did_it = false then
+				Vt100.printf "rm: require a filename\n";
+			did_it := false
+		in
 		add_command "ls" (*dirlist [
 			"-name", Set_string name, " Directory to list";
 		];*) dirlist_def [] ~anon:dirlist;
 		add_command "cat" cat_def [] ~anon:catfile;
-		(* init dirs *)
-		dirs := fs.read_dir fs.metadata.r
+		add_command "write" writefile [
+			"-t", Set write_trunc, " Truncate the file first";
+		] ~anon:(fun arg -> write_args := arg :: !write_args);
+		add_command "rm" rm_def [] ~anon:rmfile
@@ -1,25 +1,70 @@
 
-external unsafe_lock : Mutex.t -> unit = "caml_mutex_unsafe_lock"
-external unsafe_unlock : Mutex.t -> unit = "caml_mutex_unsafe_unlock"
+(* Interrupts are handled in two stages. The C top half (softirq.c) masks
+   the line, records the event and sends EOI immediately; a single bottom
+   half thread then runs the OCaml handlers for every pending IRQ in one
+   batch and unmasks each line once its handler has acknowledged the device.
+   The handlers share that thread, so none of them may wait on a consumer,
+   which would hold up every other line. They do take mutexes (IDE, AC97,
+   the network rx queue, audio capture), which can put the thread to sleep
+   on a waitqueue for a moment; the top half only ever wakes it out of
+   softirq_wait. *)
+
+external softirq_register : int -> unit = "snowflake_softirq_register"
+external softirq_wait : unit -> int = "snowflake_softirq_wait"
+external softirq_done : int -> unit = "snowflake_softirq_done"
+external softirq_stats : int -> int * int * int64 * int64 = "snowflake_softirq_stats"
+
+external apic_enabled : unit -> bool = "snowflake_apic_enabled"
+external irq_level : int -> unit = "snowflake_irq_level"
+external msi_allocate : unit -> int = "snowflake_msi_allocate"
+external msi_message : int -> int32 * int = "snowflake_msi_message"
+
+(* 16 ISA lines followed by the MSI lines, as in idt.h *)
+let lines = 24
+
+let handlers = Array.make lines (fun () -> ())
+
+let bottom_half () =
+	while true do
+		let pending = softirq_wait () in
+		for irq = 0 to lines - 1 do
+			if pending land (1 lsl irq) <> 0 then begin
+				(try handlers.(irq) ()
+				with exn ->
+					Debug.printf "irq %d handler raised %s\n" irq (Printexc.to_string exn));
+				softirq_done irq
+			end
+		done
+	done
+
+let started = ref false
 
 let create irq cb =
 	Debug.printf "registering interrupt handler for %d\n" irq;
-	let m = Mutex.create () in
-	Mutex.lock m; (* lock it so handler is blocked *)
-	let _ = Thread.create (fun () ->
-		while true do
-			(* acquire locked mutex *)
-			unsafe_lock m;
-			Debug.printf "invoking handler for %d\n" irq;
-			cb ();
-			(* signal interrupt controller that we're done *)
-			Asm.out8 0x20 0x20;
-			if irq > 7 then
-				Asm.out8 0xA0 0x20;
-		done
-	) () (Printf.sprintf "irq %d" irq) in
-	let u () = unsafe_unlock m in
-	ignore (Sys.signal irq (Sys.Signal_handle (fun _ -> Debug.printf "unlocking interrupt thread %d\n" irq; u ())))
+	handlers.(irq) <- cb;
+	if not !started then begin
+		started := true;
+		ignore (Thread.create bottom_half () "softirq")
+	end;
+	softirq_register irq
+
+let pci_line device =
+	let legacy () =
+		irq_level device.PCI.request_line;
+		device.PCI.request_line
+	in
+	if apic_enabled () && PCI.supports_msi device then
+		try
+			let line = msi_allocate () in
+			let address, data = msi_message line in
+			if PCI.enable_msi device address data then line else legacy ()
+		with Not_found -> legacy ()
+	else legacy ()
+
+let stats irq =
+	let count, handled, total, worst = softirq_stats irq in
+	let mean = if handled = 0 then 0L else Int64.div total (Int64.of_int handled) in
+	count, mean, worst
 
 (*open Gc
 let print_stat () =
@@ -41,24 +86,9 @@ let print_stat () =
   Debug.printf "compactions: %d\n" st.compactions*)
   
 let create_i irq cb =
-	let m = Mutex.create () in
-	let start = ref 0L in
-	Mutex.lock m; (* lock it so handler is blocked *)
-	let _ = Thread.create (fun () ->
-		while true do
-			(* acquire locked mutex *)
-			unsafe_lock m;
-			start := Asm.rdtsc ();
-			cb ();
-			Asm.out8 0x20 0x20;
-			if irq > 7 then
-				Asm.out8 0xA0 0x20;
-			Printf.kprintf (fun s ->
-				Debug.log s !start (Asm.rdtsc()))
-				"irq %d" irq
-		done
-	) () (Printf.sprintf "irq %02d" irq) in
-	let u () =
-		unsafe_unlock m
-	in
-	ignore (Sys.signal irq (Sys.Signal_handle (fun _ -> u ())))
+	create irq (fun () ->
+		let start = Asm.rdtsc () in
+		cb ();
+		Printf.kprintf (fun s ->
+			Debug.log s start (Asm.rdtsc()))
+			"irq %d" irq)
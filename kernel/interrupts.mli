@@ -1,7 +1,20 @@
 
 val create : int -> (unit -> unit) -> unit
-(** [create irq cb] sets up an interrupt handler for [irq],
-    which executes [cb] in a separate thread when the interrupt
-	is signalled. *)
+(** [create irq cb] sets up an interrupt handler for [irq]. The interrupt
+    is acknowledged at the PIC immediately and its line masked; [cb] then
+    runs on the shared bottom-half thread, batched with any other pending
+    IRQs, and the line is unmasked once [cb] returns. [cb] must acknowledge
+    the device, and should not block for long since it delays the
+    handlers of every other IRQ. *)
 
 val create_i : int -> (unit -> unit) -> unit
+(** Like [create], but also logs the time spent in [cb]. *)
+
+val pci_line : PCI.device -> int
+(** [pci_line device] returns the line to pass to [create] for a PCI
+    device: a private MSI line when the IOAPIC is in use and the device
+    supports MSI or MSI-X, otherwise its (level-triggered) INTx line. *)
+
+val stats : int -> int * int64 * int64
+(** [stats irq] returns the number of interrupts taken on [irq] and the
+    mean and worst latency, in TSC cycles, from top half to bottom half. *)
@@ -18,25 +18,162 @@ let decoders : decoder list ref = ref []
 let register_decoder decoder =
 	decoders := decoder :: !decoders
 
+(* Decode-ahead: a decoder thread fills a pool of buffers the size of the
+   one openfile returns, running up to [pool_size] buffers ahead, while
+   the player's thread hands them to the mixer. Decoding overlaps with
+   playback, and a slow buffer is hidden by the ones decoded before it. *)
+
+let pool_size = ref 3
+
+let set_pool_size n = pool_size := max 2 n
+
+type pipeline = {
+	lock : Mutex.t;
+	changed : Condition.t;
+	free : BlockIO.input Queue.t;
+	full : BlockIO.input Queue.t;
+	mutable finished : bool; (* the decoder has queued its last buffer *)
+	mutable stopped : bool; (* playback gave up; the decoder should too *)
+}
+
+(* for the file playing, or the last one played *)
+type stats = {
+	buffers : int; (* decoded *)
+	bytes : int;
+	underruns : int; (* times playback had to wait for the decoder *)
+	last_decode : int64; (* TSC cycles to decode the last buffer *)
+	max_decode : int64;
+	total_decode : int64;
+}
+
+let n_buffers = ref 0
+let n_bytes = ref 0
+let n_underruns = ref 0
+let last_decode = ref 0L
+let max_decode = ref 0L
+let total_decode = ref 0L
+
+let stats () = {
+	buffers = !n_buffers;
+	bytes = !n_bytes;
+	underruns = !n_underruns;
+	last_decode = !last_decode;
+	max_decode = !max_decode;
+	total_decode = !total_decode;
+}
+
+let reset_stats () =
+	n_buffers := 0;
+	n_bytes := 0;
+	n_underruns := 0;
+	last_decode := 0L;
+	max_decode := 0L;
+	total_decode := 0L
+
+let decode_ahead (p, decoder, handle) =
+	let rec loop () =
+		Mutex.lock p.lock;
+		while Queue.is_empty p.free && not p.stopped do
+			Condition.wait p.changed p.lock
+		done;
+		if p.stopped then Mutex.unlock p.lock
+		else begin
+			let blockio = Queue.take p.free in
+			Mutex.unlock p.lock;
+			(* refills the buffer, so reset blockio position to 0 *)
+			blockio.BlockIO.pos <- 0;
+			let start = AudioMixer.clock () in
+			let more =
+				try decoder.decode handle blockio
+				with ex ->
+					begin match ex with
+					| End_of_file -> ()
+					| ex -> Vt100.printf "musicplayer: %s\n" (Printexc.to_string ex)
+					end;
+					(* nothing usable in this one *)
+					blockio.BlockIO.pos <- Array1.dim blockio.BlockIO.data;
+					false in
+			let cycles = Int64.sub (AudioMixer.clock ()) start in
+			incr n_buffers;
+			n_bytes := !n_bytes + Array1.dim blockio.BlockIO.data - blockio.BlockIO.pos;
+			last_decode := cycles;
+			if cycles > !max_decode then max_decode := cycles;
+			total_decode := Int64.add !total_decode cycles;
+			Mutex.lock p.lock;
+			Queue.add blockio p.full;
+			if not more then p.finished <- true;
+			Condition.broadcast p.changed;
+			Mutex.unlock p.lock;
+			if more then loop ()
+		end
+	in loop ()
+
+(* the next decoded buffer, or None once there are no more *)
+let next_full p started =
+	Mutex.lock p.lock;
+	if started && Queue.is_empty p.full && not p.finished then incr n_underruns;
+	while Queue.is_empty p.full && not p.finished do
+		Condition.wait p.changed p.lock
+	done;
+	let b = if Queue.is_empty p.full then None else Some (Queue.take p.full) in
+	Mutex.unlock p.lock;
+	b
+
+let recycle p blockio =
+	Mutex.lock p.lock;
+	Queue.add blockio p.free;
+	Condition.broadcast p.changed;
+	Mutex.unlock p.lock
+
+let stop p =
+	Mutex.lock p.lock;
+	p.stopped <- true;
+	Condition.broadcast p.changed;
+	Mutex.unlock p.lock
+
+let play_pipelined decoder handle blockio stream =
+	let p = {
+		lock = Mutex.create ();
+		changed = Condition.create ();
+		free = Queue.create ();
+		full = Queue.create ();
+		finished = false;
+		stopped = false;
+	} in
+	let size = Array1.dim blockio.BlockIO.data in
+	for i = 2 to !pool_size do
+		Queue.add (BlockIO.make (Array1.create int8_unsigned c_layout size)) p.free
+	done;
+	Queue.add blockio p.free;
+	ignore (Thread.create decode_ahead (p, decoder, handle) "decoder");
+	let rec loop started =
+		match next_full p started with
+		| Some b ->
+			AudioMixer.play_raw ~stream b;
+			recycle p b;
+			loop true
+		| None -> ()
+	in
+	try loop false with ex -> stop p; raise ex
+
 (* based loosely on the streaming music player code *)
 let rec play_file filename = function
 	| [] -> failwith "no valid decoder available"
 	| decoder :: decoders ->
 		try
 			let handle, blockio = decoder.openfile filename in
-			AudioMixer.play (AudioMixer.Wave.read blockio);
-			let more = decoder.decode handle blockio in
-			let more = ref more in
-			while !more do
-				(* refills the decode_buffer, so reset blockio position to 0 *)
-(*Debug.printf ".";*)
-				AudioMixer.play_raw blockio;(* just decode for now, to see how fast it is... *)
-(*Debug.printf "+";*)
-				blockio.BlockIO.pos <- 0;
-				let more' = decoder.decode handle blockio in
-				more := more';
-			done;
-Debug.printf "!";
+			let stream = AudioMixer.open_stream filename in
+			begin try
+				AudioMixer.play ~stream (AudioMixer.Wave.read blockio);
+				reset_stats ();
+				play_pipelined decoder handle blockio stream
+			with ex -> AudioMixer.close_stream stream; raise ex
+			end;
+			AudioMixer.close_stream stream;
+			let s = stats () in
+			Vt100.printf "musicplayer: %d buffers, %d underruns, decode %Ld cycles max, %Ld average\n"
+				s.buffers s.underruns s.max_decode
+				(if s.buffers = 0 then 0L else Int64.div s.total_decode (Int64.of_int s.buffers));
 		with
 			| Not_compatible -> play_file filename decoders
 			| ex ->
@@ -46,29 +183,36 @@ Debug.printf "!";
 
 let play_file filename =
 	Printexc.record_backtrace true;
-	Asm.cli ();
 	play_file filename !decoders;
-	Asm.sti ();
 	Printexc.record_backtrace false
 
 (* hack around linking *)
 
 let init () =
-	add_command "musicplayer" ignore ~anon:play_file [];
-	let s_buffer = String.make (4096 lsl 6) '\000' in
+	add_command "musicplayer" ignore ~anon:play_file [
+		"-buffers", Int set_pool_size, " <n> buffers to decode ahead (default 3)";
+	];
+	(* read straight into the decode buffer, with no string in between *)
+	let fill ic blockio =
+		let data = blockio.BlockIO.data in
+		let rec loop ofs =
+			if ofs < Array1.dim data then begin
+				let n = BlockIO.input_channel ic data ofs (Array1.dim data - ofs) in
+				if n = 0 then raise End_of_file;
+				loop (ofs + n)
+			end
+		in
+		loop 0;
+		blockio.BlockIO.pos <- 0
+	in
 	let openfile filename =
 		let ic = open_in_bin filename in
 		let buffer = Array1.create int8_unsigned c_layout (4096 lsl 6) in
 		let blockio = BlockIO.make buffer in
-		really_input ic s_buffer 0 (4096 lsl 6);
-		BlockIO.blit_from_string s_buffer blockio;
-		blockio.BlockIO.pos <- 0;
+		fill ic blockio;
 		ic, blockio
 	in
 	let decode ic blockio =
-		really_input ic s_buffer 0 (4096 lsl 6);
-		blockio.BlockIO.pos <- 0;
-		BlockIO.blit_from_string s_buffer blockio;
-		blockio.BlockIO.pos <- 0;
+		fill ic blockio;
 		true
 	in register_decoder { openfile = openfile; decode = decode }
@@ -8,7 +8,43 @@
    2. Register itself with the network stack using the identifier above
 *)
 
-type rx_channel = int list Event.channel
+(* Received packets on their way from a driver's interrupt handler to the
+   stack. Every handler runs on the one bottom-half thread, so [rx_push]
+   must not block: when the stack falls this far behind, the packet is
+   dropped, as the card itself would. *)
+type rx_channel = {
+	rx_packets : PacketLists.packet Queue.t;
+	rx_lock : Mutex.t;
+	rx_ready : Condition.t;
+	mutable rx_dropped : int;
+}
+
+let rx_capacity = 64
+
+let rx_create () = {
+	rx_packets = Queue.create ();
+	rx_lock = Mutex.create ();
+	rx_ready = Condition.create ();
+	rx_dropped = 0;
+}
+
+let rx_push q packet =
+	Mutex.lock q.rx_lock;
+	if Queue.length q.rx_packets < rx_capacity then begin
+		Queue.add packet q.rx_packets;
+		Condition.signal q.rx_ready
+	end else
+		q.rx_dropped <- q.rx_dropped + 1;
+	Mutex.unlock q.rx_lock
+
+let rx_pop q =
+	Mutex.lock q.rx_lock;
+	while Queue.is_empty q.rx_packets do
+		Condition.wait q.rx_ready q.rx_lock
+	done;
+	let packet = Queue.take q.rx_packets in
+	Mutex.unlock q.rx_lock;
+	packet
 
 type net_device = {
 	send : string -> unit;
@@ -312,7 +348,7 @@ module EthernetDriver : functor (Driver : ETHERNET) -> sig
 		val write: Driver.t -> string -> unit
 		val address: Driver.t -> NetworkProtocolStack.Ethernet.addr
 	end = functor (Driver : ETHERNET) -> struct
-		let rx_buffer = Event.new_channel ()
+		let rx_buffer = rx_create ()
 		
 		let init irq = 
 			let t = Driver.init () in
@@ -320,7 +356,7 @@ module EthernetDriver : functor (Driver : ETHERNET) -> sig
 			t
 		let read () =
 			Debug.printf "waiting for packet from driver\n";
-			let packet = Event.sync (Event.receive rx_buffer) in
+			let packet = rx_pop rx_buffer in
 			Debug.printf "got a packet from driver\n";
 			packet
 		let write t packet = Driver.send t packet
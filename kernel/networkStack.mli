@@ -1,7 +1,11 @@
 
 (* Network Stack *)
 
-type rx_channel = PacketLists.packet Event.channel
+(* Packets from a driver's interrupt handler; [rx_push] never blocks and
+   drops the packet if the stack has fallen too far behind *)
+type rx_channel
+
+val rx_push : rx_channel -> PacketLists.packet -> unit
 
 type net_device = {
 	send : string -> unit;
@@ -74,9 +74,18 @@ let wrap_read f partition offset length =
 let wrap_write f partition offset length data =
 	f (partition.start + offset) length data
 
+(* fill [dst] from byte [ofs] past sector [offset] of the partition *)
+let wrap_blit f partition offset ofs dst =
+	let len = Bigarray.Array1.dim dst in
+	if len > 0 then begin
+		let offset = offset + ofs / 512 and ofs = ofs mod 512 in
+		let data = f (partition.start + offset) ((ofs + len + 511) / 512) in
+		Bigarray.Array1.blit_from_string (String.sub data ofs len) dst
+	end
+
 (* e.g. to read from a partition, p, on ide disk: primary slave, would have like:
 	let disk = IDE.get IDE.Primary IDE.slave in
-	let my_read_funcion = wrap_read (IDE.read_disk disk) in
+	let my_read_funcion = wrap_read (BlockCache.read (IDE.cache disk)) in
 	let some_data = my_read_function some_offset some_number_of_sectors in
 	(* process some_data *)
 *)
@@ -85,6 +94,8 @@ type partition_t = {
 	info : partition;
 	read : int -> int -> string;
 	write : int -> int -> string -> unit;
+	blit : int -> int -> BlockIO.t -> unit;
+	sync : unit -> unit;
 }
 
 let partitions_t r w =
@@ -93,4 +104,14 @@ let partitions_t r w =
 		info = p;
 		read = wrap_read r p;
 		write = wrap_write w p;
+		blit = wrap_blit r p;
+		sync = ignore;
 	}) partitions
+
+(* partitions of a cached device; reads and writes go through the cache *)
+let of_device dev =
+	List.map (fun p ->
+		{ p with
+			blit = (fun offset -> BlockCache.blit dev (p.info.start + offset));
+			sync = (fun () -> BlockCache.flush dev) })
+		(partitions_t (BlockCache.read dev) (BlockCache.write dev))
@@ -18,6 +18,12 @@ type partition_t = {
 	info : partition;
 	read : int -> int -> string;
 	write : int -> int -> string -> unit;
+	(* [blit sector ofs buf] fills buf from byte ofs past sector *)
+	blit : int -> int -> BlockIO.t -> unit;
+	(* make earlier writes durable *)
+	sync : unit -> unit;
 }
 
 val partitions_t : (int -> int -> string) -> (int -> int -> string -> unit) -> partition_t list
+
+val of_device : BlockCache.device -> partition_t list
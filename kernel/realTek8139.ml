@@ -295,7 +295,7 @@ let create pcii =
 				out16 Registers.capr (properties.receivebufferoffset - 16); (* what happens if this is negative? *)
 				(* send received packet to the rx_buffer *)
 				Debug.printf "submitting packet to recv buffer\n";
-				Event.sync (Event.send rx_buffer int_list);
+				rx_push rx_buffer int_list;
 				Debug.printf "packet submitted\n";
 			with Break -> Printf.printf "rtl.read error!\r\n" | Restart -> read properties rx_buffer
 		
@@ -329,7 +329,7 @@ let create pcii =
 			| _ -> failwith "Invalid MAC address"
 	end in
 	let module Driver = EthernetDriver(RTL8139) in
-	let net_device = EthernetStack.create Driver.init Driver.read Driver.write pcii.request_line Driver.address in
+	let net_device = EthernetStack.create Driver.init Driver.read Driver.write (Interrupts.pci_line pcii) Driver.address in
 	NetworkStack.register_device net_device
 
 let init () =
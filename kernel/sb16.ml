@@ -48,7 +48,7 @@ let read () =
 	in8 R.data
 
 let write v =
-	spin R.write (fun x -> x land 0x80 = 1);
+	spin R.write (fun x -> x land 0x80 <> 0);
 	out8 R.write v
 
 let write_mixer m v =
@@ -64,54 +64,141 @@ let set_sample_rate hertz =
 	write (hertz lsr 8);
 	write (hertz land 0xFF)
 
-let len = ref 0
-
-let block = DMA.allocate ()
+(* Playback: auto-initialised 16-bit DMA over the whole region, which the
+   DSP plays as two halves, interrupting as it finishes each. The mixer
+   renders into whichever half is free, so one half can be refilled while
+   the other plays. *)
+
+open Bigarray
+
+let rate = 44100
+
+let region = DMA.allocate ()
+let half = Array1.dim region / 2
+let halves = [| Array1.sub region 0 half; Array1.sub region half half |]
+
+let m = Mutex.create ()
+let cv = Condition.create ()
+let running = ref false
+let playing = ref 0 (* the half the DSP is on *)
+let next_fill = ref 0
+let queued = ref 0 (* halves filled and not yet played, the playing one too *)
+let silent = ref 0 (* halves in a row that had nothing new *)
+let underruns = ref 0
+
+(* the DSP can time out with [m] held; it mustn't stay locked *)
+let locked f =
+	Mutex.lock m;
+	let r = try f () with ex -> Mutex.unlock m; raise ex in
+	Mutex.unlock m;
+	r
+
+(* with [m] held, once half 0 has been filled *)
+let start () =
+	Array1.fill halves.(1) 0;
+	playing := 0;
+	queued := 1;
+	next_fill := 1;
+	silent := 0;
+	DMA.start_transfer C.dma16 region (DMA.single lor DMA.auto_init lor DMA.read);
+	set_sample_rate rate;
+	write 0xB6; (* 16-bit output, auto-initialised, FIFO on *)
+	write 0x30; (* signed stereo *)
+	(* a block, in 16-bit samples, is half the buffer *)
+	write ((half / 2 - 1) land 0xFF);
+	write ((half / 2 - 1) lsr 8);
+	running := true
 
 let handler () =
-	(*write 0x14;
-	write ((!len - 1) land 0xFF);
-	write ((!len - 1) asr 8);
-	DMA.start C.dma8 block 0b0001_1000;*)
-	let _ = read_mixer 0x82 in
 	(* b0 = sb-midi / 8bit dma-mode digital sound *)
 	(* b1 = 16 bit dma mode digital sound *)
 	(* b2 = mpu-401 *)
-	(* when b0 = 1 *)
-	ignore (in8 R.status)
-	(*(* when b1 = 1 *)
-	in8 (base + 0x0F)
-	(* when b2 = 1 *)
-	in8 (midi_base)*)
-	
-
-let output sample =
-	reset ();
-	Interrupts.create C.irq handler;
-	write 0xD1; (* turn on DAC speaker *)
-	write_mixer M.master_left 0xF8; (* max *)
-	write_mixer M.master_right 0xF8; (* max *)
-	write_mixer M.gain_left 0xC0; (* max *)
-	write_mixer M.gain_right 0xC0;
-	(*let mode = 0b0001_1000 in (* demand, address inc, non-auto *)*)
-	let mode = 0b0101_1000 in (* single, auto *)
-	DMA.start_transfer C.dma8 block 0x45
-	;
-	set_sample_rate 11025;
-	let length = Array.length sample in
-	for i = 0 to length - 1 do
-		block.{i} <- sample.(i);
+	let status = read_mixer 0x82 in
+	if status land 0x01 <> 0 then ignore (in8 R.status);
+	if status land 0x02 <> 0 then begin
+		ignore (in8 R.ack16);
+		locked begin fun () ->
+			if !running then begin
+				(* the DSP has moved on to the other half; this one is free *)
+				let finished = !playing in
+				playing := finished lxor 1;
+				Array1.fill halves.(finished) 0;
+				decr queued;
+				if !queued = 0 then begin
+					(* nothing arrived in time: the half now playing is silence,
+					   and the one just finished is next to fill *)
+					incr underruns;
+					incr silent;
+					queued := 1;
+					next_fill := finished
+				end else
+					silent := 0;
+				if !silent >= 2 then begin
+					(* pause 16-bit output; the DMA stops either way *)
+					(try write 0xD5 with Timeout -> ());
+					DMA.stop_transfer C.dma16;
+					running := false
+				end
+			end;
+			Condition.broadcast cv
+		end
+	end
+
+(* wait for a free half, let [fill] write into it and queue it *)
+let render fill =
+	Mutex.lock m;
+	while !running && !queued = 2 do
+		Condition.wait cv m
 	done;
-	(* 0x14 = 0001_0100 *)
-	(*write 0x14; (* DMA mode; 8bit unsigned mono *)*)
-	(*write 0x48;
-	write ((length - 1) land 0xFF);
-	write ((length - 1) asr 8);
-	write 0x1C; (* 8bit PCM output; auto-initialized DMA *)*)
-	(* single-cycle 8bit PCM output *)
-	len := length;
-	write 0xC0; (* 8-bit output *)
-	write 0x00; (* 8-bit mono unsigned PCM *)
-	write 0xFF; (*((length - 1) land 0xFF);*)
-	write 0xFF; (*((length - 1) asr 8);*)
-	()
+	let ix = if !running then !next_fill else 0 in
+	Mutex.unlock m;
+	let size = fill halves.(ix) land (lnot 3) in
+	if size > 0 then begin
+		if size < half then
+			Array1.fill (Array1.sub halves.(ix) size (half - size)) 0;
+		locked begin fun () ->
+			if !running then begin
+				(* unless an underrun already made this the playing half *)
+				if !next_fill = ix then begin
+					incr queued;
+					next_fill := ix lxor 1;
+					silent := 0
+				end
+			end else begin
+				(* playback stopped while filling; it always restarts at half 0 *)
+				if ix <> 0 then Array1.blit halves.(ix) halves.(0);
+				start ()
+			end
+		end
+	end
+
+let output block_input =
+	let len = Array1.dim block_input.BlockIO.data in
+	while block_input.BlockIO.pos < len do
+		render begin fun buffer ->
+			let size = min (Array1.dim buffer) (len - block_input.BlockIO.pos) in
+			BlockIO.blit block_input (Array1.sub buffer 0 size);
+			size
+		end
+	done
+
+(* only if nothing else, such as an AC97, is playing already. The mixer
+   is taken before the card is set up, so a refusal leaves it untouched;
+   [m] holds its first render back until the handler is in place. *)
+let init () =
+	if not (AudioMixer.has_device ()) then try
+		reset ();
+		locked begin fun () ->
+			AudioMixer.register_device {
+				AudioMixer.format = 16, rate, 2;
+				AudioMixer.output = output;
+				AudioMixer.render = Some render;
+			};
+			Interrupts.create C.irq handler;
+			write 0xD1; (* turn on DAC speaker *)
+			write_mixer M.master_left 0xF8; (* max *)
+			write_mixer M.master_right 0xF8; (* max *)
+			write_mixer M.gain_left 0xC0; (* max *)
+			write_mixer M.gain_right 0xC0
+		end
+	with Timeout -> ()
@@ -3,4 +3,10 @@
 
 exception Timeout
 
-val output : int array -> unit
+(** Probe for a DSP at 0x220 and, if there is one, register it with the
+    mixer: 44.1kHz 16-bit stereo, through auto-initialised DMA on
+    channel 5 *)
+val init : unit -> unit
+
+(** Halves the DSP started before anything new was written to them *)
+val underruns : int ref
@@ -167,5 +167,45 @@ let init () =
 				printf " %s\n" name
 			) commands
 		end [];
+	(* per-thread cpu usage over a short interval *)
+	let interval = ref 20000 in
+	add_command "top" begin fun () ->
+			let index stats =
+				let h = Hashtbl.create 17 in
+				Array.iter (fun s -> Hashtbl.replace h s.Thread.ident s) stats;
+				h
+			in
+			let before = index (Thread.stats ()) in
+			Thread.usleep !interval;
+			let after = Thread.stats () in
+			let delta f s =
+				try Int64.sub (f s) (f (Hashtbl.find before s.Thread.ident))
+				with Not_found -> f s
+			in
+			let total = Array.fold_left
+				(fun acc s -> Int64.add acc (delta (fun s -> s.Thread.runtime) s)) 0L after in
+			let total = if total = 0L then 1L else total in
+			printf "%4s %-24s %6s %10s %10s %8s\n" "id" "name" "cpu%" "run(us)" "wait(us)" "switches";
+			Array.iter begin fun s ->
+				let run = delta (fun s -> s.Thread.runtime) s in
+				let switches =
+					try s.Thread.switches - (Hashtbl.find before s.Thread.ident).Thread.switches
+					with Not_found -> s.Thread.switches
+				in
+				printf "%4d %-24s %5Ld%% %10Ld %10Ld %8d%s\n"
+					s.Thread.ident s.Thread.name
+					(Int64.div (Int64.mul run 100L) total)
+					run (delta (fun s -> s.Thread.waittime) s) switches
+					(if s.Thread.blocked then " (blocked)" else "")
+			end after
+		end [
+			"-i", Arg.Set_int interval, "ticks to sample over";
+		];
+	add_command "trace" begin fun () ->
+			Thread.trace_start ();
+			Thread.usleep !interval;
+			Thread.trace_dump ();
+			printf "trace written to serial\n"
+		end [];
 	(* then spawn the shell *)
 	ignore (Thread.create shell () "shell")
@@ -32,6 +32,7 @@ Printf.printf "init starting...\n";
 	(*IRC.init ();
 	Printf.eprintf "IRC initialised\n";*)
 	IDE.init ();
+	IDE.init2 ();
 	Printf.eprintf "IDE initialised\n";
 	Tar_vfs.init ();
 	Printf.printf "Tar_vfs initialised\n";
@@ -69,11 +70,15 @@ end;
 	(* probe the PCI bus and load any drivers it can find *)
 	DeviceManager.scan_pci_bus ();
 	
+	(* after the scan, so that it only takes the mixer if no AC97 did *)
+	Sb16.init ();
+	Printf.eprintf "Sb16 initialised\n";
+	
 	(*(* get the partitions for the primary master *)
 	let partitions =
 		begin try
 			let disk = IDE.get IDE.Primary IDE.Master in
-			let partitions = Partitions.partitions_t (IDE.read_disk disk) (fun _ _ _ -> ()) in
+			let partitions = Partitions.of_device (IDE.cache disk) in
 			(* display found partitions *)
 			if partitions = [] then
 				Vt100.printf "No partitions found on ide:0:0\r\n"
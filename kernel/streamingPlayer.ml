@@ -67,17 +67,21 @@ let playsong database filename =
 	ignore (IO.really_input stream string_buffer 0 buf_size);
 	Array1.blit_from_string string_buffer input_buffer.BlockIO.data;
 	Vt100.printf "+";
-	AudioMixer.play (AudioMixer.Wave.read input_buffer);
-	
-	(* now process all remaining buffers *)
-	while true do
-		Vt100.printf " ";
-		ignore (IO.really_input stream string_buffer 0 buf_size);
-		input_buffer.BlockIO.pos <- 0; (* reset buffer *)
-		Array1.blit_from_string string_buffer input_buffer.BlockIO.data;
-		Vt100.printf "-";
-		AudioMixer.play_raw input_buffer;
-	done
+	let mix = AudioMixer.open_stream "stream" in
+	(* the loop only ends by an exception; the stream goes with it *)
+	try
+		AudioMixer.play ~stream:mix (AudioMixer.Wave.read input_buffer);
+		
+		(* now process all remaining buffers *)
+		while true do
+			Vt100.printf " ";
+			ignore (IO.really_input stream string_buffer 0 buf_size);
+			input_buffer.BlockIO.pos <- 0; (* reset buffer *)
+			Array1.blit_from_string string_buffer input_buffer.BlockIO.data;
+			Vt100.printf "-";
+			AudioMixer.play_raw ~stream:mix input_buffer;
+		done
+	with exn -> AudioMixer.close_stream mix; raise exn
 	with exn -> Vt100.printf "playsong: error: %s\n" (Printexc.to_string exn)
 
 (* the shell interface *)
@@ -3,17 +3,7 @@
 
 type record = { ofs : int; size : int }
 
-module Order = struct
-	type t = string list
-	type key = record option
-	type index = string
-	let to_index = (fun x -> x)
-	let from_index = (fun x -> x)
-end
-
-module TarFile = Trie.Make(Order)
-
-type entry = File | Directory | Link | Unknown
+type entry = File | Directory | Link | Long_name | Unknown
 
 let octal s = Scanf.sscanf s "%o" (fun x -> x)
 let round n = if n mod 512 = 0 then n else n + 512 - n mod 512
@@ -31,79 +21,280 @@ let split_on_slash path =
 	else if len = 1 && path.[0] = '/' then []
 	else split 0
 
+(* all reads go through the block cache, so neighbouring headers and
+   consecutive bytes of a file cost one disk command per run of blocks *)
 module IDE_stuff = struct
+	let disk = lazy (IDE.get IDE.Primary IDE.Master)
+	let device = lazy (IDE.cache (Lazy.force disk))
+	
 	let read offset length =
-		let l = (length + 512) / 512 in
-		let s = offset / 512 in
-		(*Debug.printf "reading data: %d (%d), %d (%d)\n" s offset l length;*)
-		let disk = IDE.get IDE.Primary IDE.Master in
-		let data = IDE.read_disk disk s l in
-		(*for i = 0 to 511 do
-			if i mod 16 = 0 then Debug.printf "\n%03x: " (i/16);
-			Debug.printf "%c" data.[i];
-		done;*)
-		String.sub data (offset mod 512) length
+		let data = String.create length in
+		BlockCache.read_bytes (Lazy.force device) offset data 0 length;
+		data
+	
+	let read_into offset buf pos length =
+		BlockCache.read_bytes (Lazy.force device) offset buf pos length
+	
+	let blit sector ofs dst =
+		BlockCache.blit (Lazy.force device) sector ofs dst
 	
 	let read_sector n =
-		let disk = IDE.get IDE.Primary IDE.Master in
-		IDE.read_disk disk n 1
+		BlockCache.read (Lazy.force device) n 1
+	
+	let read_sectors n count =
+		BlockCache.read (Lazy.force device) n count
+	
+	let write_sectors n count data =
+		BlockCache.write (Lazy.force device) n count data;
+		BlockCache.flush (Lazy.force device)
+	
+	let sectors () = IDE.sectors (Lazy.force disk)
+	
+	let byte offset =
+		BlockCache.get_byte (Lazy.force device) offset
 end
 
-let trie () =
-	let trie = TarFile.empty () in
-	let size = 861818880 in
-	let read ofs len =
-		let len =
-			if ofs >= size then 0
-			else min (size - ofs) len in
-		let buf = IDE_stuff.read ofs len in
-		try
-			String.sub buf 0 (String.index buf '\000')
-		with Not_found -> buf
-	in
-	let name ofs = "/" ^ read ofs 100 in
-	let size ofs = octal (read (ofs + 124) 12) in
-	let magic ofs = read (ofs + 257) 8 in
-	let kind ofs = 
-		let s = read (ofs + 256) 1 in
-		if String.length s = 0 then File
-		else match s.[0] with
-			| '\000' | '0' | '7' -> File
-			| '5' -> Directory
-			| '1' | '2' -> Link
-			| _ -> Unknown
+(* The index: every path in the archive, directories included whether or
+   not they have a header of their own, sorted so that a lookup is a
+   binary search and a directory's children are one run of the table.
+   Paths have no leading slash; "" is the root. *)
+type index = {
+	paths : string array;
+	records : record option array; (* None for a directory *)
+	archive_end : int; (* just past the end-of-archive blocks *)
+	headers : int; (* hash of every header, end-of-archive block included *)
+}
+
+let find index path =
+	let rec search lo hi =
+		if lo >= hi then raise Not_found
+		else
+			let mid = (lo + hi) / 2 in
+			let c = compare path index.paths.(mid) in
+			if c = 0 then mid
+			else if c < 0 then search lo mid
+			else search (mid + 1) hi
+	in search 0 (Array.length index.paths)
+
+(* the first slot whose path is >= [path] *)
+let lower_bound index path =
+	let rec search lo hi =
+		if lo >= hi then lo
+		else
+			let mid = (lo + hi) / 2 in
+			if compare index.paths.(mid) path < 0 then search (mid + 1) hi else search lo mid
+	in search 0 (Array.length index.paths)
+
+let children index dir =
+	let prefix = if dir = "" then "" else dir ^ "/" in
+	let n = String.length prefix in
+	let starts p = String.length p > n && String.sub p 0 n = prefix in
+	let rec collect i acc =
+		if i < Array.length index.paths && starts index.paths.(i) then begin
+			let p = index.paths.(i) in
+			let acc =
+				if String.contains_from p n '/' then acc
+				else String.sub p n (String.length p - n) :: acc in
+			collect (i + 1) acc
+		end else List.rev acc
+	in collect (lower_bound index prefix) []
+
+(* Scanning. Headers are parsed out of a window of the archive that is
+   read [window_size] bytes at a time, so a run of small files costs one
+   read rather than one per header field; file data the window doesn't
+   cover is skipped without being read. *)
+
+let window_size = 128 * 1024
+
+let field h ofs len =
+	let s = String.sub h ofs len in
+	try String.sub s 0 (String.index s '\000') with Not_found -> s
+
+let kind h =
+	match h.[156] with
+	| '\000' | '0' | '7' -> File
+	| '5' -> Directory
+	| '1' | '2' -> Link
+	| 'L' -> Long_name
+	| _ -> Unknown
+
+(* fold one header into the hash of the chain *)
+let mix h header = (h * 65599 + Hashtbl.hash header) land 0x3FFFFFFF
+
+let scan () =
+	let limit =
+		let sectors = IDE_stuff.sectors () in
+		if sectors > max_int / 512 then max_int else sectors * 512 in
+	let window = ref "" and window_ofs = ref 0 in
+	let header ofs =
+		if ofs < !window_ofs || ofs + 512 > !window_ofs + String.length !window then begin
+			let len = min window_size (limit - ofs) in
+			if len < 512 then raise End_of_file;
+			window := IDE_stuff.read ofs len;
+			window_ofs := ofs
+		end;
+		String.sub !window (ofs - !window_ofs) 512
 	in
-	
-	let rec make ofs =
-		let real_name = name ofs in
-		let name = split_on_slash real_name in
-		if name = [] then TarFile.insert [] None trie
+	let table = Hashtbl.create 1024 in
+	(* add [path] and any parent directories not seen yet *)
+	let rec add path r =
+		Hashtbl.replace table path r;
+		if path <> "" then begin
+			let parent = try String.sub path 0 (String.rindex path '/') with Not_found -> "" in
+			if not (Hashtbl.mem table parent) then add parent None
+		end in
+	add "" None;
+	let headers = ref 0 in
+	let rec loop ofs long_name =
+		let h = try header ofs with End_of_file -> String.make 512 '\000' in
+		headers := mix !headers h;
+		let name = field h 0 100 in
+		if name = "" then ofs + 1024
 		else begin
-			let magic = magic ofs in
-			if magic <> "ustar  " && magic <> "       " then
+			let magic = String.sub h 257 8 in
+			if String.sub magic 0 5 <> "ustar" && magic <> "       " then
 				raise (Sys_error ("Invalid TAR file: " ^ magic ^ "."));
-			match kind ofs with
+			let size = octal (field h 124 12) in
+			let name = match long_name with
+				| Some n -> n
+				| None ->
+					let prefix = if magic = "ustar\00000" then field h 345 155 else "" in
+					if prefix = "" then name else prefix ^ "/" ^ name in
+			let path = String.concat "/" (List.filter (fun n -> n <> ".") (split_on_slash name)) in
+			let next = ofs + 512 + round size in
+			match kind h with
 			| File ->
-				let r = { ofs = ofs + 512; size = size ofs } in
-				(* does multiple insertions =( ah well *)
-				ignore (List.fold_left (fun path n ->
-					let path = path @ [n] in
-					if path = name then TarFile.insert path (Some r) trie
-					else TarFile.insert path None trie; path) [] name);
-				make (round (r.ofs + r.size))
+				add path (Some { ofs = ofs + 512; size = size });
+				loop next None
 			| Directory ->
-				TarFile.insert name None trie;
-				make (ofs + 512)
-			| _ -> raise (Sys_error "Unknown type of TAR entry")
+				if not (Hashtbl.mem table path) then add path None;
+				loop next None
+			| Long_name ->
+				loop next (Some (field (IDE_stuff.read (ofs + 512) size) 0 size))
+			| Link | Unknown ->
+				loop next None
 		end
-	in make 0;
-	trie
+	in
+	let archive_end = loop 0 None in
+	let entries = List.sort compare (Hashtbl.fold (fun p r acc -> (p, r) :: acc) table []) in
+	{
+		paths = Array.of_list (List.map fst entries);
+		records = Array.of_list (List.map snd entries);
+		archive_end = archive_end;
+		headers = !headers;
+	}
+
+(* The index is cached in the sectors at the end of the disk, behind the
+   archive. The disk's last sector is a trailer saying where the index
+   starts; it also records the archive's end and a hash of its headers so
+   that an index left behind by an older image isn't trusted. Checking
+   that hash reads every header, but none of the file data a scan's
+   windows bring in, and sorts nothing. *)
+
+let index_magic = "TARIDX02"
+
+let get32 s i =
+	Char.code s.[i] lor (Char.code s.[i + 1] lsl 8)
+	lor (Char.code s.[i + 2] lsl 16) lor (Char.code s.[i + 3] lsl 24)
+
+let put32 b n =
+	for i = 0 to 3 do Buffer.add_char b (Char.chr ((n lsr (8 * i)) land 0xFF)) done
+
+(* follow the header chain as [scan] does, hashing it; the chain must
+   end exactly where the trailer says the archive does *)
+let headers_hash archive_end =
+	let rec walk ofs h =
+		if ofs + 1024 > archive_end then raise Not_found;
+		let header = IDE_stuff.read ofs 512 in
+		let h = mix h header in
+		if field header 0 100 = "" then
+			if ofs + 1024 = archive_end then h else raise Not_found
+		else walk (ofs + 512 + round (octal (field header 124 12))) h
+	in walk 0 0
+
+let encode index =
+	let b = Buffer.create (Array.length index.paths * 32) in
+	Array.iteri (fun i p ->
+		Buffer.add_char b (Char.chr (String.length p land 0xFF));
+		Buffer.add_char b (Char.chr (String.length p lsr 8));
+		Buffer.add_string b p;
+		match index.records.(i) with
+		| None -> Buffer.add_char b 'd'
+		| Some r -> Buffer.add_char b 'f'; put32 b r.ofs; put32 b r.size) index.paths;
+	Buffer.contents b
+
+let decode data count archive_end headers =
+	let paths = Array.make count "" and records = Array.make count None in
+	let rec loop i pos =
+		if i < count then begin
+			let len = Char.code data.[pos] lor (Char.code data.[pos + 1] lsl 8) in
+			paths.(i) <- String.sub data (pos + 2) len;
+			let pos = pos + 2 + len in
+			if data.[pos] = 'f' then begin
+				records.(i) <- Some { ofs = get32 data (pos + 1); size = get32 data (pos + 5) };
+				loop (i + 1) (pos + 9)
+			end else
+				loop (i + 1) (pos + 1)
+		end
+	in
+	loop 0 0;
+	{ paths = paths; records = records; archive_end = archive_end; headers = headers }
+
+let load () =
+	let last = IDE_stuff.sectors () - 1 in
+	let trailer = IDE_stuff.read_sector last in
+	if String.sub trailer 0 8 <> index_magic then None
+	else begin
+		let start = get32 trailer 8 and length = get32 trailer 12 in
+		let count = get32 trailer 16 and archive_end = get32 trailer 20 in
+		let headers = get32 trailer 24 in
+		if start < archive_end / 512 || start + (length + 511) / 512 > last
+		|| IDE_stuff.read (archive_end - 1024) 1024 <> String.make 1024 '\000'
+		|| headers_hash archive_end <> headers then None
+		else begin
+			let data = IDE_stuff.read_sectors start ((length + 511) / 512) in
+			if get32 trailer 28 <> Hashtbl.hash (String.sub data 0 length) then None
+			else Some (decode data count archive_end headers)
+		end
+	end
+
+let save index =
+	let data = encode index in
+	let count = (String.length data + 511) / 512 in
+	let last = IDE_stuff.sectors () - 1 in
+	let start = last - count in
+	(* only into space the archive doesn't use *)
+	if start >= (index.archive_end + 511) / 512 then begin
+		let padded = String.make (count * 512) '\000' in
+		String.blit data 0 padded 0 (String.length data);
+		IDE_stuff.write_sectors start count padded;
+		let b = Buffer.create 512 in
+		Buffer.add_string b index_magic;
+		List.iter (put32 b) [start; String.length data; Array.length index.paths;
+			index.archive_end; index.headers; Hashtbl.hash data];
+		Buffer.add_string b (String.make (512 - Buffer.length b) '\000');
+		IDE_stuff.write_sectors last 1 (Buffer.contents b)
+	end
+
+(* Off by default: saving writes the last sectors of the boot disk *)
+let cache_index = ref false
+
+let index () =
+	match (try load () with _ -> None) with
+	| Some index -> index
+	| None ->
+		let index = scan () in
+		if !cache_index then
+			(try save index with ex ->
+				Vt100.printf "tarfs: couldn't save index: %s\n" (Printexc.to_string ex));
+		index
 
 (* The VFS Implementation for tar files...???? *)
 
 module FileSystem (*: Vfs.FileSystem*) = struct
 	type inode = {
-			trie : TarFile.t;
+			path : string;
+			record : record option;
 			mutable offset : int;
 			mutable position : int;
 			mutable length : int;
@@ -113,7 +304,7 @@ module FileSystem (*: Vfs.FileSystem*) = struct
 		type t = inode
 		
 		let open_in inode _ =
-			match TarFile.find_empty inode.trie with
+			match inode.record with
 				| None -> failwith "not a file"
 				| Some r ->
 					inode.offset <- r.ofs;
@@ -124,39 +315,28 @@ module FileSystem (*: Vfs.FileSystem*) = struct
 		let flush_in _ _ = ()
 		let input_byte inode _ =
 			if inode.position >= inode.length then raise End_of_file;
-			(* find disk sector offset+position in *)
-			let sector = (inode.offset + inode.position) / 512 in
-			let offset = inode.position mod 512 in
-			(*let buffer = IDE.read_disk 0x00 sector 1 in*)
-			let buffer = IDE_stuff.read_sector sector in
+			let byte = IDE_stuff.byte (inode.offset + inode.position) in
 			inode.position <- inode.position + 1;
-			(*Debug.printf "input_byte: %d\r\n" (Char.code buffer.[offset]);*)
-			Char.code buffer.[offset]
+			byte
 		
+		(* both go through the cache a block at a time, reading ahead
+		   while the file is read in order *)
 		let input_bytes inode obuf ofs len =
-			if inode.position >= inode.length then 0
-			else begin
-				let n = (inode.offset + inode.position) / 512 in
-				let s = min len (inode.length - inode.position - len) in
-				let buf = IDE_stuff.read_sector n in
-				let pos = inode.position mod 512 in
-				String.blit buf pos obuf ofs (min s (512-pos));
-				for i = 1 to s / 512 - 1 do
-					(*let buf = IDE.read_disk 0x00 (i+n) 1 in*)
-					let buf = IDE_stuff.read_sector (i+n) in
-					String.blit buf 0 obuf (i * 512 + ofs - pos) 512;
-				done;
-				(* this bit isn't quite right given bit above... *)
-				if (s-pos) mod 512 <> 0 && ((s/512)+n) <> n then begin
-					let rem = s mod 512 in
-					(*let buf = IDE.read_disk 0x00 ((s / 512) + n) 1 in*)
-					let buf = IDE_stuff.read_sector ((s / 512) + n) in
-					String.blit buf 0 obuf (String.length obuf - rem - pos) rem;
-				end;
-				(* return *)
-				inode.position <- inode.position + s;
-				s
-			end
+			let n = max 0 (min len (inode.length - inode.position)) in
+			if n > 0 then begin
+				IDE_stuff.read_into (inode.offset + inode.position) obuf ofs n;
+				inode.position <- inode.position + n
+			end;
+			n
+		
+		let input_bigarray inode dst ofs len =
+			let n = max 0 (min len (inode.length - inode.position)) in
+			if n > 0 then begin
+				let at = inode.offset + inode.position in
+				IDE_stuff.blit (at / 512) (at mod 512) (Bigarray.Array1.sub (BlockIO.of_vfs dst) ofs n);
+				inode.position <- inode.position + n
+			end;
+			n
 		
 		let seek_in inode npos =
 			if npos > inode.length || npos < 0 then raise (Invalid_argument "npos");
@@ -168,29 +348,23 @@ module FileSystem (*: Vfs.FileSystem*) = struct
 		
 	end
 	
-	let trie = lazy (trie ())
+	let index = lazy (index ())
 	
 	let walk path =
-			{
-				trie = TarFile.restrict_direct path (Lazy.force trie);
-				offset = 0; position = 0; length = 0;
-			}
-	
-	let is_directory cookie _ =
-		match TarFile.find_empty cookie.trie with
-			None -> true | _ -> false		
+		let index = Lazy.force index in
+		let path = String.concat "/" (List.filter (fun n -> n <> "") path) in
+		{
+			path = path;
+			record = index.records.(find index path);
+			offset = 0; position = 0; length = 0;
+		}
 	
-	let rec nub = function
-		| x :: y :: rest when x = y -> nub (y::rest)
-		| x :: rest -> x :: nub rest
-		| [] -> []
+	let is_directory cookie _ = cookie.record = None
 	
 	let read_dir cookie _ =
-		match TarFile.find_empty cookie.trie with
+		match cookie.record with
 		| Some _ -> failwith "Not a directory"
-		| None ->
-			let entries = TarFile.fold (fun elt -> List.hd elt) cookie.trie in
-			nub (List.sort compare entries)
+		| None -> children (Lazy.force index) cookie.path
 end
 
 open Vfs
@@ -205,6 +379,7 @@ let init () =
 				close_in = FileSystem.Ops.close_in cookie;
 				input_byte = FileSystem.Ops.input_byte cookie;
 				input_bytes = FileSystem.Ops.input_bytes cookie;
+				input_bigarray = FileSystem.Ops.input_bigarray cookie;
 				seek_in = FileSystem.Ops.seek_in cookie;
 				pos_in = FileSystem.Ops.pos_in cookie;
 				length_in = FileSystem.Ops.length_in cookie;
@@ -44,6 +44,19 @@ let date () =
 	int_of_bcd (read R.month),
 	(int_of_bcd (read R.year)) + (int_of_bcd (read R.century)) * 100
 
+(* seconds since 1970-01-01, taking the RTC to keep UTC *)
+let unix_time () =
+	let _, d, m, y = date () in
+	let h, mi, s = time () in
+	(* days from the civil date, counting years from March *)
+	let y = if m <= 2 then y - 1 else y in
+	let era = y / 400 in
+	let yoe = y - era * 400 in
+	let doy = (153 * ((m + 9) mod 12) + 2) / 5 + d - 1 in
+	let doe = yoe * 365 + yoe / 4 - yoe / 100 + doy in
+	let days = era * 146097 + doe - 719468 in
+	Int64.add (Int64.mul (Int64.of_int days) 86400L) (Int64.of_int (h * 3600 + mi * 60 + s))
+
 let weekday = function
 | 0 -> "Sunday"
 | 1 -> "Monday"
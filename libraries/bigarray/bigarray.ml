@@ -115,6 +115,7 @@ module Array1 = struct
     ba
   external to_string: ('a, 'b, 'c) t -> string = "caml_ba_to_string"
   external blit_from_string: string -> ('a, 'b, 'c) t -> unit = "caml_ba_blit_from_string"
+  external blit_to_string: ('a, 'b, 'c) t -> string -> int -> unit = "caml_ba_blit_to_string"
 end
 
 module Array2 = struct
@@ -454,6 +454,11 @@ module Array1 : sig
   (** Copy the string to the big array, number of bytes minimum
      of the length of string and bigarray. *)
 
+  external blit_to_string: ('a, 'b, 'c) t -> string -> int -> unit
+      = "caml_ba_blit_to_string"
+  (** [blit_to_string a s ofs] copies the whole big array into [s]
+     starting at [ofs]. Raise [Invalid_argument] if it does not fit. *)
+
 end
 
 
@@ -1027,6 +1027,22 @@ CAMLprim value caml_ba_blit_from_string(value src, value vdst)
 	return Val_unit;
 }
 
+/* Copying a big array into part of an existing string */
+
+CAMLprim value caml_ba_blit_to_string(value vsrc, value dst, value ofs)
+{
+	struct caml_ba_array * src = Caml_ba_array_val(vsrc);
+	intnat num_bytes;
+	num_bytes =
+		caml_ba_num_elts(src)
+		* caml_ba_element_size[src->flags & CAML_BA_KIND_MASK];
+	if (Long_val(ofs) < 0 || Long_val(ofs) + num_bytes > caml_string_length(dst)) {
+		caml_invalid_argument("Bigarray.blit_to_string: string too short");
+	}
+	memcpy(String_val(dst) + Long_val(ofs), src->data, num_bytes);
+	return Val_unit;
+}
+
 /* Filling a big array with a given value */
 
 CAMLprim value caml_ba_fill(value vb, value vinit)
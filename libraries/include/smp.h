@@ -0,0 +1,57 @@
+#ifndef _SMP_H
+#define _SMP_H
+
+#include <list.h>
+
+#define MAX_CPUS 8
+
+/* Application processors never enter the OCaml runtime or the thread
+ * scheduler in threads.c; they run smp tasks to completion from per-CPU
+ * run queues. Tasks must not call malloc/free or any caml_* function. A
+ * long-running task (e.g. a NIC polling loop) simply keeps its CPU. */
+
+typedef struct spinlock {
+	volatile unsigned long locked;
+} spinlock_t;
+
+typedef struct smp_task {
+	void (*fn)(void *);
+	void *arg;
+	volatile int done;
+	int cpu; /* whose run queue it went on */
+	link_t link;
+} smp_task_t;
+
+static inline void spin_lock(spinlock_t *lock)
+{
+	unsigned long old;
+
+	do {
+		while (lock->locked) {
+			asm volatile("pause");
+		}
+		old = 1;
+		asm volatile("xchg %0, %1" : "+r"(old), "+m"(lock->locked) :: "memory");
+	} while (old);
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+	asm volatile("" ::: "memory");
+	lock->locked = 0;
+}
+
+extern int smp_init(void);
+extern int smp_cpus(void);
+extern int smp_cpu_id(void);
+
+/* Queue [task] on the least loaded application processor. Returns -1 if
+ * there are none, in which case the caller should run it itself. */
+extern int smp_spawn(smp_task_t *task, void (*fn)(void *), void *arg);
+
+/* Take back a spawned task that no processor has started. Returns 1 if it
+ * was still queued, and the caller should run it itself; 0 if it has
+ * started, in which case it will finish and set [done]. */
+extern int smp_cancel(smp_task_t *task);
+
+#endif
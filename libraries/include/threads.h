@@ -8,17 +8,33 @@
 #define KILLED 2
 #define EXITED 4
 
+#define THREAD_NAME_LEN 24
+
+/* Stack size used by thread_create, in bytes */
+#define THREAD_DEFAULT_STACK_SIZE (64 * 1024)
+
 typedef struct thread {
 	unsigned long *stack;
+	unsigned long stack_size;
 	unsigned long *esp;
 	void *slot;
 	unsigned long id;
 	unsigned long status;
+	char name[THREAD_NAME_LEN];
+	
+	/* CPU accounting, in TSC cycles. stamp is when the thread last got the
+	 * CPU, or when it last became runnable while it waits for it */
+	unsigned long long runtime;
+	unsigned long long waittime;
+	unsigned long long stamp;
+	unsigned long switches;
 	
 	/* Doubly-linked list of threads in the system */
 	link_t global_link;
-	/* Doubly-linked list of ready to run threads */
+	/* Doubly-linked list of ready to run threads, or of timed sleepers */
 	link_t run_link;
+	/* TSC deadline while in thread_sleep_until, otherwise 0 */
+	unsigned long long wake_at;
 } real_thread_t;
 
 /* Pointer to emulate unique thread ID semantics of pthread_t */
@@ -42,15 +58,35 @@ typedef struct cond {
 
 typedef void *(*thread_func)(void *);
 
+/* A copy of one thread's accounting, see thread_snapshot */
+typedef struct thread_info {
+	unsigned long id;
+	unsigned long status;
+	char name[THREAD_NAME_LEN];
+	unsigned long long runtime;
+	unsigned long long waittime;
+	unsigned long switches;
+} thread_info_t;
+
 extern void thread_init();
 extern void thread_yield();
 extern void thread_exit(void *);
 extern void thread_create(thread_t *, void *(*)(void *), void *);
+extern void thread_create_sized(thread_t *, unsigned long, void *(*)(void *), void *);
+extern void thread_stack_stats(unsigned long *, unsigned long *, unsigned long *);
 extern thread_t thread_self();
 extern void thread_setspecific(void *);
 extern void *thread_getspecific();
 extern void thread_sleep();
 extern void thread_wake(thread_t);
+extern void thread_sleep_until(unsigned long long);
+extern void thread_timer_tick(void);
+extern void thread_set_name(thread_t, const char *);
+extern int thread_snapshot(thread_info_t *, int);
+extern unsigned long thread_cycles_per_usec(void);
+extern void thread_trace_start(void);
+extern void thread_trace_stop(void);
+extern void thread_trace_dump(void);
 
 //extern mutex_t *mutex_create();
 extern void mutex_init(mutex_t *);
@@ -0,0 +1,337 @@
+
+/* apic.c
+ *
+ * Local APIC / IOAPIC interrupt routing and MSI vector allocation.
+ *
+ * The MADT is located through the ACPI RSDP. When it describes an IOAPIC,
+ * the 8259s are masked off and every ISA IRQ is redirected to the same
+ * vector the PIC would have used (32 + irq), so the stubs in irqs.S and
+ * signal_handlers keep working unchanged; only masking and EOI differ.
+ * Lines MSI_FIRST .. IRQ_LINES-1 have no pin at all and are handed out to
+ * PCI devices that can signal MSI or MSI-X. */
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+
+#include <asm.h>
+#include <stdio.h>
+#include <string.h>
+#include <smp.h>
+#include "idt.h"
+
+#define LAPIC_DEFAULT  0xFEE00000
+#define LAPIC_ID       0x20
+#define LAPIC_TPR      0x80
+#define LAPIC_EOI      0xB0
+#define LAPIC_SVR      0xF0
+#define LAPIC_ICR_LO   0x300
+#define LAPIC_ICR_HI   0x310
+
+#define ICR_PENDING    (1 << 12)
+
+#define IOAPIC_VER     0x01
+#define IOAPIC_REDTBL  0x10
+
+#define REDIR_MASKED   (1 << 16)
+#define REDIR_LEVEL    (1 << 15)
+#define REDIR_LOW      (1 << 13)
+
+#define MADT_LAPIC     0
+#define MADT_IOAPIC    1
+#define MADT_OVERRIDE  2
+
+#define MAX_IOAPICS    4
+
+typedef struct ioapic {
+	volatile unsigned int *base;
+	unsigned int gsi_base;
+	unsigned int pins;
+} ioapic_t;
+
+int apic_enabled = 0;
+
+static volatile unsigned int *lapic = (volatile unsigned int *)LAPIC_DEFAULT;
+static unsigned int lapic_id;
+
+static ioapic_t ioapics[MAX_IOAPICS];
+static int ioapic_count = 0;
+
+/* ISA IRQ -> global system interrupt, and redirection flags, from the MADT */
+static unsigned int isa_gsi[16];
+static unsigned int isa_flags[16];
+/* the mask the redirection entries were last programmed with */
+static unsigned int programmed_mask;
+
+static int next_msi_line = MSI_FIRST;
+
+/* Local APIC ids of the enabled processors, boot processor included */
+unsigned char apic_cpu_ids[MAX_CPUS];
+int apic_cpu_count = 0;
+
+static inline unsigned int lapic_read(int reg)
+{
+	return lapic[reg / 4];
+}
+
+static inline void lapic_write(int reg, unsigned int val)
+{
+	lapic[reg / 4] = val;
+}
+
+static unsigned int ioapic_read(ioapic_t *io, int reg)
+{
+	io->base[0] = reg;
+	return io->base[4];
+}
+
+static void ioapic_write(ioapic_t *io, int reg, unsigned int val)
+{
+	io->base[0] = reg;
+	io->base[4] = val;
+}
+
+static ioapic_t *ioapic_for(unsigned int gsi, int *pin)
+{
+	int i;
+
+	for (i = 0; i < ioapic_count; ++i) {
+		if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].pins) {
+			*pin = gsi - ioapics[i].gsi_base;
+			return &ioapics[i];
+		}
+	}
+	return NULL;
+}
+
+static void redirect(int irq, int masked)
+{
+	int pin;
+	ioapic_t *io = ioapic_for(isa_gsi[irq], &pin);
+
+	if (io == NULL) {
+		return;
+	}
+	ioapic_write(io, IOAPIC_REDTBL + pin * 2 + 1, lapic_id << 24);
+	ioapic_write(io, IOAPIC_REDTBL + pin * 2,
+		(MASTER + irq) | isa_flags[irq] | (masked ? REDIR_MASKED : 0));
+}
+
+/* ACPI table discovery */
+
+static int checksum(unsigned char *p, unsigned int len)
+{
+	unsigned char sum = 0;
+
+	while (len--) {
+		sum += *p++;
+	}
+	return sum == 0;
+}
+
+static unsigned char *find_rsdp(unsigned char *start, unsigned int len)
+{
+	unsigned char *p;
+
+	for (p = start; p < start + len; p += 16) {
+		if (memcmp(p, "RSD PTR ", 8) == 0 && checksum(p, 20)) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static unsigned char *find_madt(void)
+{
+	unsigned char *rsdp, *rsdt;
+	unsigned int i, entries;
+	unsigned int ebda = *(unsigned short *)0x40E << 4;
+
+	rsdp = ebda ? find_rsdp((unsigned char *)ebda, 1024) : NULL;
+	if (rsdp == NULL) {
+		rsdp = find_rsdp((unsigned char *)0xE0000, 0x20000);
+	}
+	if (rsdp == NULL) {
+		return NULL;
+	}
+
+	rsdt = (unsigned char *)*(unsigned int *)(rsdp + 16);
+	if (memcmp(rsdt, "RSDT", 4) != 0) {
+		return NULL;
+	}
+	entries = (*(unsigned int *)(rsdt + 4) - 36) / 4;
+	for (i = 0; i < entries; ++i) {
+		unsigned char *table = (unsigned char *)((unsigned int *)(rsdt + 36))[i];
+		if (memcmp(table, "APIC", 4) == 0 && checksum(table, *(unsigned int *)(table + 4))) {
+			return table;
+		}
+	}
+	return NULL;
+}
+
+static void parse_madt(unsigned char *madt)
+{
+	unsigned char *p = madt + 44;
+	unsigned char *end = madt + *(unsigned int *)(madt + 4);
+
+	lapic = (volatile unsigned int *)*(unsigned int *)(madt + 36);
+
+	for (; p < end && p[1] != 0; p += p[1]) {
+		switch (p[0]) {
+		case MADT_LAPIC:
+			if ((p[4] & 1) && apic_cpu_count < MAX_CPUS) {
+				apic_cpu_ids[apic_cpu_count++] = p[3];
+			}
+			break;
+		case MADT_IOAPIC:
+			if (ioapic_count < MAX_IOAPICS) {
+				ioapic_t *io = &ioapics[ioapic_count++];
+				io->base = (volatile unsigned int *)*(unsigned int *)(p + 4);
+				io->gsi_base = *(unsigned int *)(p + 8);
+				io->pins = ((ioapic_read(io, IOAPIC_VER) >> 16) & 0xFF) + 1;
+			}
+			break;
+		case MADT_OVERRIDE:
+			if (p[2] == 0 && p[3] < 16) {
+				unsigned short flags = *(unsigned short *)(p + 8);
+				isa_gsi[p[3]] = *(unsigned int *)(p + 4);
+				isa_flags[p[3]] = 0;
+				if ((flags & 3) == 3) {
+					isa_flags[p[3]] |= REDIR_LOW;
+				}
+				if (((flags >> 2) & 3) == 3) {
+					isa_flags[p[3]] |= REDIR_LEVEL;
+				}
+			}
+			break;
+		}
+	}
+}
+
+int apic_init(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	unsigned char *madt;
+	int i;
+
+	asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+	if (!(edx & (1 << 9))) {
+		return 0;
+	}
+
+	for (i = 0; i < 16; ++i) {
+		isa_gsi[i] = i;
+		isa_flags[i] = 0;
+	}
+
+	madt = find_madt();
+	if (madt == NULL) {
+		return 0;
+	}
+	parse_madt(madt);
+	if (ioapic_count == 0) {
+		return 0;
+	}
+
+	/* Software-enable the local APIC, spurious interrupts on vector 0xFF */
+	lapic_id = lapic_read(LAPIC_ID) >> 24;
+	lapic_write(LAPIC_TPR, 0);
+	lapic_write(LAPIC_SVR, 0x100 | SPURIOUS);
+
+	/* The 8259s stay initialised but never deliver anything again */
+	out8(PICMI, 0xFF);
+	out8(PICSI, 0xFF);
+
+	apic_enabled = 1;
+	for (i = 0; i < 16; ++i) {
+		/* IRQ 2 is the PIC cascade; its pin usually carries the timer */
+		if (i != 2) {
+			redirect(i, signal_mask & (1 << i));
+		}
+	}
+	programmed_mask = signal_mask;
+
+	dprintf("apic: lapic %d at %08x, %d ioapic(s)\r\n", lapic_id, (unsigned int)lapic, ioapic_count);
+	return 1;
+}
+
+/* Called around every IRQ, so only the pins whose bit changed are
+   reprogrammed */
+void apic_update_mask(unsigned int mask)
+{
+	unsigned int changed = (mask ^ programmed_mask) & 0xFFFB; /* not the cascade */
+	int i;
+
+	for (i = 0; changed != 0; ++i, changed >>= 1) {
+		if (changed & 1) {
+			redirect(i, mask & (1 << i));
+		}
+	}
+	programmed_mask = mask;
+}
+
+void apic_eoi(void)
+{
+	lapic_write(LAPIC_EOI, 0);
+}
+
+unsigned int apic_id(void)
+{
+	return lapic_read(LAPIC_ID) >> 24;
+}
+
+/* Software-enable the local APIC of an application processor */
+void apic_local_init(void)
+{
+	lapic_write(LAPIC_TPR, 0);
+	lapic_write(LAPIC_SVR, 0x100 | SPURIOUS);
+}
+
+/* [command] is the low ICR word: vector, delivery mode and level bits */
+void apic_send_ipi(unsigned int dest, unsigned int command)
+{
+	while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING) {
+		asm volatile("pause");
+	}
+	lapic_write(LAPIC_ICR_HI, dest << 24);
+	lapic_write(LAPIC_ICR_LO, command);
+	while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING) {
+		asm volatile("pause");
+	}
+}
+
+/* ML interface */
+
+CAMLprim value snowflake_apic_enabled(value unit) {
+	return Val_bool(apic_enabled);
+}
+
+/* PCI INTx lines are level triggered, active low */
+CAMLprim value snowflake_irq_level(value irq) {
+	int i = Int_val(irq);
+
+	if (apic_enabled && i < 16 && i != 2) {
+		isa_flags[i] |= REDIR_LEVEL | REDIR_LOW;
+		redirect(i, signal_mask & (1 << i));
+	}
+	return Val_unit;
+}
+
+CAMLprim value snowflake_msi_allocate(value unit) {
+	if (!apic_enabled || next_msi_line >= IRQ_LINES) {
+		caml_raise_not_found();
+	}
+	return Val_int(next_msi_line++);
+}
+
+/* (message address, message data) that raise [line] on this CPU */
+CAMLprim value snowflake_msi_message(value line) {
+	CAMLparam1(line);
+	CAMLlocal1(result);
+
+	result = caml_alloc_tuple(2);
+	Store_field(result, 0, caml_copy_int32(LAPIC_DEFAULT | (lapic_id << 12)));
+	Store_field(result, 1, Val_int(MASTER + Int_val(line)));
+	CAMLreturn(result);
+}
@@ -8,6 +8,7 @@
 
 #include <asm.h>
 #include <string.h>
+#include <stdlib.h>
 
 CAMLprim value snowflake_out8(value port, value val) {
 	out8(Int_val(port), Int_val(val));
@@ -64,6 +65,23 @@ CAMLprim value snowflake_out16s(value port, value string, value count) {
 	return Val_unit;
 }
 
+/* word string I/O straight to and from a byte bigarray */
+CAMLprim value snowflake_in16s_ba(value port, value ba, value count) {
+	if (Caml_ba_array_val(ba)->dim[0] < Long_val(count) * 2) {
+		caml_invalid_argument("in16s_ba");
+	}
+	ins16(Int_val(port), Int_val(count), (unsigned short *)Caml_ba_data_val(ba));
+	return Val_unit;
+}
+
+CAMLprim value snowflake_out16s_ba(value port, value ba, value count) {
+	if (Caml_ba_array_val(ba)->dim[0] < Long_val(count) * 2) {
+		caml_invalid_argument("out16s_ba");
+	}
+	outs16(Int_val(port), Int_val(count), (unsigned short *)Caml_ba_data_val(ba));
+	return Val_unit;
+}
+
 CAMLprim value snowflake_address(value ba) {
 	unsigned long addr = (unsigned long)Caml_ba_data_val(ba);
 	return caml_copy_int32(addr);
@@ -105,9 +123,20 @@ CAMLprim value snowflake_matrix32(value address, value dim1, value dim2) {
 	return ba;
 }
 
+/* Physically contiguous (there is no paging), aligned buffer for bus-master
+ * DMA; freed by the GC like any other bigarray */
+CAMLprim value snowflake_dma_alloc(value size, value align) {
+	intnat dims[] = { Long_val(size) };
+	void *data = memalign(Long_val(align), Long_val(size));
+	if (data == NULL) {
+		caml_raise_out_of_memory();
+	}
+	return caml_ba_alloc(CAML_BA_UINT8 | CAML_BA_C_LAYOUT | CAML_BA_MANAGED, 1, data, dims);
+}
+
 CAMLprim value get_dma_region(value unit) {
 	long dims[] = { 0x10000 };
-	value r = caml_ba_alloc(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 2, (unsigned char *)(0x100000), dims);
+	value r = caml_ba_alloc(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, (unsigned char *)(0x100000), dims);
 	return r;
 }
 
@@ -2,6 +2,7 @@
 #include <caml/fail.h>
 #include <caml/memory.h>
 #include <caml/alloc.h>
+#include <caml/bigarray.h>
 
 #include <assert.h>
 #include <string.h>
@@ -135,10 +136,12 @@ uint32_t find_sym(void *image, dynamic_info_t *dynamic_info, unsigned int sym_id
 }
 
 /* returns "string * (string * int) list"
-           "soname * (sym name * sym value) list" */
-CAMLprim value caml_elfopen(value filename, value data)
+           "soname * (sym name * sym value) list"
+   The symbol names are copied out of [data] after allocating, so it is a
+   root along with the filename. */
+static value elf_open(value filename, value data, int bigarray)
 {
-	CAMLparam1(data);
+	CAMLparam2(filename, data);
 	CAMLlocal4(cell, list, symbol, result);
 
 	dynamic_info_t dynamic_info;
@@ -155,8 +158,13 @@ CAMLprim value caml_elfopen(value filename, value data)
 	memset(dynamic_info, 0, sizeof(dynamic_info_t));
 	dynamic_info[DT_SONAME].d_ptr = -1;
 
-	buf = String_val(data);
-	buf_len = caml_string_length(data);
+	if(bigarray) {
+		buf = Caml_ba_data_val(data);
+		buf_len = Caml_ba_array_val(data)->dim[0];
+	} else {
+		buf = String_val(data);
+		buf_len = caml_string_length(data);
+	}
 
 	if(buf_len < sizeof(Elf32_Ehdr)) {
 		caml_invalid_argument("caml_dlopen: buffer too short!");
@@ -433,3 +441,16 @@ CAMLprim value caml_elfopen(value filename, value data)
 
 	CAMLreturn(result);
 }
+
+CAMLprim value caml_elfopen(value filename, value data)
+{
+	return elf_open(filename, data, 0);
+}
+
+/* The same from a byte bigarray, such as Vfs.map returns. Its data is
+   outside the OCaml heap and doesn't move, but it is freed once the
+   bigarray is collected, hence the root in elf_open. */
+CAMLprim value caml_elfopen_ba(value filename, value data)
+{
+	return elf_open(filename, data, 1);
+}
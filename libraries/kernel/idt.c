@@ -29,10 +29,25 @@ unsigned short signal_mask = 0xFFFF;
 void update_mask() {
 	//dprintf("updating signal mask: %4x\n", signal_mask);
 	
+	if (apic_enabled) {
+		apic_update_mask(signal_mask);
+		return;
+	}
 	out8(PICMI, signal_mask & 0xFF);
 	out8(PICSI, signal_mask >> 8);
 }
 
+void irq_eoi(int irq) {
+	if (apic_enabled) {
+		apic_eoi();
+		return;
+	}
+	if (irq > 7) {
+		out8(PICS, 0x20);
+	}
+	out8(PICM, 0x20);
+}
+
 void unmask_irq(unsigned char irq) {
 	signal_mask &= ~(1 << irq);
 	if (irq >= 8) {
@@ -73,7 +88,11 @@ void set_vector(unsigned char vector, interrupt_handler handler, gate_type type)
 }
 
 void set_irq(unsigned char irq, interrupt_handler handler) {
-	if (irq >= 8) {
+	if (irq >= MSI_FIRST) {
+		/* MSI lines have no pin to unmask */
+		set_vector(irq + MASTER, handler, interrupt);
+		return;
+	} else if (irq >= 8) {
 		set_vector(irq + SLAVE - 8, handler, interrupt);
 	} else {
 		set_vector(irq + MASTER, handler, interrupt);
@@ -156,11 +175,8 @@ MK_E(15, "Unknown exception")
 MK_E(16, "Coprocessor error")
 
 void default_handler(int n) {
-	if (n < 16) {
-		out8(0x20, 0x20);
-		if (n > 7) {
-			out8(0x20, 0xA0);
-		}
+	if (n < IRQ_LINES) {
+		irq_eoi(n);
 	}
 }
 
@@ -168,7 +184,9 @@ static void ignore_handler(int n) {
 	/* do nothing */
 }
 
-sighandler_t signal_handlers[16] = {
+sighandler_t signal_handlers[IRQ_LINES] = {
+		default_handler, default_handler, default_handler, default_handler,
+		default_handler, default_handler, default_handler, default_handler,
 		default_handler, default_handler, default_handler, default_handler,
 		default_handler, default_handler, default_handler, default_handler,
 		default_handler, default_handler, default_handler, default_handler,
@@ -230,6 +248,17 @@ EI(12);
 EI(13);
 EI(14);
 EI(15);
+EI(16);
+EI(17);
+EI(18);
+EI(19);
+EI(20);
+EI(21);
+EI(22);
+EI(23);
+
+extern void spurious_irq();
+extern void ipi_wakeup();
 
 void idt_init() {
 	int i;
@@ -290,9 +319,26 @@ void idt_init() {
 	I(13);
 	I(14);
 	I(15);
+	I(16);
+	I(17);
+	I(18);
+	I(19);
+	I(20);
+	I(21);
+	I(22);
+	I(23);
+	
+	/* Local APIC spurious interrupts must not be EOI'd */
+	set_vector(SPURIOUS, spurious_irq, interrupt);
+	set_vector(IPI_WAKEUP, ipi_wakeup, interrupt);
 	
 	signal_mask = 0xFFFF;
 	
+	idt_load();
+}
+
+/* Also used by application processors, which share the one IDT */
+void idt_load() {
 	struct {
 		unsigned short size  __attribute__ ((packed));
 		unsigned long offset __attribute__ ((packed));
@@ -13,11 +13,19 @@
 #define ICW1          0x11
 #define ICW4          0x01
 
+/* Lines 0-15 are ISA IRQs; the rest are vectors reserved for MSI */
+#define IRQ_LINES     24
+#define MSI_FIRST     16
+
+#define SPURIOUS      0xFF
+#define IPI_WAKEUP    0xF0
+
 typedef void (*interrupt_handler)();
 
 typedef enum { interrupt, trap } gate_type;
 
 extern void idt_init();
+extern void idt_load();
 
 extern void set_vector(unsigned char vector, interrupt_handler handler, gate_type type);
 
@@ -28,4 +36,18 @@ extern void unmask_irq(unsigned char irq);
 
 extern void update_mask();
 
+extern void irq_eoi(int irq);
+
+extern unsigned short signal_mask;
+
+extern int apic_enabled;
+extern int apic_init(void);
+extern void apic_update_mask(unsigned int mask);
+extern void apic_eoi(void);
+extern unsigned int apic_id(void);
+extern void apic_local_init(void);
+extern void apic_send_ipi(unsigned int dest, unsigned int command);
+extern unsigned char apic_cpu_ids[];
+extern int apic_cpu_count;
+
 #endif
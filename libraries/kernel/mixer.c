@@ -0,0 +1,366 @@
+
+/* mixer.c
+ *
+ * Sample kernels for the software audio mixer: scale a run of signed 16-bit
+ * samples by a Q14 gain and add it into the mix with saturation, and the
+ * polyphase FIR behind AudioMixer's sample-rate converter. For stereo
+ * the converter's second channel runs on an application processor, when
+ * there is one, while the boot processor does the first.
+ *
+ * The SSE2 paths are switched on the first time one is needed, if CPUID
+ * has it; stage2 leaves CR4.OSFXSR clear, so that is set here. threads.c
+ * does not save XMM state across a switch, so the vector loops run with
+ * interrupts off. Nothing else in the kernel touches the XMM registers.
+ * MMX is avoided because it shares its registers with the x87 stack the
+ * OCaml float code uses. */
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/bigarray.h>
+
+#include <string.h>
+#include <threads.h>
+#include <smp.h>
+
+#define GAIN_SHIFT      14
+#define COEF_SHIFT      14
+#define PHASES          256
+
+/* multiply-adds per channel below which the IPI round trip to another
+   processor costs more than it saves */
+#define SMP_MIN_WORK    8192
+
+/* pauses to wait for another processor to pick a job up before taking it
+   back, in case that processor is busy with a long-running task */
+#define SMP_PICKUP_SPINS 20000
+
+#define CPUID_SSE2      (1 << 26)
+#define CR4_OSFXSR      (1 << 9)
+#define CR4_OSXMMEXCPT  (1 << 10)
+
+static int sse2 = -1;
+
+static int sse2_enable(void)
+{
+	unsigned int eax, ebx, ecx, edx, cr4;
+
+	asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+	if (!(edx & CPUID_SSE2)) {
+		return 0;
+	}
+	asm volatile("mov %%cr4, %0" : "=r"(cr4));
+	cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+	asm volatile("mov %0, %%cr4" : : "r"(cr4));
+	return 1;
+}
+
+static inline int clamp16(int x)
+{
+	if (x > 32767) {
+		return 32767;
+	}
+	if (x < -32768) {
+		return -32768;
+	}
+	return x;
+}
+
+static void mix_scalar(short *dst, const short *src, int count, int gain)
+{
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		dst[i] = clamp16(dst[i] + clamp16((src[i] * gain) >> GAIN_SHIFT));
+	}
+}
+
+/* Eight samples a step: the full 32-bit products come from pmullw/pmulhw,
+   are shifted back down and packed with saturation, then added with
+   saturation. Bit for bit the same as mix_scalar. */
+static void mix_sse2(short *dst, const short *src, int count, int gain)
+{
+	int blocks = count / 8;
+	long istate;
+
+	if (blocks > 0) {
+		istate = interrupts_disable();
+		asm volatile(
+			"movd %3, %%xmm7\n\t"
+			"pshuflw $0, %%xmm7, %%xmm7\n\t"
+			"punpcklqdq %%xmm7, %%xmm7\n"
+			"1:\n\t"
+			"movdqu (%1), %%xmm0\n\t"
+			"movdqa %%xmm0, %%xmm1\n\t"
+			"pmullw %%xmm7, %%xmm0\n\t"
+			"pmulhw %%xmm7, %%xmm1\n\t"
+			"movdqa %%xmm0, %%xmm2\n\t"
+			"punpcklwd %%xmm1, %%xmm0\n\t"
+			"punpckhwd %%xmm1, %%xmm2\n\t"
+			"psrad $14, %%xmm0\n\t"
+			"psrad $14, %%xmm2\n\t"
+			"packssdw %%xmm2, %%xmm0\n\t"
+			"movdqu (%0), %%xmm1\n\t"
+			"paddsw %%xmm0, %%xmm1\n\t"
+			"movdqu %%xmm1, (%0)\n\t"
+			"add $16, %0\n\t"
+			"add $16, %1\n\t"
+			"dec %2\n\t"
+			"jnz 1b"
+			: "+r"(dst), "+r"(src), "+r"(blocks)
+			: "r"(gain)
+			: "memory", "cc");
+		interrupts_restore(istate);
+	}
+	mix_scalar(dst, src, count & 7, gain);
+}
+
+/* Resampling. The history is planar, one run of frames per channel, so
+   each output sample is a dot product of [taps] history samples with one
+   row of the coefficient table. */
+
+static int dot_scalar(const short *x, const short *h, int taps)
+{
+	int i, sum = 0;
+
+	for (i = 0; i < taps; ++i) {
+		sum += x[i] * h[i];
+	}
+	return sum;
+}
+
+/* [taps] is a multiple of 8 */
+static int dot_sse2(const short *x, const short *h, int taps)
+{
+	int sum;
+
+	asm volatile(
+		"pxor %%xmm0, %%xmm0\n"
+		"1:\n\t"
+		"movdqu (%1), %%xmm1\n\t"
+		"movdqu (%2), %%xmm2\n\t"
+		"pmaddwd %%xmm2, %%xmm1\n\t"
+		"paddd %%xmm1, %%xmm0\n\t"
+		"add $16, %1\n\t"
+		"add $16, %2\n\t"
+		"sub $8, %3\n\t"
+		"jnz 1b\n\t"
+		"pshufd $0x4E, %%xmm0, %%xmm1\n\t"
+		"paddd %%xmm1, %%xmm0\n\t"
+		"pshufd $0xB1, %%xmm0, %%xmm1\n\t"
+		"paddd %%xmm1, %%xmm0\n\t"
+		"movd %%xmm0, %0"
+		: "=r"(sum), "+r"(x), "+r"(h), "+r"(taps)
+		:
+		: "memory", "cc");
+	return sum;
+}
+
+/* Fields of AudioMixer.resampler, in order */
+#define R_CHANNELS  0
+#define R_IN_RATE   1
+#define R_OUT_RATE  2
+#define R_TAPS      3
+#define R_TABLE     4
+#define R_HISTORY   5
+#define R_AVAIL     6
+#define R_INDEX     7
+#define R_FRAC      8
+
+#define Field_int(r, f) Long_val(Field(r, f))
+#define Set_field_int(r, f, n) (Field(r, f) = Val_long(n))
+
+static int history_frames(value r)
+{
+	return Caml_ba_array_val(Field(r, R_HISTORY))->dim[0] / (2 * Field_int(r, R_CHANNELS));
+}
+
+/* One channel of a resampler run, self-contained so that it can be
+   handed to another processor */
+typedef struct resample_job {
+	const short *table;
+	const short *history; /* this channel's run of frames */
+	short *out;
+	int channel, channels;
+	int in_rate, out_rate, taps;
+	int index, frac, frames;
+	int use_sse2;
+	smp_task_t task;
+} resample_job_t;
+
+static void resample_channel(resample_job_t *j)
+{
+	int (*dot)(const short *, const short *, int) = j->use_sse2 ? dot_sse2 : dot_scalar;
+	int half = j->taps / 2;
+	int index = j->index, frac = j->frac;
+	int n;
+
+	for (n = 0; n < j->frames; ++n) {
+		const short *h = j->table + (frac * PHASES / j->out_rate) * j->taps;
+		int s = clamp16(dot(j->history + index - half + 1, h, j->taps) >> COEF_SHIFT);
+
+		j->out[2 * n + j->channel] = s;
+		if (j->channels == 1) {
+			j->out[2 * n + 1] = s;
+		}
+		for (frac += j->in_rate; frac >= j->out_rate; frac -= j->out_rate) {
+			index++;
+		}
+	}
+}
+
+/* On an application processor: no thread switches happen there, so the
+   XMM registers are free, but CR4 is per processor */
+static void resample_task(void *arg)
+{
+	resample_job_t *j = arg;
+
+	if (j->use_sse2) {
+		sse2_enable();
+	}
+	resample_channel(j);
+}
+
+/* ML interface */
+
+/* [dst] += [src] * [gain] / 16384, over the shorter of the two byte arrays */
+CAMLprim value snowflake_mix_s16(value dst, value src, value gain) {
+	int count = Caml_ba_array_val(dst)->dim[0];
+
+	if (Caml_ba_array_val(src)->dim[0] < count) {
+		count = Caml_ba_array_val(src)->dim[0];
+	}
+	if (sse2 < 0) {
+		sse2 = sse2_enable();
+	}
+	if (Int_val(gain) > 0) {
+		(sse2 ? mix_sse2 : mix_scalar)((short *)Caml_ba_data_val(dst),
+			(const short *)Caml_ba_data_val(src), count / 2, Int_val(gain));
+	}
+	return Val_unit;
+}
+
+/* Full-resolution time stamp counter, for timing mixer periods */
+CAMLprim value snowflake_mix_clock(value unit) {
+	unsigned long long t;
+
+	asm volatile("rdtsc" : "=A"(t));
+	return caml_copy_int64(t);
+}
+
+/* Deinterleave as many whole frames of [src] as fit into the history;
+   returns the bytes taken */
+CAMLprim value snowflake_resample_feed(value r, value src) {
+	int channels = Field_int(r, R_CHANNELS);
+	int capacity = history_frames(r);
+	int avail = Field_int(r, R_AVAIL);
+	int frames = Caml_ba_array_val(src)->dim[0] / (2 * channels);
+	short *history = (short *)Caml_ba_data_val(Field(r, R_HISTORY));
+	const short *in = (const short *)Caml_ba_data_val(src);
+	int i, c;
+
+	if (frames > capacity - avail) {
+		frames = capacity - avail;
+	}
+	for (c = 0; c < channels; ++c) {
+		short *run = history + c * capacity + avail;
+		for (i = 0; i < frames; ++i) {
+			run[i] = in[i * channels + c];
+		}
+	}
+	Set_field_int(r, R_AVAIL, avail + frames);
+	return Val_int(frames * 2 * channels);
+}
+
+/* Fill [dst] with as many 16-bit stereo frames as the history allows,
+   then drop the history no later output needs; returns the bytes made */
+CAMLprim value snowflake_resample_run(value r, value dst) {
+	int channels = Field_int(r, R_CHANNELS);
+	int in_rate = Field_int(r, R_IN_RATE);
+	int out_rate = Field_int(r, R_OUT_RATE);
+	int taps = Field_int(r, R_TAPS);
+	int capacity = history_frames(r);
+	int avail = Field_int(r, R_AVAIL);
+	int index = Field_int(r, R_INDEX);
+	int frac = Field_int(r, R_FRAC);
+	int half = taps / 2;
+	int room = Caml_ba_array_val(dst)->dim[0] / 4;
+	short *history = (short *)Caml_ba_data_val(Field(r, R_HISTORY));
+	resample_job_t jobs[2];
+	int n, c, drop, vector, spins, remote = 0;
+	long istate = 0;
+
+	if (sse2 < 0) {
+		sse2 = sse2_enable();
+	}
+	vector = sse2 && taps % 8 == 0;
+	for (c = 0; c < channels; ++c) {
+		jobs[c].table = (const short *)Caml_ba_data_val(Field(r, R_TABLE));
+		jobs[c].history = history + c * capacity;
+		jobs[c].out = (short *)Caml_ba_data_val(dst);
+		jobs[c].channel = c;
+		jobs[c].channels = channels;
+		jobs[c].in_rate = in_rate;
+		jobs[c].out_rate = out_rate;
+		jobs[c].taps = taps;
+		jobs[c].index = index;
+		jobs[c].frac = frac;
+		jobs[c].use_sse2 = vector;
+	}
+
+	/* how many frames there is history for, and where that leaves us */
+	for (n = 0; n < room && index + half < avail; ++n) {
+		for (frac += in_rate; frac >= out_rate; frac -= out_rate) {
+			index++;
+		}
+	}
+	for (c = 0; c < channels; ++c) {
+		jobs[c].frames = n;
+	}
+
+	if (channels == 2 && n * taps >= SMP_MIN_WORK) {
+		remote = smp_spawn(&jobs[1].task, resample_task, &jobs[1]) >= 0;
+	}
+	if (vector) {
+		istate = interrupts_disable();
+	}
+	resample_channel(&jobs[0]);
+	if (channels == 2 && !remote) {
+		resample_channel(&jobs[1]);
+	}
+	if (vector) {
+		interrupts_restore(istate);
+	}
+	for (spins = 0; remote && !jobs[1].task.done && spins < SMP_PICKUP_SPINS; ++spins) {
+		asm volatile("pause" ::: "memory");
+	}
+	if (remote && !jobs[1].task.done && smp_cancel(&jobs[1].task)) {
+		if (vector) {
+			istate = interrupts_disable();
+		}
+		resample_channel(&jobs[1]);
+		if (vector) {
+			interrupts_restore(istate);
+		}
+		remote = 0;
+	}
+	/* otherwise it is running, and finishes */
+	while (remote && !jobs[1].task.done) {
+		asm volatile("pause" ::: "memory");
+	}
+
+	drop = index - (half - 1);
+	if (drop > avail) {
+		drop = avail;
+	}
+	if (drop > 0) {
+		for (c = 0; c < channels; ++c) {
+			memmove(history + c * capacity, history + c * capacity + drop, (avail - drop) * 2);
+		}
+		avail -= drop;
+		index -= drop;
+	}
+	Set_field_int(r, R_AVAIL, avail);
+	Set_field_int(r, R_INDEX, index);
+	Set_field_int(r, R_FRAC, frac);
+	return Val_int(n * 4);
+}
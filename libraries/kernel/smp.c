@@ -0,0 +1,270 @@
+
+/* smp.c
+ *
+ * Application processor bring-up and per-CPU task queues.
+ *
+ * Each AP is started with INIT-SIPI-SIPI into the trampoline in ap_boot.S
+ * and then sits in ap_main: it runs tasks from its own queue, steals from
+ * the most loaded other queue when that is empty, and halts otherwise.
+ * smp_spawn sends a wakeup IPI to the chosen processor. The boot processor
+ * keeps running the OCaml runtime and threads.c scheduler on its own. */
+
+#include <asm.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+#include <smp.h>
+#include "idt.h"
+
+#define AP_BASE        0x8000
+#define AP_STACK_SIZE  0x4000
+
+#define ICR_INIT       0x4500
+#define ICR_STARTUP    0x4600
+#define ICR_FIXED      0x4000
+
+/* cpu_t.online: 0 while starting, then one of these */
+#define CPU_ONLINE     1
+#define CPU_DEAD       -1
+
+typedef struct cpu {
+	unsigned int apic_id;
+	volatile int online;
+	spinlock_t lock;
+	link_t run_queue;
+	volatile unsigned long queued;
+	volatile unsigned long completed;
+	volatile unsigned long stolen;
+} cpu_t;
+
+extern char ap_trampoline[], ap_trampoline_end[], ap_stack[];
+
+static cpu_t cpus[MAX_CPUS];
+static int cpu_count = 1;
+
+static unsigned char __attribute__((aligned(16))) ap_stacks[MAX_CPUS][AP_STACK_SIZE];
+
+static inline int cmpxchg(volatile int *p, int old, int new)
+{
+	int prev;
+
+	asm volatile("lock; cmpxchgl %2, %1" : "=a"(prev), "+m"(*p) : "r"(new), "0"(old) : "memory");
+	return prev;
+}
+
+/* Roughly a microsecond per write to the POST port */
+static void udelay(unsigned int usec)
+{
+	while (usec--) {
+		out8(0x80, 0);
+	}
+}
+
+int smp_cpu_id(void)
+{
+	unsigned int id;
+	int i;
+
+	if (!apic_enabled) {
+		return 0;
+	}
+	id = apic_id();
+	for (i = 0; i < cpu_count; ++i) {
+		if (cpus[i].apic_id == id) {
+			return i;
+		}
+	}
+	return 0;
+}
+
+int smp_cpus(void)
+{
+	return cpu_count;
+}
+
+static smp_task_t *dequeue(cpu_t *cpu, int from_tail)
+{
+	smp_task_t *task = NULL;
+
+	spin_lock(&cpu->lock);
+	if (!list_empty(&cpu->run_queue)) {
+		link_t *link = from_tail ? cpu->run_queue.prev : cpu->run_queue.next;
+		task = list_get_instance(link, smp_task_t, link);
+		list_remove(&task->link);
+		cpu->queued--;
+	}
+	spin_unlock(&cpu->lock);
+	return task;
+}
+
+/* Take the oldest task from the busiest other processor */
+static smp_task_t *steal(cpu_t *self)
+{
+	cpu_t *victim = NULL;
+	smp_task_t *task;
+	int i;
+
+	for (i = 1; i < cpu_count; ++i) {
+		if (&cpus[i] != self && cpus[i].queued > 0
+				&& (victim == NULL || cpus[i].queued > victim->queued)) {
+			victim = &cpus[i];
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+	task = dequeue(victim, 1);
+	if (task != NULL) {
+		self->stolen++;
+	}
+	return task;
+}
+
+void ap_main(void)
+{
+	cpu_t *self;
+	smp_task_t *task;
+
+	idt_load();
+	apic_local_init();
+	self = &cpus[smp_cpu_id()];
+	/* the boot processor gave up on us and won't send any work */
+	if (cmpxchg(&self->online, 0, CPU_ONLINE) != 0) {
+		while (1) {
+			asm volatile("cli; hlt");
+		}
+	}
+
+	while (1) {
+		task = dequeue(self, 0);
+		if (task == NULL) {
+			task = steal(self);
+		}
+		if (task == NULL) {
+			/* sti;hlt is atomic, so a wakeup IPI can't slip in between */
+			asm volatile("sti; hlt; cli");
+			continue;
+		}
+		task->fn(task->arg);
+		task->done = 1;
+		self->completed++;
+	}
+}
+
+int smp_spawn(smp_task_t *task, void (*fn)(void *), void *arg)
+{
+	cpu_t *target = NULL;
+	long istate;
+	int i;
+
+	for (i = 1; i < cpu_count; ++i) {
+		if (cpus[i].online == CPU_ONLINE && (target == NULL || cpus[i].queued < target->queued)) {
+			target = &cpus[i];
+		}
+	}
+	if (target == NULL) {
+		return -1;
+	}
+
+	task->fn = fn;
+	task->arg = arg;
+	task->done = 0;
+	task->cpu = target - cpus;
+	link_initialize(&task->link);
+
+	spin_lock(&target->lock);
+	list_append(&task->link, &target->run_queue);
+	target->queued++;
+	spin_unlock(&target->lock);
+
+	istate = interrupts_disable();
+	apic_send_ipi(target->apic_id, ICR_FIXED | IPI_WAKEUP);
+	interrupts_restore(istate);
+	return target - cpus;
+}
+
+/* A queued task is linked on the queue it was spawned to; dequeue unlinks
+   it, which leaves the link NULL, before it runs */
+int smp_cancel(smp_task_t *task)
+{
+	cpu_t *cpu = &cpus[task->cpu];
+	int queued;
+
+	spin_lock(&cpu->lock);
+	queued = task->link.next != NULL;
+	if (queued) {
+		list_remove(&task->link);
+		cpu->queued--;
+	}
+	spin_unlock(&cpu->lock);
+	return queued;
+}
+
+static int start_ap(int n)
+{
+	cpu_t *cpu = &cpus[n];
+	int wait;
+
+	*(unsigned long *)(AP_BASE + (ap_stack - ap_trampoline)) =
+		(unsigned long)(ap_stacks[n] + AP_STACK_SIZE);
+
+	apic_send_ipi(cpu->apic_id, ICR_INIT);
+	udelay(10000);
+	apic_send_ipi(cpu->apic_id, ICR_STARTUP | (AP_BASE >> 12));
+	udelay(200);
+	if (!cpu->online) {
+		apic_send_ipi(cpu->apic_id, ICR_STARTUP | (AP_BASE >> 12));
+	}
+
+	for (wait = 0; wait < 100000 && !cpu->online; ++wait) {
+		udelay(1);
+	}
+	if (cmpxchg(&cpu->online, 0, CPU_DEAD) == CPU_ONLINE) {
+		return 1;
+	}
+	/* Park it before the trampoline's stack pointer is rewritten for the
+	   next processor. Its slot stays taken, so if it still comes up it
+	   finds itself dead rather than in another processor's place. */
+	apic_send_ipi(cpu->apic_id, ICR_INIT);
+	return 0;
+}
+
+int smp_init(void)
+{
+	unsigned int bsp;
+	int i, online = 1;
+
+	if (!apic_enabled || apic_cpu_count < 2) {
+		return 1;
+	}
+
+	memcpy((void *)AP_BASE, ap_trampoline, ap_trampoline_end - ap_trampoline);
+
+	bsp = apic_id();
+	cpus[0].apic_id = bsp;
+	cpus[0].online = 1;
+	list_initialize(&cpus[0].run_queue);
+
+	for (i = 0; i < apic_cpu_count; ++i) {
+		cpu_t *cpu;
+
+		if (apic_cpu_ids[i] == bsp) {
+			continue;
+		}
+		cpu = &cpus[cpu_count];
+		cpu->apic_id = apic_cpu_ids[i];
+		cpu->online = 0;
+		cpu->lock.locked = 0;
+		list_initialize(&cpu->run_queue);
+		/* Published before the AP looks itself up in smp_cpu_id */
+		cpu_count++;
+		if (start_ap(cpu_count - 1)) {
+			online++;
+		} else {
+			dprintf("smp: cpu %d (apic %d) did not start\r\n", cpu_count - 1, cpu->apic_id);
+		}
+	}
+
+	dprintf("smp: %d processor(s) online\r\n", online);
+	return online;
+}
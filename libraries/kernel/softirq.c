@@ -0,0 +1,144 @@
+
+/* softirq.c
+ *
+ * Two-stage interrupt dispatch. The top half runs in interrupt context: it
+ * masks the line (so a level-triggered device can't re-fire before its
+ * driver has acknowledged it), stamps the event and sends EOI straight away,
+ * leaving every other IRQ free to be delivered. The bottom half is a single
+ * OCaml thread that drains all pending IRQs in a batch and runs their
+ * handlers, then unmasks each line. */
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/signals.h>
+
+#include <asm.h>
+#include <signal.h>
+#include <threads.h>
+#include "idt.h"
+
+extern sighandler_t signal_handlers[IRQ_LINES];
+
+typedef struct irq_stats {
+	unsigned long count;            /* Top halves taken */
+	unsigned long handled;          /* Bottom-half batches that included this IRQ */
+	unsigned long long raised;      /* TSC at the last top half */
+	unsigned long long total;       /* Sum of top-to-bottom-half latencies */
+	unsigned long long worst;
+} irq_stats_t;
+
+/* Per-CPU softirq state; there is only the boot CPU for now */
+typedef struct softirq_cpu {
+	volatile unsigned long pending;
+	thread_t waiter;
+	/* Set only while the waiter sleeps in softirq_wait. The handlers take
+	 * mutexes, so it can also be BLOCKED on a waitqueue, and a wake then
+	 * would pull it out from under that queue. */
+	volatile int sleeping;
+	irq_stats_t stats[IRQ_LINES];
+} softirq_cpu_t;
+
+static softirq_cpu_t softirq_cpu;
+
+static inline unsigned long long read_tsc(void)
+{
+	unsigned long long tsc;
+	asm volatile("rdtsc" : "=A"(tsc));
+	return tsc;
+}
+
+static void softirq_top_half(int irq)
+{
+	softirq_cpu_t *cpu = &softirq_cpu;
+
+	if (irq < MSI_FIRST) {
+		mask_irq(irq);
+		update_mask();
+	}
+	irq_eoi(irq);
+
+	if (!(cpu->pending & (1 << irq))) {
+		cpu->stats[irq].raised = read_tsc();
+	}
+	cpu->pending |= 1 << irq;
+	cpu->stats[irq].count++;
+
+	if (cpu->sleeping) {
+		cpu->sleeping = 0;
+		thread_wake(cpu->waiter);
+	}
+}
+
+CAMLprim value snowflake_softirq_register(value irq) {
+	long istate = interrupts_disable();
+	signal_handlers[Int_val(irq)] = softirq_top_half;
+	if (Int_val(irq) < MSI_FIRST) {
+		unmask_irq(Int_val(irq));
+		update_mask();
+	}
+	interrupts_restore(istate);
+	return Val_unit;
+}
+
+/* Block until at least one IRQ is pending; returns and clears the mask */
+CAMLprim value snowflake_softirq_wait(value unit) {
+	softirq_cpu_t *cpu = &softirq_cpu;
+	unsigned long long now;
+	unsigned long pending;
+	int irq;
+
+	caml_enter_blocking_section();
+	long istate = interrupts_disable();
+	cpu->waiter = thread_self();
+	while (cpu->pending == 0) {
+		cpu->sleeping = 1;
+		thread_sleep();
+		cpu->sleeping = 0;
+	}
+	pending = cpu->pending;
+	cpu->pending = 0;
+	now = read_tsc();
+	for (irq = 0; irq < IRQ_LINES; irq++) {
+		if (pending & (1 << irq)) {
+			irq_stats_t *s = &cpu->stats[irq];
+			unsigned long long latency = now - s->raised;
+			s->handled++;
+			s->total += latency;
+			if (latency > s->worst) {
+				s->worst = latency;
+			}
+		}
+	}
+	interrupts_restore(istate);
+	caml_leave_blocking_section();
+
+	return Val_int(pending);
+}
+
+CAMLprim value snowflake_softirq_done(value irq) {
+	long istate;
+
+	if (Int_val(irq) >= MSI_FIRST) {
+		return Val_unit;
+	}
+	istate = interrupts_disable();
+	unmask_irq(Int_val(irq));
+	update_mask();
+	interrupts_restore(istate);
+	return Val_unit;
+}
+
+/* (count, handled, total latency, worst latency), latencies in TSC cycles */
+CAMLprim value snowflake_softirq_stats(value irq) {
+	CAMLparam1(irq);
+	CAMLlocal1(result);
+	irq_stats_t *s = &softirq_cpu.stats[Int_val(irq)];
+
+	result = caml_alloc_tuple(4);
+	Store_field(result, 0, Val_long(s->count));
+	Store_field(result, 1, Val_long(s->handled));
+	Store_field(result, 2, caml_copy_int64(s->total));
+	Store_field(result, 3, caml_copy_int64(s->worst));
+	CAMLreturn(result);
+}
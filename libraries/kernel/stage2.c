@@ -5,10 +5,12 @@
 #include <asm.h>
 #include <threads.h>
 #include <multiboot.h>
+#include <smp.h>
 
 extern void caml_startup(char **args);
 
 extern void idt_init();
+extern int apic_init(void);
 
 static unsigned int __attribute__((section(".bss.pagealigned"),used)) page_dir[1024];
 static unsigned int __attribute__((section(".bss.pagealigned"))) first_page_table[1024];
@@ -73,6 +75,10 @@ void __startup(multiboot_info_t *multiboot, int magic)
 	// set up C thread machinery, exception and irq handlers
 	thread_init();
 	idt_init();
+	if (!apic_init()) {
+		dprintf("INFO: No IOAPIC found, using the 8259 PICs\r\n");
+	}
+	smp_init();
 	//paging_init();
 	
 	unmask_irq(0);
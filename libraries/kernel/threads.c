@@ -5,6 +5,17 @@
 #include <string.h>
 #include <assert.h>
 #include "threads.h"
+
+/* Stack cache size classes; the canary sits in the lowest word of every
+ * stack (see "Thread stacks and control blocks" below) */
+#define STACK_MIN_SHIFT 14                 /* 16 KiB */
+#define STACK_MAX_SHIFT 20                 /* 1 MiB */
+#define STACK_CLASSES (STACK_MAX_SHIFT - STACK_MIN_SHIFT + 1)
+#define STACK_CACHE_DEPTH 8
+#define STACK_CANARY 0x57ACCA9EUL
+
+/* TCBs are carved from slabs of this many records and never freed */
+#define TCB_SLAB_SIZE 32
 
 extern void _thread_switch_stacks(unsigned long *new_esp, unsigned long **old_esp);
 
@@ -16,6 +27,8 @@ static unsigned long next_id = 0;
 static LIST_INITIALIZE(all_threads);
 static LIST_INITIALIZE(run_queue);
 static LIST_INITIALIZE(zombie_list);
+/* Threads in thread_sleep_until, on their run_link */
+static LIST_INITIALIZE(sleepers);
 static real_thread_t *current;
 
 static real_thread_t kernel_thread;
@@ -23,6 +36,63 @@ static thread_t idle_thread;
 /* Reaper: Slayer of dead threads */
 static thread_t reaper_thread;
 
+/* Scheduler trace: a ring of switch/wake events, dumped as Chrome trace
+ * JSON (chrome://tracing) over the serial port */
+#define TRACE_SIZE 4096
+#define TRACE_SWITCH 0
+#define TRACE_WAKE 1
+
+typedef struct trace_event {
+	unsigned long long tsc;
+	unsigned long type;
+	unsigned long from;
+	unsigned long to;
+} trace_event_t;
+
+static trace_event_t trace_ring[TRACE_SIZE];
+static unsigned long trace_head = 0;
+static int trace_enabled = 0;
+
+static unsigned long cycles_per_usec = 1;
+
+static inline unsigned long long read_tsc(void)
+{
+	unsigned long long tsc;
+	asm volatile("rdtsc" : "=A"(tsc));
+	return tsc;
+}
+
+static inline void trace(unsigned long type, unsigned long from, unsigned long to, unsigned long long tsc)
+{
+	trace_event_t *e;
+	
+	if(!trace_enabled) {
+		return;
+	}
+	e = &trace_ring[trace_head++ % TRACE_SIZE];
+	e->tsc = tsc;
+	e->type = type;
+	e->from = from;
+	e->to = to;
+}
+
+/* Time 10ms of PIT channel 2 (gated, speaker off) against the TSC */
+static unsigned long calibrate_tsc(void)
+{
+	unsigned long long start, end;
+	
+	out8(0x61, (in8(0x61) & ~0x02) & ~0x01);
+	out8(0x43, 0xB0);
+	out8(0x42, 11932 & 0xFF);
+	out8(0x42, 11932 >> 8);
+	out8(0x61, in8(0x61) | 0x01);
+	start = read_tsc();
+	while(!(in8(0x61) & 0x20));
+	end = read_tsc();
+	
+	return (unsigned long)((end - start) / 10000);
+}
+
 void thread_init() {
 	/* Kernel thread is special, it already has a stack and is currently running */
 	kernel_thread.id = next_id++;
@@ -31,10 +101,24 @@ void thread_init() {
 	link_initialize(&kernel_thread.global_link);
 	list_insert_prev(&kernel_thread.global_link, &all_threads);
 	kernel_thread.slot = NULL;
+	kernel_thread.stack = NULL;
+	kernel_thread.stack_size = 0;
+	strcpy(kernel_thread.name, "kernel");
+	kernel_thread.runtime = 0;
+	kernel_thread.waittime = 0;
+	kernel_thread.switches = 0;
 	current = &kernel_thread;
 	
+	cycles_per_usec = calibrate_tsc();
+	if(cycles_per_usec == 0) {
+		cycles_per_usec = 1;
+	}
+	kernel_thread.stamp = read_tsc();
+	
 	thread_create(&idle_thread, do_idle, NULL);
+	thread_set_name(idle_thread, "idle");
 	thread_create(&reaper_thread, do_reaper, NULL);
+	thread_set_name(reaper_thread, "reaper");
 }
 
 static void schedule(void)
@@ -42,6 +126,13 @@ static void schedule(void)
 	/* Save the current state of IF and disable interrupts */
 	long intr_state = interrupts_disable();
 	real_thread_t *previous = current;
+	unsigned long long now;
+	
+	/* Catch stack overflows before they spread to a neighbouring allocation */
+	if(current->stack != NULL && current->stack[0] != STACK_CANARY) {
+		dprintf("schedule: Aiee! stack overflow in %u/%x\r\n", current->id, (long)current);
+		assert(0);
+	}
 	
 	/* Possibly put the thread back on the run queue
 	 * The idle thread is special, it never goes on the run queue */
@@ -62,6 +153,7 @@ static void schedule(void)
 			list_append(&current->run_link, &zombie_list);
 			if(reaper_thread->status == BLOCKED) {
 				reaper_thread->status = RUNNABLE;
+				reaper_thread->stamp = read_tsc();
 				list_append(&reaper_thread->run_link, &run_queue);
 			}
 			break;
@@ -87,6 +179,19 @@ static void schedule(void)
 		#endif
 	}
 	
+	/* Charge the outgoing thread for its slice; the incoming one stops waiting */
+	now = read_tsc();
+	previous->runtime += now - previous->stamp;
+	previous->stamp = now;
+	if(previous != current) {
+		previous->switches++;
+		if(current->status == RUNNABLE && current != idle_thread) {
+			current->waittime += now - current->stamp;
+		}
+		current->stamp = now;
+		trace(TRACE_SWITCH, previous->id, current->id, now);
+	}
+	
 	if(previous == current) {
 		/* Nothing to do, early return now to avoid the stack switch code */
 		#ifdef DEBUG_SCHEDULER
@@ -121,7 +226,116 @@ void thread_exit(void *retval) {
 	assert(0);
 }
 
-#define STACK_SIZE 16384
+/* Thread stacks and control blocks
+ *
+ * Stacks are recycled through a small cache per power-of-two size class
+ * rather than handed back to dlmalloc, so short-lived threads (TCP input
+ * threads, interrupt threads) don't churn and fragment the heap. Stacks are
+ * not zeroed: only the initial frame built below is ever read. The lowest
+ * word of every stack holds a canary that is checked whenever the thread is
+ * switched away from and when it is reaped. */
+
+typedef struct stack_cache {
+	void *free[STACK_CACHE_DEPTH];
+	unsigned long count;
+} stack_cache_t;
+
+static stack_cache_t stack_caches[STACK_CLASSES];
+static LIST_INITIALIZE(free_tcbs);
+
+static unsigned long stack_hits = 0;
+static unsigned long stack_misses = 0;
+
+/* Round size up to its class; returns -1 for stacks too big to cache */
+static int stack_class(unsigned long *size)
+{
+	int shift;
+	
+	for(shift = STACK_MIN_SHIFT; shift <= STACK_MAX_SHIFT; shift++) {
+		if(*size <= (1UL << shift)) {
+			*size = 1UL << shift;
+			return shift - STACK_MIN_SHIFT;
+		}
+	}
+	*size = (*size + 4095) & ~4095UL;
+	return -1;
+}
+
+static unsigned long *stack_alloc(unsigned long size)
+{
+	int class = stack_class(&size);
+	unsigned long *stack = NULL;
+	long istate = interrupts_disable();
+	
+	if(class >= 0 && stack_caches[class].count > 0) {
+		stack = stack_caches[class].free[--stack_caches[class].count];
+		stack_hits++;
+	} else {
+		stack_misses++;
+	}
+	interrupts_restore(istate);
+	
+	if(stack == NULL) {
+		stack = memalign(16, size);
+		assert(stack != NULL);
+	}
+	stack[0] = STACK_CANARY;
+	return stack;
+}
+
+static void stack_free(unsigned long *stack, unsigned long size)
+{
+	int class = stack_class(&size);
+	long istate = interrupts_disable();
+	
+	if(class >= 0 && stack_caches[class].count < STACK_CACHE_DEPTH) {
+		stack_caches[class].free[stack_caches[class].count++] = stack;
+		stack = NULL;
+	}
+	interrupts_restore(istate);
+	
+	if(stack != NULL) {
+		free(stack);
+	}
+}
+
+static real_thread_t *tcb_alloc(void)
+{
+	real_thread_t *tcb;
+	long istate = interrupts_disable();
+	
+	if(list_empty(&free_tcbs)) {
+		int i;
+		real_thread_t *slab = malloc(TCB_SLAB_SIZE * sizeof(real_thread_t));
+		assert(slab != NULL);
+		for(i = 0; i < TCB_SLAB_SIZE; i++) {
+			list_append(&slab[i].global_link, &free_tcbs);
+		}
+	}
+	tcb = list_get_instance(free_tcbs.next, real_thread_t, global_link);
+	list_remove(&tcb->global_link);
+	interrupts_restore(istate);
+	return tcb;
+}
+
+static void tcb_free(real_thread_t *tcb)
+{
+	long istate = interrupts_disable();
+	list_append(&tcb->global_link, &free_tcbs);
+	interrupts_restore(istate);
+}
+
+void thread_stack_stats(unsigned long *hits, unsigned long *misses, unsigned long *cached)
+{
+	int i;
+	
+	*hits = stack_hits;
+	*misses = stack_misses;
+	*cached = 0;
+	for(i = 0; i < STACK_CLASSES; i++) {
+		*cached += stack_caches[i].count << (i + STACK_MIN_SHIFT);
+	}
+}
 
 static void thread_entry_trampoline(void *(*closure)(void *), void *arg)
 {
@@ -129,15 +343,26 @@ static void thread_entry_trampoline(void *(*closure)(void *), void *arg)
 	thread_exit(closure(arg));
 }
 
-void thread_create(thread_t *thread, void *(*closure)(void *), void *arg) {
-	*thread = malloc(sizeof(real_thread_t));
+void thread_create_sized(thread_t *thread, unsigned long stack_size, void *(*closure)(void *), void *arg) {
+	if(stack_size == 0) {
+		stack_size = THREAD_DEFAULT_STACK_SIZE;
+	}
+	/* Record the rounded size so the reaper returns it to the right class */
+	stack_class(&stack_size);
+	
+	*thread = tcb_alloc();
 	(*thread)->id = next_id++;
 	(*thread)->status = RUNNABLE;
 	(*thread)->slot = NULL;
-	(*thread)->stack = (unsigned long *)malloc(STACK_SIZE * sizeof(unsigned long));
-	(*thread)->esp = (*thread)->stack + STACK_SIZE;
-	
-	memset((*thread)->stack, 0, STACK_SIZE * sizeof(unsigned long));
+	(*thread)->stack_size = stack_size;
+	(*thread)->name[0] = '\0';
+	(*thread)->runtime = 0;
+	(*thread)->waittime = 0;
+	(*thread)->switches = 0;
+	(*thread)->wake_at = 0;
+	(*thread)->stamp = read_tsc();
+	(*thread)->stack = stack_alloc(stack_size);
+	(*thread)->esp = (*thread)->stack + stack_size / sizeof(unsigned long);
 	
 	link_initialize(&(*thread)->run_link);
 	link_initialize(&(*thread)->global_link);
@@ -161,6 +386,10 @@ void thread_create(thread_t *thread, void *(*closure)(void *), void *arg) {
 #endif
 }
 
+void thread_create(thread_t *thread, void *(*closure)(void *), void *arg) {
+	thread_create_sized(thread, THREAD_DEFAULT_STACK_SIZE, closure, arg);
+}
+
 thread_t thread_self() {
 	return current;
 }
@@ -175,7 +404,9 @@ void *thread_getspecific() {
 
 void thread_sleep()
 {
+#ifdef DEBUG_THREADS
 	dprintf("thread %d sleeping\r\n", current->id);
+#endif
 	current->status = BLOCKED;
 	list_remove(&current->run_link);
 	schedule();
@@ -183,11 +414,184 @@ void thread_sleep()
 
 void thread_wake(thread_t t)
 {
+#ifdef DEBUG_THREADS
 	dprintf("thread %d being woken up by %d\r\n", t->id, current->id);
+#endif
+	/* A timed sleeper woken early leaves the sleepers list first */
+	if(t->wake_at != 0) {
+		list_remove(&t->run_link);
+		t->wake_at = 0;
+	}
 	t->status = RUNNABLE;
+	/* Blocked time isn't wait time; start counting from now */
+	t->stamp = read_tsc();
+	trace(TRACE_WAKE, current->id, t->id, t->stamp);
 	list_append(&t->run_link, &run_queue);
 }
 
+/* Block until the TSC passes deadline. The timer interrupt does the waking,
+ * so it comes up to one PIT tick late. */
+void thread_sleep_until(unsigned long long deadline)
+{
+	long istate = interrupts_disable();
+	
+	if(read_tsc() < deadline) {
+		current->wake_at = deadline;
+		current->status = BLOCKED;
+		list_remove(&current->run_link);
+		list_append(&current->run_link, &sleepers);
+		schedule();
+	}
+	interrupts_restore(istate);
+}
+
+/* Called from IRQ 0 with interrupts off: wake every sleeper that is due */
+void thread_timer_tick(void)
+{
+	unsigned long long now = read_tsc();
+	link_t *link = sleepers.next;
+	
+	while(link != &sleepers) {
+		real_thread_t *t = list_get_instance(link, real_thread_t, run_link);
+		link = link->next;
+		if(t->wake_at <= now) {
+			thread_wake(t);
+		}
+	}
+}
+
+void thread_set_name(thread_t t, const char *name)
+{
+	int i;
+	
+	for(i = 0; i < THREAD_NAME_LEN - 1 && name[i]; i++) {
+		t->name[i] = name[i];
+	}
+	t->name[i] = '\0';
+}
+
+/* Copy the accounting of up to max threads; returns how many were copied */
+int thread_snapshot(thread_info_t *info, int max)
+{
+	link_t *link;
+	int n = 0;
+	long istate = interrupts_disable();
+	
+	for(link = all_threads.next; link != &all_threads && n < max; link = link->next, n++) {
+		real_thread_t *t = list_get_instance(link, real_thread_t, global_link);
+		info[n].id = t->id;
+		info[n].status = t->status;
+		memcpy(info[n].name, t->name, THREAD_NAME_LEN);
+		info[n].runtime = t->runtime;
+		info[n].waittime = t->waittime;
+		info[n].switches = t->switches;
+		if(t == current) {
+			/* Include the slice in progress */
+			info[n].runtime += read_tsc() - t->stamp;
+		}
+	}
+	interrupts_restore(istate);
+	return n;
+}
+
+unsigned long thread_cycles_per_usec(void)
+{
+	return cycles_per_usec;
+}
+
+void thread_trace_start(void)
+{
+	long istate = interrupts_disable();
+	trace_head = 0;
+	trace_enabled = 1;
+	interrupts_restore(istate);
+}
+
+void thread_trace_stop(void)
+{
+	trace_enabled = 0;
+}
+
+/* Copies the name of thread id into buf, which holds THREAD_NAME_LEN */
+static const char *thread_name(unsigned long id, char *buf)
+{
+	link_t *link;
+	const char *name = "exited";
+	int i;
+	long istate = interrupts_disable();
+	
+	for(link = all_threads.next; link != &all_threads; link = link->next) {
+		real_thread_t *t = list_get_instance(link, real_thread_t, global_link);
+		if(t->id == id) {
+			name = t->name[0] ? t->name : "?";
+			break;
+		}
+	}
+	for(i = 0; i < THREAD_NAME_LEN - 1 && name[i]; i++) {
+		buf[i] = name[i];
+	}
+	buf[i] = '\0';
+	interrupts_restore(istate);
+	return buf;
+}
+
+/* Print the trace ring as Chrome trace JSON: one complete slice per run of
+ * a thread on the CPU, and an instant event for each wakeup. The ring is
+ * copied with interrupts off and printed with them back on, since polled
+ * serial output of a full ring takes seconds. */
+void thread_trace_dump(void)
+{
+	unsigned long first, last, n, i;
+	unsigned long long base;
+	int comma = 0;
+	char name[THREAD_NAME_LEN];
+	trace_event_t *events = malloc(TRACE_SIZE * sizeof(trace_event_t));
+	long istate;
+	
+	if(events == NULL) {
+		return;
+	}
+	istate = interrupts_disable();
+	trace_enabled = 0;
+	first = trace_head > TRACE_SIZE ? trace_head - TRACE_SIZE : 0;
+	for(n = 0; first + n < trace_head; n++) {
+		events[n] = trace_ring[(first + n) % TRACE_SIZE];
+	}
+	interrupts_restore(istate);
+	
+	last = n;
+	base = last > 0 ? events[0].tsc : 0;
+	dprintf("{\"traceEvents\":[\r\n");
+	for(i = 0; i < last; i++) {
+		trace_event_t *e = &events[i];
+		unsigned long ts = (unsigned long)((e->tsc - base) / cycles_per_usec);
+		
+		if(e->type == TRACE_WAKE) {
+			dprintf("%s{\"name\":\"wake %u\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":%u,\"ts\":%u}\r\n",
+				comma ? "," : "", e->to, e->from, ts);
+			comma = 1;
+		} else {
+			/* The slice of e->to lasts until the next switch */
+			unsigned long j, dur = 0;
+			for(j = i + 1; j < last; j++) {
+				trace_event_t *next = &events[j];
+				if(next->type == TRACE_SWITCH) {
+					dur = (unsigned long)((next->tsc - e->tsc) / cycles_per_usec);
+					break;
+				}
+			}
+			if(j == last) {
+				continue;
+			}
+			dprintf("%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%u,\"dur\":%u}\r\n",
+				comma ? "," : "", thread_name(e->to, name), e->to, ts, dur);
+			comma = 1;
+		}
+	}
+	dprintf("]}\r\n");
+	free(events);
+}
+
 static void *do_idle(void *a)
 {
 	while(1) {
@@ -208,8 +612,9 @@ static void *do_reaper(void *a)
 			thread = list_get_instance(zombie_list.next, real_thread_t, run_link);
 			list_remove(&thread->run_link);
 			list_remove(&thread->global_link);
-			free(thread->stack);
-			free(thread);
+			assert(thread->stack[0] == STACK_CANARY);
+			stack_free(thread->stack, thread->stack_size);
+			tcb_free(thread);
 		}
 		/* Now sleep */
 		current->status = BLOCKED;
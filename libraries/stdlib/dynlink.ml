@@ -24,6 +24,7 @@ external ndl_globals_inited: unit -> int = "caml_natdynlink_globals_inited"
 
 (** snowflake version: filename file-contents => soname, [symbol, value; ..] *)
 external ndl_load_elf: string -> string -> string * (string * string) list = "caml_elfopen"
+external ndl_load_elf_mapped: string -> Vfs.bigarray -> string * (string * string) list = "caml_elfopen_ba"
 
 external ndl_register_frametable: string -> unit = "caml_natdynlink_register_frametable"
 external ndl_register_global: string -> unit = "caml_natdynlink_register_global"
@@ -68,15 +69,9 @@ let dyn_magic_number = "Caml2007D001"
 let read_file filename priv =
 	Printf.eprintf "read_file for %s\n" filename;
 	(* modified for snowflake... should be interesting... *)
-	let ic = open_in_bin filename in
-	let buffer = Buffer.create (1024 * 1042) in
-	begin try
-		while true do
-			Buffer.add_char buffer (input_char ic);
-		done;
-	with End_of_file -> () end;
+	let image = Vfs.map filename in
 	Printf.eprintf "Read in plugin...\n";
-	let soname, symbols = ndl_load_elf filename (Buffer.contents buffer) in
+	let soname, symbols = ndl_load_elf_mapped filename image in
 
 	Printf.eprintf "Loaded ELF object...\n";
 	
@@ -211,9 +211,12 @@ type out_channel = Vfs.io_channel
 
 external magic : 'a -> 'b = "%identity"
 
-let stdin  = { inode = Vfs.null_inode }
-let stdout = { inode = Vfs.null_inode }
-let stderr = { inode = Vfs.null_inode }
+let channel inode =
+	{ inode = inode; buffer = ""; buffer_base = 0; buffer_len = 0; position = 0 }
+
+let stdin  = channel Vfs.null_inode
+let stdout = channel Vfs.null_inode
+let stderr = channel Vfs.null_inode
 
 (* General output functions *)
 
@@ -300,7 +303,7 @@ let open_in_gen mode perm name =
 		raise Not_found
 	else begin
 		inode.open_in ();
-		{ inode }
+		channel inode
 	end
 
 let open_in name =
@@ -309,14 +312,68 @@ let open_in name =
 let open_in_bin name =
   open_in_gen [Open_rdonly; Open_binary] 0 name
 
+(* Input is read through the channel's buffer in aligned blocks, several
+   at a time; reads at least as big as the buffer go straight through *)
+
+let channel_block = 4096
+let channel_buffer = 16 * channel_block
+
+external buffer_get : string -> int -> char = "%string_unsafe_get"
+
+let buffered ic =
+	if ic.position < ic.buffer_base then 0
+	else ic.buffer_base + ic.buffer_len - ic.position
+
+let refill ic =
+	if string_length ic.buffer = 0 then ic.buffer <- string_create channel_buffer;
+	let base = ic.position - ic.position mod channel_block in
+	ic.inode.seek_in base;
+	let rec fill n =
+		if n = channel_buffer then n
+		else begin
+			let r = ic.inode.input_bytes ic.buffer n (channel_buffer - n) in
+			if r = 0 then n else fill (n + r)
+		end in
+	ic.buffer_base <- base;
+	ic.buffer_len <- 0;
+	ic.buffer_len <- fill 0
+
+let input_byte ic =
+	if buffered ic <= 0 then refill ic;
+	if buffered ic <= 0 then raise End_of_file;
+	let c = buffer_get ic.buffer (ic.position - ic.buffer_base) in
+	ic.position <- ic.position + 1;
+	int_of_char c
+
 let input_char ic =
-	char_of_int (ic.inode.input_byte ())
+	char_of_int (input_byte ic)
+
+let unsafe_input ic s ofs len =
+	let copy () =
+		let n = min len (buffered ic) in
+		string_blit ic.buffer (ic.position - ic.buffer_base) s ofs n;
+		ic.position <- ic.position + n;
+		n in
+	if len = 0 then 0
+	else if buffered ic > 0 then copy ()
+	else if len >= channel_buffer then begin
+		ic.inode.seek_in ic.position;
+		let n = ic.inode.input_bytes s ofs len in
+		ic.position <- ic.position + n;
+		n
+	end else begin
+		refill ic;
+		if buffered ic > 0 then copy () else 0
+	end
 
-let input ic s ofs len = invalid_arg "input"
+let input ic s ofs len =
+	if ofs < 0 || len < 0 || ofs > string_length s - len
+	then invalid_arg "input"
+	else unsafe_input ic s ofs len
 
 let rec unsafe_really_input ic s ofs len =
 	if len <= 0 then () else begin
-		let r = ic.inode.input_bytes s ofs len in
+		let r = unsafe_input ic s ofs len in
 		if r = 0 then raise End_of_file
 		else unsafe_really_input ic s (ofs+r) (len-r)
 	end
@@ -330,11 +387,10 @@ let input_scan_line _ = 0
 
 let input_line _ = raise End_of_file
 
-let input_byte ic = ic.inode.input_byte ()
 let input_binary_int _ = raise End_of_file
 let input_value _ = raise End_of_file
-let seek_in ic offset = ic.inode.seek_in offset
-let pos_in ic = ic.inode.pos_in ()
+let seek_in ic offset = ic.inode.seek_in offset; ic.position <- offset
+let pos_in ic = ic.position
 let in_channel_length ic = ic.inode.length_in ()
 let close_in _ = ()
 let close_in_noerr _ = ()
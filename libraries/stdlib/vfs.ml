@@ -100,6 +100,10 @@ type abstract_inode
 
 exception Not_supported
 
+(* a Bigarray.Array1 of unsigned bytes; the standard library is built
+   before Bigarray and can't name the type *)
+type bigarray
+
 (* a filesystem will walk to an inode and return a record of function handles;
 	the filesystem can use currying to hide filesystem-specific info that it needs	
  *)
@@ -109,9 +113,14 @@ type inode = {
 	close_in : unit -> unit;
 	input_byte : unit -> int;
 	input_bytes : string -> int -> int -> int;
+	(* [input_bigarray dst ofs len] reads straight into caller memory *)
+	input_bigarray : bigarray -> int -> int -> int;
 	seek_in : int -> unit;
 	pos_in : unit -> int;
 	length_in : unit -> int;
+	(* the whole file at once, for file systems that can do better than
+	   copying it through input_bigarray *)
+	map : unit -> bigarray;
 
 	open_out : unit -> unit;
 	close_out : unit -> unit;
@@ -134,9 +143,11 @@ let null_inode = {
 	close_in = (fun _ -> raise Not_supported);
 	input_byte = (fun _ -> raise Not_supported);
 	input_bytes = (fun _ _ _ -> raise Not_supported);
+	input_bigarray = (fun _ _ _ -> raise Not_supported);
 	seek_in = (fun _ -> raise Not_supported);
 	pos_in = (fun _ -> raise Not_supported);
 	length_in = (fun _ -> raise Not_supported);
+	map = (fun _ -> raise Not_supported);
 	open_out = (fun _ -> raise Not_supported);
 	close_out = (fun _ -> raise Not_supported);
 	flush_out = (fun _ -> raise Not_supported);
@@ -153,8 +164,14 @@ type file_system = {
 	walk : string list -> inode;
 }
 
+(* Input channels keep an aligned window of the file, [buffer_len] bytes
+   from [buffer_base], so small reads don't each go to the inode *)
 type io_channel = {
 	mutable inode : inode;
+	mutable buffer : string;
+	mutable buffer_base : int;
+	mutable buffer_len : int;
+	mutable position : int;
 }
 
 (* remember, no Pervasives here... *)
@@ -273,3 +290,35 @@ let split_on_slash path =
 	if len = 0 then []
 	else if len = 1 && (unsafe_get path 0) = '/' then []
 	else split 0
+
+(* [input_bigarray ic dst ofs len] reads up to [len] bytes at the channel's
+   position into [dst] from [ofs], bypassing the channel buffer *)
+let input_bigarray ic dst ofs len =
+	ic.inode.seek_in ic.position;
+	let n = ic.inode.input_bigarray dst ofs len in
+	ic.position <- ic.position + n;
+	n
+
+external bigarray_create : int -> int -> int array -> bigarray = "caml_ba_create"
+
+(* [map name] is the whole of a file as a byte bigarray, to be treated as
+   read-only. There's no paging to fault it in lazily, so it is assembled
+   up front: by the file system if it has a way, otherwise read straight
+   into the array in as few requests as the file system will take. *)
+let map name =
+	let inode = walk (split_on_slash name) in
+	if inode.is_directory () then raise Not_found;
+	inode.open_in ();
+	try inode.map () with Not_supported ->
+		let len = inode.length_in () in
+		(* kind 3 is int8_unsigned, layout 0 is c_layout *)
+		let ba = bigarray_create 3 0 [| len |] in
+		let rec fill ofs =
+			if ofs < len then begin
+				let n = inode.input_bigarray ba ofs (len - ofs) in
+				if n = 0 then raise End_of_file;
+				fill (ofs + n)
+			end
+		in
+		fill 0;
+		ba
@@ -388,7 +388,7 @@ static void * caml_thread_start(void * arg)
   return NULL;
 }  
 
-value caml_thread_new(value clos, value name)          /* ML */
+value caml_thread_new(value clos, value name, value stack_size)          /* ML */
 {
   caml_thread_t th;
   value mu = Val_unit;
@@ -427,12 +427,71 @@ value caml_thread_new(value clos, value name)          /* ML */
     curr_thread->next->prev = th;
     curr_thread->next = th;
     /* Fork the new thread */
-    thread_create(&th->pthread, caml_thread_start, (void *) th);
-	//dprintf("ocaml thread: %d = %s\n", Int_val(Ident(th->descr)), String_val(name));
+    thread_create_sized(&th->pthread, Long_val(stack_size), caml_thread_start, (void *) th);
+    thread_set_name(th->pthread, String_val(name));
   End_roots();
   return descr;
 }
 
+/* Return (cache hits, cache misses, bytes held) for the C stack cache */
+
+value snowflake_thread_stack_stats(value unit)
+{
+	CAMLparam1(unit);
+	CAMLlocal1(result);
+	unsigned long hits, misses, cached;
+	
+	thread_stack_stats(&hits, &misses, &cached);
+	result = caml_alloc_tuple(3);
+	Store_field(result, 0, Val_long(hits));
+	Store_field(result, 1, Val_long(misses));
+	Store_field(result, 2, Val_long(cached));
+	CAMLreturn(result);
+}
+
+/* Per-thread CPU accounting: an array of
+   (id, name, runtime, waittime, switches, blocked), times in microseconds */
+
+#define Max_snapshot_threads 128
+
+value snowflake_thread_stats(value unit)
+{
+	CAMLparam1(unit);
+	CAMLlocal3(result, entry, name);
+	static thread_info_t info[Max_snapshot_threads];
+	unsigned long per_usec = thread_cycles_per_usec();
+	int i, n;
+	
+	n = thread_snapshot(info, Max_snapshot_threads);
+	result = caml_alloc_tuple(n);
+	for (i = 0; i < n; i++) {
+		name = caml_copy_string(info[i].name);
+		entry = caml_alloc_tuple(6);
+		Store_field(entry, 0, Val_long(info[i].id));
+		Store_field(entry, 1, name);
+		Store_field(entry, 2, caml_copy_int64(info[i].runtime / per_usec));
+		Store_field(entry, 3, caml_copy_int64(info[i].waittime / per_usec));
+		Store_field(entry, 4, Val_long(info[i].switches));
+		Store_field(entry, 5, Val_bool(info[i].status == BLOCKED));
+		Store_field(result, i, entry);
+	}
+	CAMLreturn(result);
+}
+
+value snowflake_thread_trace_start(value unit)
+{
+	thread_trace_start();
+	return Val_unit;
+}
+
+value snowflake_thread_trace_dump(value unit)
+{
+	caml_enter_blocking_section();
+	thread_trace_dump();
+	caml_leave_blocking_section();
+	return Val_unit;
+}
+
 /* Return the current thread */
 
 value caml_thread_self(value unit)         /* ML */
@@ -518,13 +577,13 @@ value caml_thread_sleep(value unit)
 
 extern unsigned long long get_ticks();
 
+/* usec is in get_ticks units, TSC cycles / 65536. The thread blocks and
+ * the timer interrupt wakes it, so the CPU can idle meanwhile. */
 value snowflake_thread_usleep(value usec)
 {
-	unsigned long long start = get_ticks();
+	unsigned long long deadline = (get_ticks() + Int_val(usec)) << 16;
 	caml_enter_blocking_section();
-	while ((get_ticks() - start) < Int_val(usec)) {
-		thread_yield();
-	}
+	thread_sleep_until(deadline);
 	caml_leave_blocking_section();
 	return Val_unit;
 }
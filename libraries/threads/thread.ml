@@ -18,7 +18,7 @@
 type t
 
 external thread_initialize : unit -> unit = "caml_thread_initialize"
-external thread_new : (unit -> unit) -> string -> t = "caml_thread_new"
+external thread_new : (unit -> unit) -> string -> int -> t = "caml_thread_new"
 external thread_uncaught_exception : exn -> unit = 
             "caml_thread_uncaught_exception"
 
@@ -31,17 +31,31 @@ external sleep : unit -> unit = "caml_thread_sleep"
 external wake : t -> unit = "caml_thread_wake"
 
 external usleep : int -> unit = "snowflake_thread_usleep"
+external stack_stats : unit -> int * int * int = "snowflake_thread_stack_stats"
+
+type stats = {
+  ident : int;
+  name : string;
+  runtime : int64;
+  waittime : int64;
+  switches : int;
+  blocked : bool;
+}
+
+external stats : unit -> stats array = "snowflake_thread_stats"
+external trace_start : unit -> unit = "snowflake_thread_trace_start"
+external trace_dump : unit -> unit = "snowflake_thread_trace_dump"
 
 (* For new, make sure the function passed to thread_new never
    raises an exception. *)
 
-let create fn arg name =
+let create ?(stack_size = 0) fn arg name =
   thread_new
     (fun () ->
       try
         fn arg; ()
       with exn ->
-             thread_uncaught_exception exn) name
+             thread_uncaught_exception exn) name stack_size
 
 (* Thread.kill is currently not implemented due to problems with
    cleanup handlers on several platforms *)
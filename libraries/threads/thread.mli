@@ -20,7 +20,7 @@ type t
 
 (** {6 Thread creation and termination} *)
 
-val create : ('a -> 'b) -> 'a -> string -> t
+val create : ?stack_size:int -> ('a -> 'b) -> 'a -> string -> t
 (** [Thread.create funct arg] creates a new thread of control,
    in which the function application [funct arg]
    is executed concurrently with the other threads of the program.
@@ -31,9 +31,39 @@ val create : ('a -> 'b) -> 'a -> string -> t
    In the latter case, the exception is printed on standard error,
    but not propagated back to the parent thread. Similarly, the
    result of the application [funct arg] is discarded and not
-   directly accessible to the parent thread. *)
+   directly accessible to the parent thread.
+   [stack_size] is the size in bytes of the C stack the thread runs on;
+   it is rounded up to a power of two, and defaults to 64 KiB. *)
 
 external usleep : int -> unit = "snowflake_thread_usleep"
+(** [usleep n] blocks the calling thread for [n] ticks of 65536 TSC
+   cycles. The timer interrupt wakes it, up to one PIT tick late. *)
+
+external stack_stats : unit -> int * int * int = "snowflake_thread_stack_stats"
+(** Return [(hits, misses, bytes)] for the thread stack cache: stacks
+   reused, stacks freshly allocated, and bytes held by idle stacks. *)
+
+(** {6 Accounting and tracing} *)
+
+type stats = {
+  ident : int;         (** scheduler id, as in the trace *)
+  name : string;
+  runtime : int64;     (** microseconds spent running *)
+  waittime : int64;    (** microseconds spent runnable but not running *)
+  switches : int;      (** times switched away from *)
+  blocked : bool;
+}
+
+external stats : unit -> stats array = "snowflake_thread_stats"
+(** Snapshot the accounting of every live thread. *)
+
+external trace_start : unit -> unit = "snowflake_thread_trace_start"
+(** Clear the scheduler trace ring and start recording switches and
+   wakeups into it. *)
+
+external trace_dump : unit -> unit = "snowflake_thread_trace_dump"
+(** Stop tracing and print the ring to the serial port as Chrome trace
+   JSON. *)
 
 external self : unit -> t = "caml_thread_self"
 (** Return the thread currently executing. *)
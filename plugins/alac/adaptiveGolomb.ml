@@ -143,7 +143,7 @@ let n_max_mean_clamp = 0xffffl
 let n_mean_clamp_val = 0xffffl
 
 (* out_num_bits is never used, max_size <= 16 *)
-let dyn_decomp params bitstream (pc : int32a) num_samples max_size =
+let dyn_decomp_ml params bitstream (pc : int32a) num_samples max_size =
 	let c = ref 0 in
 	let mb = ref params.mb0 in
 	let zmode = ref zero in
@@ -194,3 +194,12 @@ let dyn_decomp params bitstream (pc : int32a) num_samples max_size =
 			mb := zero;
 		end;
 	done
+
+(* The same in C (alac_stubs.c); it reads params.mb0/pb/kb/wb and the
+   bitstream's buffer/current/bit_index by position, so keep those field
+   orders in step. Returns nonzero if the bitstream ran out. *)
+external dyn_decomp_c : params -> BitBuffer.t -> int32a -> int -> int -> int = "alac_dyn_decomp" "noalloc"
+
+let dyn_decomp params bitstream pc num_samples max_size =
+	if dyn_decomp_c params bitstream pc num_samples max_size <> 0 then
+		raise ALAC_parameter_error
@@ -8,30 +8,56 @@ open MusicPlayer
 open BlockIO
 
 type t = {
-	mutable mdat : Mp4_alt.box;
 	mutable cookie : Decoder.specific_config;
-	mutable buffer : string;
+	mutable samples : Mp4_alt.samples;
+	mutable buffer : string; (* holds a run of consecutive samples *)
 	mutable bitbuffer : BitBuffer.t;
+	mutable run_first : int;
+	mutable run_count : int;
+	mutable next : int; (* the next sample to decode *)
+	mutable skip : int; (* PCM frames of it to drop, after a seek *)
+	mutable seek_to : float option;
 }
 
 let t = {
-	mdat = { kind = ""; offset = 0; size = 0 };
 	cookie = !Decoder.config;
+	samples = {
+		count = 0; offsets = [||]; sizes = [||];
+		run_sample = [||]; run_frame = [||]; run_delta = [||]; frames = 0 };
 	buffer = "";
 	bitbuffer = BitBuffer.create "" 0;
+	run_first = 0;
+	run_count = 0;
+	next = 0;
+	skip = 0;
+	seek_to = None;
 }
 
-let real_decode_buffer = Array1.create int8_unsigned c_layout (4096 lsl 6)
+(* samples are read from the file in runs of up to this many bytes; the
+   slack past the end keeps the bit readers' look-ahead inside the string *)
+let run_bytes = 65536
+let slack = 8
+
+(* one frame of decoded samples; sized from the cookie *)
+let real_decode_buffer = ref (Array1.create int8_unsigned c_layout 0)
+
+(* Move to [seconds] into the file; takes effect at the next decode *)
+let seek seconds =
+	t.seek_to <- Some seconds
 
 let openfile filename =
 	begin try
 		let ic = open_in_bin filename in
-		let cookie, mdat = Mp4_alt.openfile ic in
+		let cookie, _ = Mp4_alt.openfile ic in
 		seek_in ic cookie.offset;
 		let buffer = String.make cookie.size '\000' in
 		really_input ic buffer 0 cookie.size;
 		let cookie = Decoder.init (Bitstring.bitstring_of_string buffer) in
 		Decoder.print_specific_config cookie;
+		let frame_length = Int32.to_int cookie.frame_length in
+		if frame_length < 1 || frame_length > Decoder.max_frame_length
+			|| cookie.num_channels < 1 || cookie.num_channels > 8 then
+			failwith "alac: unsupported cookie";
 		(* set up global config *)
 		Decoder.config := cookie;
 		(* allocate mix buffers *)
@@ -46,33 +72,40 @@ let openfile filename =
 
 		(* set up buffers *)
 		let decode_buffer = Array1.create int8_unsigned c_layout (4096 lsl 8) in
-		Array1.fill real_decode_buffer 0;
-		let size = (Int32.to_int cookie.max_frame_bytes) + 1 in
-		t.buffer <- String.make (Int32.to_int cookie.max_frame_bytes+1) '\000';
-		t.bitbuffer <- BitBuffer.create t.buffer (Int32.to_int cookie.max_frame_bytes+1);
-		t.mdat <- mdat;
+		real_decode_buffer := Array1.create int8_unsigned c_layout
+			(frame_length * cookie.num_channels * Decoder.sample_bytes cookie.bit_depth);
+		Array1.fill !real_decode_buffer 0;
+		let samples = Mp4_alt.sample_table ic in
+		let size = max run_bytes (Array.fold_left max 0 samples.sizes) + slack in
+		t.buffer <- String.make size '\000';
+		t.bitbuffer <- BitBuffer.create t.buffer size;
 		t.cookie <- cookie;
+		t.samples <- samples;
+		t.run_first <- 0;
+		t.run_count <- 0;
+		t.next <- 0;
+		t.skip <- 0;
 		let blockio = {
 			pos = Array1.dim decode_buffer - 44; (* we're only going to write wave header *)
 			data = decode_buffer;
 		} in
 		
-		(* write WAVE header *)
+		(* write WAVE header: what decode hands on is always 16-bit, mono or stereo *)
 		let x c = Char.code c in
+		let le n v = Array.init n (fun i -> (v lsr (8 * i)) land 0xFF) in
+		let channels = min 2 cookie.num_channels in
+		let rate = Int32.to_int cookie.sample_rate in
 		Array.iteri (fun ofs byte -> decode_buffer.{blockio.pos+ofs} <- byte)
-			[|	x 'R';x 'I';x 'F';x 'F';
-				0xff;0xff;0xff;0xff;
-				x 'W';x 'A';x 'V';x 'E';
-				x 'f';x 'm';x 't';x ' ';
-				0x10; 0x00; 0x00; 0x00;
-				0x01; 0x00; 0x02; 0x00;
-				0x44; 0xAC; 0x00; 0x00;
-				0x10; 0xB1; 0x02; 0x00;
-				0x04; 0x00; 0x10; 0x00;
-				x 'd';x 'a';x 't';x 'a';
-				0xff; 0xff; 0xff; 0xff; |]; (* length, don't care *)
-
-		seek_in ic mdat.offset;
+			(Array.concat [
+				[|	x 'R';x 'I';x 'F';x 'F';
+					0xff;0xff;0xff;0xff;
+					x 'W';x 'A';x 'V';x 'E';
+					x 'f';x 'm';x 't';x ' ' |];
+				le 4 16; le 2 1; le 2 channels; le 4 rate;
+				le 4 (rate * channels * 2); le 2 (channels * 2); le 2 16;
+				[|	x 'd';x 'a';x 't';x 'a';
+					0xff; 0xff; 0xff; 0xff; |] ]); (* length, don't care *)
+
 		(* done opening *)
 		ic, blockio
 	with ex ->
@@ -80,52 +113,57 @@ let openfile filename =
 		raise ex;
 	end
 
-let decode ic blockio =
-	let size = (Int32.to_int t.cookie.max_frame_bytes) + 1 in
+(* whether sample [t.next] is in the run held in [t.buffer] *)
+let buffered () = t.next >= t.run_first && t.next < t.run_first + t.run_count
 
+let decode ic blockio =
 	let frame_length = Int32.to_int t.cookie.frame_length in
-	let chunk_size = frame_length * t.cookie.num_channels * t.cookie.bit_depth / 2 in
-
-	let length = t.mdat.offset + t.mdat.size - 8 in
+	let channels = t.cookie.num_channels in
+	let width = Decoder.sample_bytes t.cookie.bit_depth in
+	(* only the front pair of a multichannel stream is played; it follows
+	   the centre channel *)
+	let out_channels = min 2 channels in
+	let first = if channels > 2 then 1 else 0 in
+	let chunk_size = frame_length * out_channels * 2 in
+
+	begin match t.seek_to with
+	| Some seconds ->
+		let frame = int_of_float (seconds *. Int32.to_float t.cookie.sample_rate) in
+		let sample, skip = Mp4_alt.seek t.samples frame in
+		t.next <- sample;
+		t.skip <- skip;
+		t.seek_to <- None
+	| None -> ()
+	end;
 
-	let continue = ref true in
 	let offset = ref 0 in
-	let ok = ref false in
-
-	let last = ref 0 in
-
-while !continue do
-
-	(* read initial buffer *)
-	t.bitbuffer.current <- 0;
-	really_input ic t.buffer 0 (min size (in_channel_length ic - pos_in ic));
-
-	let decoded = Decoder.decode t.bitbuffer real_decode_buffer frame_length t.cookie.num_channels in
-	let ok', decoded = match decoded with `ok n -> true, n | `fail (n,ex) ->
-		Printf.eprintf "error decoding: %s\n" (Printexc.to_string ex);
-		for i = 0 to 16 do
-			Printf.eprintf " %02x" (Char.code t.buffer.[t.bitbuffer.current+i]);
-		done;
-		Printf.eprintf "\n";
-		Printf.eprintf "end position = %d\n" (pos_in ic);
-		Printf.eprintf "length = %d\n" length;
-		Printf.eprintf "previous position = %d\n" !last;
-		Printf.eprintf "current = %d\n" t.bitbuffer.current;
-		Printf.eprintf "decoded = %d\n" n;
-		Printf.eprintf "size should've decoded = %d\n" (pos_in ic - !last);
-		false, n
-	in
-	ok := ok';
-	Printf.eprintf "+";
-	(* refill *)
-	seek_in ic (pos_in ic - size + t.bitbuffer.current);
-	last := pos_in ic;
-	(* copy to blockio *)
-	Array1.blit (Array1.sub real_decode_buffer 0 decoded) (Array1.sub blockio.data !offset decoded);
-	offset := !offset + decoded;
-	
-	continue := (pos_in ic < length && ok') && ((Array1.dim blockio.data - !offset) >= chunk_size);
-done;
+
+	while t.next < t.samples.count && (Array1.dim blockio.data - !offset) >= chunk_size do
+		if not (buffered ()) then begin
+			t.run_first <- t.next;
+			t.run_count <- Mp4_alt.read_run t.samples ic t.next t.buffer (String.length t.buffer - slack)
+		end;
+		(* the sample is decoded where it lies in the run *)
+		t.bitbuffer.current <- t.samples.offsets.(t.next) - t.samples.offsets.(t.run_first);
+		t.bitbuffer.bit_index <- 0;
+
+		begin match Decoder.decode t.bitbuffer !real_decode_buffer frame_length channels with
+		| `ok n when n > t.skip ->
+			(* copy to blockio, down to 16 bits *)
+			let n = n - t.skip in
+			let bytes = n * out_channels * 2 in
+			Matrix.to_s16 (Array1.sub !real_decode_buffer (t.skip * channels * width) (n * channels * width))
+				width channels first
+				(BigarrayUtils.uint8_to_int16 (Array1.sub blockio.data !offset bytes)) out_channels n;
+			offset := !offset + bytes
+		| `ok _ -> ()
+		| `fail (_, ex) ->
+			(* drop the sample and carry on with the next *)
+			Printf.eprintf "alac: sample %d: %s\n" t.next (Printexc.to_string ex)
+		end;
+		t.skip <- 0;
+		t.next <- t.next + 1;
+	done;
 
 	(* shift decoded bytes to end of blockio buffer -- limitation with blockio *)
 	if !offset < Array1.dim blockio.data then begin
@@ -135,7 +173,8 @@ done;
 	end;
 	blockio.pos <- Array1.dim blockio.data - !offset;
 	(* and finally return *)
-	(pos_in ic < length && !ok)
+	t.next < t.samples.count
 
 let () =
-	MusicPlayer.register_decoder { openfile = openfile; decode = decode }
+	MusicPlayer.register_decoder { openfile = openfile; decode = decode };
+	Shell.add_command "alacseek" ignore ~anon:(fun s -> seek (float_of_string s)) []
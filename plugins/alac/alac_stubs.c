@@ -0,0 +1,784 @@
+
+/* alac_stubs.c
+ *
+ * The per-sample ALAC kernels: adaptive Golomb decoding, the dynamic
+ * predictor and stereo unmixing. They follow Apple's reference decoder
+ * (ag_dec.c, dp_dec.c, matrix_dec.c) and work on the ArrayTypes bigarrays
+ * in place, so none of them allocates; the OCaml versions in
+ * AdaptiveGolomb, DynamicPredictor and Matrix are kept as *_ml. */
+
+#include <caml/mlvalues.h>
+#include <caml/bigarray.h>
+
+typedef int s32;
+typedef unsigned int u32;
+typedef short s16;
+typedef unsigned short u16;
+typedef unsigned char u8;
+
+/* Adaptive Golomb */
+
+#define QBSHIFT                 9
+#define QB                      (1 << QBSHIFT)
+#define MMULSHIFT               2
+#define MDENSHIFT               (QBSHIFT - MMULSHIFT - 1)
+#define MOFF                    (1 << (MDENSHIFT - 2))
+#define BITOFF                  24
+#define MAX_PREFIX_16           9
+#define MAX_PREFIX_32           9
+#define MAX_DATATYPE_BITS_16    16
+#define N_MAX_MEAN_CLAMP        0xffff
+#define N_MEAN_CLAMP_VAL        0xffff
+
+/* Fields of AdaptiveGolomb.params and BitBuffer.t, in order */
+#define P_MB0       1
+#define P_PB        2
+#define P_KB        3
+#define P_WB        4
+
+#define B_BUFFER    0
+#define B_CURRENT   1
+#define B_BIT_INDEX 2
+
+static inline u32 lead(u32 m)
+{
+	return m ? __builtin_clz(m) : 32;
+}
+
+static inline u32 lg3a(u32 x)
+{
+	return 31 - lead(x + 3);
+}
+
+static inline u32 bswap(u32 x)
+{
+	asm("bswap %0" : "+r"(x));
+	return x;
+}
+
+/* Big-endian; bytes past the end of the buffer read as zero. Away from
+   the end this is one unaligned load, which gcc won't make of the four
+   byte loads on its own. */
+static inline u32 read32(const u8 *in, u32 pos, u32 len)
+{
+	u32 r = 0;
+	int i;
+
+	if (pos + 4 <= len) {
+		__builtin_memcpy(&r, in + pos, 4);
+		return bswap(r);
+	}
+	for (i = 0; i < 4; ++i) {
+		r = (r << 8) | (pos + i < len ? in[pos + i] : 0);
+	}
+	return r;
+}
+
+static u32 getstreambits(const u8 *in, u32 len, u32 bitpos, int numbits)
+{
+	u32 load1 = read32(in, bitpos >> 3, len);
+	u32 shift = bitpos & 7;
+	u32 result;
+
+	if (numbits + shift > 32) {
+		u32 load2 = (bitpos >> 3) + 4 < len ? in[(bitpos >> 3) + 4] : 0;
+		result = (load1 << shift) >> (32 - numbits);
+		result |= load2 >> (8 - (numbits + shift - 32));
+	} else {
+		result = load1 >> (32 - numbits - shift);
+	}
+	if (numbits != 32) {
+		result &= ~(0xffffffffu << numbits);
+	}
+	return result;
+}
+
+static inline u32 dyn_get(const u8 *in, u32 len, u32 *bitpos, u32 m, u32 k)
+{
+	u32 pos = *bitpos;
+	u32 stream = read32(in, pos >> 3, len) << (pos & 7);
+	u32 pre = lead(~stream);
+	u32 result, v;
+
+	if (pre >= MAX_PREFIX_16) {
+		stream <<= MAX_PREFIX_16;
+		result = stream >> (32 - MAX_DATATYPE_BITS_16);
+		pos += MAX_PREFIX_16 + MAX_DATATYPE_BITS_16;
+	} else {
+		stream <<= pre + 1;
+		v = stream >> (32 - k);
+		pos += pre + 1 + k;
+		result = pre * m + v - 1;
+		if (v < 2) {
+			result -= v - 1;
+			pos -= 1;
+		}
+	}
+	*bitpos = pos;
+	return result;
+}
+
+static inline u32 dyn_get_32bit(const u8 *in, u32 len, u32 *bitpos, u32 m, u32 k, int maxbits)
+{
+	u32 pos = *bitpos;
+	u32 stream = read32(in, pos >> 3, len) << (pos & 7);
+	u32 result = lead(~stream);
+	u32 v;
+
+	if (result >= MAX_PREFIX_32) {
+		result = getstreambits(in, len, pos + MAX_PREFIX_32, maxbits);
+		pos += MAX_PREFIX_32 + maxbits;
+	} else {
+		pos += result + 1;
+		if (k != 1) {
+			stream <<= result + 1;
+			v = stream >> (32 - k);
+			pos += k - 1;
+			result *= m;
+			if (v >= 2) {
+				result += v - 1;
+				pos += 1;
+			}
+		}
+	}
+	*bitpos = pos;
+	return result;
+}
+
+/* Returns 0, or -1 if the bitstream ran out first */
+static int dyn_decomp(value params, value bits, s32 *pc, u32 limit, u32 num_samples, int max_size)
+{
+	const u8 *in = (const u8 *)String_val(Field(bits, B_BUFFER));
+	u32 len = caml_string_length(Field(bits, B_BUFFER));
+	u32 current = Long_val(Field(bits, B_CURRENT));
+	u32 bitpos = current * 8 + Long_val(Field(bits, B_BIT_INDEX));
+	u32 maxpos = len * 8;
+	u32 mb = Int32_val(Field(params, P_MB0));
+	u32 pb = Int32_val(Field(params, P_PB));
+	u32 kb = Int32_val(Field(params, P_KB));
+	u32 wb = Int32_val(Field(params, P_WB));
+	u32 c = 0, zmode = 0;
+	u32 m, k, n, j, ndecode;
+	int status = 0;
+
+	while (c < num_samples) {
+		if (bitpos >= maxpos) {
+			status = -1;
+			break;
+		}
+		k = lg3a(mb >> QBSHIFT);
+		if (k > kb) {
+			k = kb;
+		}
+		m = (1 << k) - 1;
+
+		n = dyn_get_32bit(in, len, &bitpos, m, k, max_size);
+
+		/* least significant bit is the sign */
+		ndecode = n + zmode;
+		if (c < limit) {
+			pc[c] = ((ndecode + 1) >> 1) * ((-(s32)(ndecode & 1)) | 1);
+		}
+		c++;
+
+		mb = pb * (n + zmode) + mb - ((pb * mb) >> QBSHIFT);
+		if (n > N_MAX_MEAN_CLAMP) {
+			mb = N_MEAN_CLAMP_VAL;
+		}
+		zmode = 0;
+
+		if ((mb << MMULSHIFT) < QB && c < num_samples) {
+			zmode = 1;
+			k = lead(mb) - BITOFF + ((mb + MOFF) >> MDENSHIFT);
+			m = ((1 << k) - 1) & wb;
+
+			n = dyn_get(in, len, &bitpos, m, k);
+			for (j = 0; j < n; j++, c++) {
+				if (c < limit) {
+					pc[c] = 0;
+				}
+			}
+			if (n >= 65535) {
+				zmode = 0;
+			}
+			mb = 0;
+		}
+	}
+
+	Field(bits, B_CURRENT) = Val_long(bitpos >> 3);
+	Field(bits, B_BIT_INDEX) = Val_long(bitpos & 7);
+	return status;
+}
+
+/* Fixed-width runs, checked against the end of the string once at the
+   end rather than per value. Both return 0, or -1 if they ran past it. */
+
+static inline u32 bits_pos(value bits)
+{
+	return Long_val(Field(bits, B_CURRENT)) * 8 + Long_val(Field(bits, B_BIT_INDEX));
+}
+
+static inline int bits_done(value bits, u32 bitpos)
+{
+	Field(bits, B_CURRENT) = Val_long(bitpos >> 3);
+	Field(bits, B_BIT_INDEX) = Val_long(bitpos & 7);
+	return bitpos > caml_string_length(Field(bits, B_BUFFER)) * 8 ? -1 : 0;
+}
+
+/* The shift-off bytes: [count] values of [shift] bits */
+static int read_shifted(value bits, u16 *out, int count, int shift)
+{
+	const u8 *in = (const u8 *)String_val(Field(bits, B_BUFFER));
+	u32 len = caml_string_length(Field(bits, B_BUFFER));
+	u32 bitpos = bits_pos(bits);
+	int i;
+
+	for (i = 0; i < count; ++i, bitpos += shift) {
+		out[i] = getstreambits(in, len, bitpos, shift);
+	}
+	return bits_done(bits, bitpos);
+}
+
+/* Samples stored verbatim in an escaped element, sign extended from
+   [chan_bits]; with two channels they alternate U, V */
+static int read_verbatim(value bits, s32 *u, s32 *v, int count, int chan_bits, int channels)
+{
+	const u8 *in = (const u8 *)String_val(Field(bits, B_BUFFER));
+	u32 len = caml_string_length(Field(bits, B_BUFFER));
+	u32 bitpos = bits_pos(bits);
+	u32 shift = 32 - chan_bits;
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		u[i] = (s32)(getstreambits(in, len, bitpos, chan_bits) << shift) >> shift;
+		bitpos += chan_bits;
+		if (channels == 2) {
+			v[i] = (s32)(getstreambits(in, len, bitpos, chan_bits) << shift) >> shift;
+			bitpos += chan_bits;
+		}
+	}
+	return bits_done(bits, bitpos);
+}
+
+/* Dynamic predictor */
+
+static inline s32 sign_of_int(s32 i)
+{
+	return (s32)((0u - (u32)i) >> 31) | (i >> 31);
+}
+
+static inline s32 sign_extend(s32 x, u32 shift)
+{
+	return (s32)((u32)x << shift) >> shift;
+}
+
+/* One step of the coefficient update for tap [k] of [n], moving it
+   against the sign of the residual; moves on to the next sample once
+   the residual has been used up */
+#define ADAPT(a, b, k, n)                                      \
+	if (sg > 0) {                                          \
+		sgn = sign_of_int(b);                          \
+		a -= sgn;                                      \
+		del0 -= ((n) - (k)) * ((sgn * (b)) >> denshift); \
+		if (del0 <= 0) continue;                       \
+	} else {                                               \
+		sgn = -sign_of_int(b);                         \
+		a -= sgn;                                      \
+		del0 -= ((n) - (k)) * ((sgn * (b)) >> denshift); \
+		if (del0 >= 0) continue;                       \
+	}
+
+static void unpc_block(const s32 *pc1, s32 *out, int num, s16 *coefs, int numactive, u32 chanbits, u32 denshift)
+{
+	u32 chanshift = 32 - chanbits;
+	s32 denhalf = denshift ? 1 << (denshift - 1) : 0;
+	s32 del, del0, sg, sgn, top, sum1, dd, prev;
+	const s32 *pout;
+	int j, k, lim;
+
+	out[0] = pc1[0];
+	if (numactive == 0) {
+		if (pc1 != out) {
+			for (j = 1; j < num; j++) {
+				out[j] = pc1[j];
+			}
+		}
+		return;
+	}
+	if (numactive == 31) {
+		/* in and out may be the same buffer */
+		prev = out[0];
+		for (j = 1; j < num; j++) {
+			prev = sign_extend(pc1[j] + prev, chanshift);
+			out[j] = prev;
+		}
+		return;
+	}
+
+	for (j = 1; j <= numactive && j < num; j++) {
+		out[j] = sign_extend(pc1[j] + out[j - 1], chanshift);
+	}
+	lim = numactive + 1;
+
+	if (numactive == 4) {
+		s16 a0 = coefs[0], a1 = coefs[1], a2 = coefs[2], a3 = coefs[3];
+		s32 b0, b1, b2, b3;
+
+		for (j = lim; j < num; j++) {
+			top = out[j - lim];
+			pout = out + j - 1;
+
+			b0 = top - pout[0];
+			b1 = top - pout[-1];
+			b2 = top - pout[-2];
+			b3 = top - pout[-3];
+
+			sum1 = (denhalf - a0 * b0 - a1 * b1 - a2 * b2 - a3 * b3) >> denshift;
+
+			del = del0 = pc1[j];
+			sg = sign_of_int(del);
+			out[j] = sign_extend(del + top + sum1, chanshift);
+
+			if (sg == 0) {
+				continue;
+			}
+			ADAPT(a3, b3, 3, 4)
+			ADAPT(a2, b2, 2, 4)
+			ADAPT(a1, b1, 1, 4)
+			a0 -= sg > 0 ? sign_of_int(b0) : -sign_of_int(b0);
+		}
+		coefs[0] = a0;
+		coefs[1] = a1;
+		coefs[2] = a2;
+		coefs[3] = a3;
+	} else if (numactive == 8) {
+		s16 a0 = coefs[0], a1 = coefs[1], a2 = coefs[2], a3 = coefs[3];
+		s16 a4 = coefs[4], a5 = coefs[5], a6 = coefs[6], a7 = coefs[7];
+		s32 b0, b1, b2, b3, b4, b5, b6, b7;
+
+		for (j = lim; j < num; j++) {
+			top = out[j - lim];
+			pout = out + j - 1;
+
+			b0 = top - pout[0];
+			b1 = top - pout[-1];
+			b2 = top - pout[-2];
+			b3 = top - pout[-3];
+			b4 = top - pout[-4];
+			b5 = top - pout[-5];
+			b6 = top - pout[-6];
+			b7 = top - pout[-7];
+
+			sum1 = (denhalf - a0 * b0 - a1 * b1 - a2 * b2 - a3 * b3
+				- a4 * b4 - a5 * b5 - a6 * b6 - a7 * b7) >> denshift;
+
+			del = del0 = pc1[j];
+			sg = sign_of_int(del);
+			out[j] = sign_extend(del + top + sum1, chanshift);
+
+			if (sg == 0) {
+				continue;
+			}
+			ADAPT(a7, b7, 7, 8)
+			ADAPT(a6, b6, 6, 8)
+			ADAPT(a5, b5, 5, 8)
+			ADAPT(a4, b4, 4, 8)
+			ADAPT(a3, b3, 3, 8)
+			ADAPT(a2, b2, 2, 8)
+			ADAPT(a1, b1, 1, 8)
+			a0 -= sg > 0 ? sign_of_int(b0) : -sign_of_int(b0);
+		}
+		coefs[0] = a0;
+		coefs[1] = a1;
+		coefs[2] = a2;
+		coefs[3] = a3;
+		coefs[4] = a4;
+		coefs[5] = a5;
+		coefs[6] = a6;
+		coefs[7] = a7;
+	} else {
+		for (j = lim; j < num; j++) {
+			sum1 = 0;
+			pout = out + j - 1;
+			top = out[j - lim];
+
+			for (k = 0; k < numactive; k++) {
+				sum1 += coefs[k] * (pout[-k] - top);
+			}
+
+			del = del0 = pc1[j];
+			sg = sign_of_int(del);
+			out[j] = sign_extend(del + top + ((sum1 + denhalf) >> denshift), chanshift);
+
+			if (sg > 0) {
+				for (k = numactive - 1; k >= 0; k--) {
+					dd = top - pout[-k];
+					sgn = sign_of_int(dd);
+					coefs[k] -= sgn;
+					del0 -= (numactive - k) * ((sgn * dd) >> denshift);
+					if (del0 <= 0) {
+						break;
+					}
+				}
+			} else if (sg < 0) {
+				for (k = numactive - 1; k >= 0; k--) {
+					dd = top - pout[-k];
+					sgn = sign_of_int(dd);
+					coefs[k] += sgn;
+					del0 -= (numactive - k) * ((-sgn * dd) >> denshift);
+					if (del0 >= 0) {
+						break;
+					}
+				}
+			}
+		}
+	}
+}
+
+/* Unmixing: mixres = 0 is plain interleaving */
+
+static inline s32 unmix_left(s32 u, s32 v, int mixbits, int mixres)
+{
+	return u + v - ((mixres * v) >> mixbits);
+}
+
+static void unmix16(const s32 *u, const s32 *v, s16 *out, int stride, int num, int mixbits, int mixres)
+{
+	int j;
+
+	if (mixres != 0) {
+		for (j = 0; j < num; j++, out += stride) {
+			s32 l = unmix_left(u[j], v[j], mixbits, mixres);
+			out[0] = (s16)l;
+			out[1] = (s16)(l - v[j]);
+		}
+	} else {
+		for (j = 0; j < num; j++, out += stride) {
+			out[0] = (s16)u[j];
+			out[1] = (s16)v[j];
+		}
+	}
+}
+
+/* 24-bit little-endian samples */
+static inline void put24(u8 *op, s32 x)
+{
+	op[0] = x & 0xff;
+	op[1] = (x >> 8) & 0xff;
+	op[2] = (x >> 16) & 0xff;
+}
+
+static void unmix20(const s32 *u, const s32 *v, u8 *out, int stride, int num, int mixbits, int mixres)
+{
+	s32 l, r;
+	int j;
+
+	for (j = 0; j < num; j++, out += stride * 3) {
+		if (mixres != 0) {
+			l = unmix_left(u[j], v[j], mixbits, mixres);
+			r = l - v[j];
+		} else {
+			l = u[j];
+			r = v[j];
+		}
+		put24(out, (u32)l << 4);
+		put24(out + 3, (u32)r << 4);
+	}
+}
+
+/* [shift_uv] holds the low [bytes_shifted] bytes of each sample, which
+   were sent uncompressed */
+static void unmix24(const s32 *u, const s32 *v, u8 *out, int stride, int num, int mixbits, int mixres,
+	const u16 *shift_uv, int bytes_shifted)
+{
+	int shift = bytes_shifted * 8;
+	s32 l, r;
+	int j;
+
+	for (j = 0; j < num; j++, out += stride * 3) {
+		if (mixres != 0) {
+			l = unmix_left(u[j], v[j], mixbits, mixres);
+			r = l - v[j];
+		} else {
+			l = u[j];
+			r = v[j];
+		}
+		if (bytes_shifted != 0) {
+			l = ((u32)l << shift) | shift_uv[2 * j];
+			r = ((u32)r << shift) | shift_uv[2 * j + 1];
+		}
+		put24(out, l);
+		put24(out + 3, r);
+	}
+}
+
+static void unmix32(const s32 *u, const s32 *v, s32 *out, int stride, int num, int mixbits, int mixres,
+	const u16 *shift_uv, int bytes_shifted)
+{
+	int shift = bytes_shifted * 8;
+	s32 l, r;
+	int j;
+
+	for (j = 0; j < num; j++, out += stride) {
+		if (mixres != 0) {
+			l = unmix_left(u[j], v[j], mixbits, mixres);
+			r = l - v[j];
+		} else {
+			l = u[j];
+			r = v[j];
+		}
+		if (bytes_shifted != 0) {
+			l = ((u32)l << shift) | shift_uv[2 * j];
+			r = ((u32)r << shift) | shift_uv[2 * j + 1];
+		}
+		out[0] = l;
+		out[1] = r;
+	}
+}
+
+/* A single channel straight from the predictor, every [stride] samples.
+   [shift] is as for unmix24 and unmix32, one value per sample. */
+
+static void copy_to_16(const s32 *in, s16 *out, int stride, int num)
+{
+	int j;
+
+	for (j = 0; j < num; j++, out += stride) {
+		*out = (s16)in[j];
+	}
+}
+
+static void copy_to_24(const s32 *in, const u16 *shift, u8 *out, int stride, int num, int left, int bytes_shifted)
+{
+	int j;
+
+	for (j = 0; j < num; j++, out += stride * 3) {
+		put24(out, bytes_shifted ? ((u32)in[j] << (bytes_shifted * 8)) | shift[j] : (u32)in[j] << left);
+	}
+}
+
+static void copy_to_32(const s32 *in, const u16 *shift, s32 *out, int stride, int num, int bytes_shifted)
+{
+	int j;
+
+	for (j = 0; j < num; j++, out += stride) {
+		*out = bytes_shifted ? ((u32)in[j] << (bytes_shifted * 8)) | shift[j] : (u32)in[j];
+	}
+}
+
+/* Down to 16 bits for playback: the top two bytes of each [width]-byte
+   little-endian sample, [out_channels] channels from [first] on */
+static void to_s16(const u8 *in, int width, int channels, int first, s16 *out, int out_channels, int num)
+{
+	int j, c;
+
+	in += first * width + width - 2;
+	for (j = 0; j < num; j++, in += channels * width, out += out_channels) {
+		for (c = 0; c < out_channels; c++) {
+			out[c] = (s16)(in[c * width] | (in[c * width + 1] << 8));
+		}
+	}
+}
+
+/* ML interface; all "noalloc" */
+
+#define Data(v) Caml_ba_data_val(v)
+#define Dim(v) (Caml_ba_array_val(v)->dim[0])
+
+/* whether [num] writes, [step] elements apart and each [width] wide, fit
+   in [dim] elements. The stubs below check every buffer this way before
+   touching it, and return -1 rather than run off the end. */
+static inline int fits(long num, long long step, long long width, long dim)
+{
+	if (num < 0 || step < 0) {
+		return 0;
+	}
+	return num == 0 || (num - 1) * step + width <= (long long)dim;
+}
+
+/* u and v (and the shift values, two per sample, if there are any) for
+   [num] samples of a channel pair */
+static inline int pair_fits(value u, value v, value shift_uv, long num, int bytes_shifted)
+{
+	return fits(num, 1, 1, Dim(u)) && fits(num, 1, 1, Dim(v))
+		&& (bytes_shifted == 0 || fits(num, 2, 2, Dim(shift_uv)));
+}
+
+/* returns 0, or -1 if [bits] ran out */
+CAMLprim value alac_dyn_decomp(value params, value bits, value pc, value num_samples, value max_size) {
+	return Val_int(dyn_decomp(params, bits, (s32 *)Data(pc), Dim(pc), Int_val(num_samples), Int_val(max_size)));
+}
+
+CAMLprim value alac_read_shifted(value bits, value out, value count, value shift) {
+	if (Int_val(count) > Dim(out)) {
+		return Val_int(-1);
+	}
+	return Val_int(read_shifted(bits, (u16 *)Data(out), Int_val(count), Int_val(shift)));
+}
+
+CAMLprim value alac_read_verbatim(value bits, value u, value v, value count, value chan_bits, value channels) {
+	if (Int_val(count) > Dim(u) || (Int_val(channels) == 2 && Int_val(count) > Dim(v))) {
+		return Val_int(-1);
+	}
+	return Val_int(read_verbatim(bits, (s32 *)Data(u), (s32 *)Data(v), Int_val(count),
+		Int_val(chan_bits), Int_val(channels)));
+}
+
+CAMLprim value alac_read_verbatim_bytecode(value *argv, int argn) {
+	return alac_read_verbatim(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+CAMLprim value alac_unpc_block(value pc1, value out, value num, value coefs,
+	value numactive, value chanbits, value denshift) {
+	long num_ = Int_val(num);
+	/* out[0] is always written */
+	if (!fits(num_ ? num_ : 1, 1, 1, Dim(pc1)) || !fits(num_ ? num_ : 1, 1, 1, Dim(out))
+		|| Int_val(numactive) < 0 || Int_val(numactive) > Dim(coefs)) {
+		return Val_int(-1);
+	}
+	unpc_block((const s32 *)Data(pc1), (s32 *)Data(out), Int_val(num), (s16 *)Data(coefs),
+		Int_val(numactive), Int_val(chanbits), Int_val(denshift));
+	return Val_int(0);
+}
+
+CAMLprim value alac_unpc_block_bytecode(value *argv, int argn) {
+	return alac_unpc_block(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6]);
+}
+
+CAMLprim value alac_unmix16(value u, value v, value out, value stride, value num, value mixbits, value mixres) {
+	if (!pair_fits(u, v, Val_unit, Int_val(num), 0) || !fits(Int_val(num), Int_val(stride), 2, Dim(out))) {
+		return Val_int(-1);
+	}
+	unmix16((const s32 *)Data(u), (const s32 *)Data(v), (s16 *)Data(out),
+		Int_val(stride), Int_val(num), Int_val(mixbits), Int_val(mixres));
+	return Val_int(0);
+}
+
+CAMLprim value alac_unmix16_bytecode(value *argv, int argn) {
+	return alac_unmix16(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6]);
+}
+
+CAMLprim value alac_unmix20(value u, value v, value out, value stride, value num, value mixbits, value mixres) {
+	if (!pair_fits(u, v, Val_unit, Int_val(num), 0) || !fits(Int_val(num), (long long)Int_val(stride) * 3, 6, Dim(out))) {
+		return Val_int(-1);
+	}
+	unmix20((const s32 *)Data(u), (const s32 *)Data(v), (u8 *)Data(out),
+		Int_val(stride), Int_val(num), Int_val(mixbits), Int_val(mixres));
+	return Val_int(0);
+}
+
+CAMLprim value alac_unmix20_bytecode(value *argv, int argn) {
+	return alac_unmix20(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6]);
+}
+
+CAMLprim value alac_unmix24(value u, value v, value out, value stride, value num, value mixbits, value mixres,
+	value shift_uv, value bytes_shifted) {
+	if (!pair_fits(u, v, shift_uv, Int_val(num), Int_val(bytes_shifted))
+		|| !fits(Int_val(num), (long long)Int_val(stride) * 3, 6, Dim(out))) {
+		return Val_int(-1);
+	}
+	unmix24((const s32 *)Data(u), (const s32 *)Data(v), (u8 *)Data(out),
+		Int_val(stride), Int_val(num), Int_val(mixbits), Int_val(mixres),
+		(const u16 *)Data(shift_uv), Int_val(bytes_shifted));
+	return Val_int(0);
+}
+
+CAMLprim value alac_unmix24_bytecode(value *argv, int argn) {
+	return alac_unmix24(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6], argv[7], argv[8]);
+}
+
+CAMLprim value alac_unmix32(value u, value v, value out, value stride, value num, value mixbits, value mixres,
+	value shift_uv, value bytes_shifted) {
+	if (!pair_fits(u, v, shift_uv, Int_val(num), Int_val(bytes_shifted))
+		|| !fits(Int_val(num), Int_val(stride), 2, Dim(out))) {
+		return Val_int(-1);
+	}
+	unmix32((const s32 *)Data(u), (const s32 *)Data(v), (s32 *)Data(out),
+		Int_val(stride), Int_val(num), Int_val(mixbits), Int_val(mixres),
+		(const u16 *)Data(shift_uv), Int_val(bytes_shifted));
+	return Val_int(0);
+}
+
+CAMLprim value alac_unmix32_bytecode(value *argv, int argn) {
+	return alac_unmix32(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6], argv[7], argv[8]);
+}
+
+CAMLprim value alac_copy_predictor_to_16(value in, value out, value stride, value num) {
+	if (!fits(Int_val(num), 1, 1, Dim(in)) || !fits(Int_val(num), Int_val(stride), 1, Dim(out))) {
+		return Val_int(-1);
+	}
+	copy_to_16((const s32 *)Data(in), (s16 *)Data(out), Int_val(stride), Int_val(num));
+	return Val_int(0);
+}
+
+CAMLprim value alac_copy_predictor_to_20(value in, value out, value stride, value num) {
+	if (!fits(Int_val(num), 1, 1, Dim(in)) || !fits(Int_val(num), (long long)Int_val(stride) * 3, 3, Dim(out))) {
+		return Val_int(-1);
+	}
+	copy_to_24((const s32 *)Data(in), NULL, (u8 *)Data(out), Int_val(stride), Int_val(num), 4, 0);
+	return Val_int(0);
+}
+
+CAMLprim value alac_copy_predictor_to_24(value in, value out, value stride, value num) {
+	if (!fits(Int_val(num), 1, 1, Dim(in)) || !fits(Int_val(num), (long long)Int_val(stride) * 3, 3, Dim(out))) {
+		return Val_int(-1);
+	}
+	copy_to_24((const s32 *)Data(in), NULL, (u8 *)Data(out), Int_val(stride), Int_val(num), 0, 0);
+	return Val_int(0);
+}
+
+CAMLprim value alac_copy_predictor_to_24_shift(value in, value shift, value out, value stride, value num,
+	value bytes_shifted) {
+	if (!fits(Int_val(num), 1, 1, Dim(in)) || !fits(Int_val(num), 1, 1, Dim(shift))
+		|| !fits(Int_val(num), (long long)Int_val(stride) * 3, 3, Dim(out))) {
+		return Val_int(-1);
+	}
+	copy_to_24((const s32 *)Data(in), (const u16 *)Data(shift), (u8 *)Data(out),
+		Int_val(stride), Int_val(num), 0, Int_val(bytes_shifted));
+	return Val_int(0);
+}
+
+CAMLprim value alac_copy_predictor_to_24_shift_bytecode(value *argv, int argn) {
+	return alac_copy_predictor_to_24_shift(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+CAMLprim value alac_copy_predictor_to_32(value in, value out, value stride, value num) {
+	if (!fits(Int_val(num), 1, 1, Dim(in)) || !fits(Int_val(num), Int_val(stride), 1, Dim(out))) {
+		return Val_int(-1);
+	}
+	copy_to_32((const s32 *)Data(in), NULL, (s32 *)Data(out), Int_val(stride), Int_val(num), 0);
+	return Val_int(0);
+}
+
+CAMLprim value alac_copy_predictor_to_32_shift(value in, value shift, value out, value stride, value num,
+	value bytes_shifted) {
+	if (!fits(Int_val(num), 1, 1, Dim(in)) || !fits(Int_val(num), 1, 1, Dim(shift))
+		|| !fits(Int_val(num), Int_val(stride), 1, Dim(out))) {
+		return Val_int(-1);
+	}
+	copy_to_32((const s32 *)Data(in), (const u16 *)Data(shift), (s32 *)Data(out),
+		Int_val(stride), Int_val(num), Int_val(bytes_shifted));
+	return Val_int(0);
+}
+
+CAMLprim value alac_copy_predictor_to_32_shift_bytecode(value *argv, int argn) {
+	return alac_copy_predictor_to_32_shift(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+CAMLprim value alac_to_s16(value in, value width, value channels, value first, value out, value out_channels,
+	value num) {
+	long w = Int_val(width), ch = Int_val(channels), first_ = Int_val(first), oc = Int_val(out_channels);
+	/* each sample read is the top two bytes of channel first + c */
+	if (w < 2 || first_ < 0 || oc < 1 || first_ + oc > ch
+		|| !fits(Int_val(num), (long long)ch * w, (long long)(first_ + oc) * w, Dim(in))
+		|| !fits(Int_val(num), oc, oc, Dim(out))) {
+		return Val_int(-1);
+	}
+	to_s16((const u8 *)Data(in), Int_val(width), Int_val(channels), Int_val(first),
+		(s16 *)Data(out), Int_val(out_channels), Int_val(num));
+	return Val_int(0);
+}
+
+CAMLprim value alac_to_s16_bytecode(value *argv, int argn) {
+	return alac_to_s16(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6]);
+}
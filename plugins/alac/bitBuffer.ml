@@ -172,3 +172,11 @@ let rewind bits = function
 let reset bits =
 	bits.current <- 0;
 	bits.bit_index <- 0
+
+(* Whole runs of fixed-width values, in C (alac_stubs.c): the shift-off
+   bytes, and the samples of an escaped element with [channels] (1 or 2)
+   interleaved. The end of the buffer is checked once per run; they
+   return nonzero if it was passed. *)
+external read_shifted : t -> ArrayTypes.uint16a -> int -> int -> int = "alac_read_shifted" "noalloc"
+external read_verbatim : t -> ArrayTypes.int32a -> ArrayTypes.int32a -> int -> int -> int -> int
+	= "alac_read_verbatim_bytecode" "alac_read_verbatim" "noalloc"
@@ -47,6 +47,15 @@ type specific_config = {
 	sample_rate : int32; (* uint32 *)
 }
 
+(* bytes per decoded sample; 20-bit samples are stored in 3 bytes *)
+let sample_bytes = function
+	| 16 -> 2
+	| 20 | 24 -> 3
+	| _ -> 4
+
+(* the largest frame_length a cookie may give; encoders use 4096 *)
+let max_frame_length = 65536
+
 let print_specific_config cfg =
 	Printf.printf (
 		"frame length:    %ld\n" ^^
@@ -116,8 +125,24 @@ let data_stream_element bits =
 	if data_byte_align_flag <> 0 then BitBuffer.byte_align bits false;
 	BitBuffer.advance bits (count * 8)
 
+(* silence for channels the frame had no element for *)
+
 let zero16 (buffer : ArrayTypes.int16a) num_items stride =
-	failwith "alac: shouldn't need; only dealing with stereo files"
+	for i = 0 to num_items - 1 do
+		buffer.{i * stride} <- 0
+	done
+
+let zero24 (buffer : ArrayTypes.uint8a) num_items stride =
+	for i = 0 to num_items - 1 do
+		buffer.{i * stride * 3} <- 0;
+		buffer.{i * stride * 3 + 1} <- 0;
+		buffer.{i * stride * 3 + 2} <- 0;
+	done
+
+let zero32 (buffer : ArrayTypes.int32a) num_items stride =
+	for i = 0 to num_items - 1 do
+		buffer.{i * stride} <- 0l
+	done
 
 (* globals *)
 
@@ -137,153 +162,227 @@ let mix_buffer_V = ref (Array1.create int32 c_layout 0)
 let predictor    = ref (Array1.create int32 c_layout 0)
 let shift_buffer = ref (Array1.create int16_unsigned c_layout 0)
 
-exception Done
-
+(* channel [ch] of the interleaved output, for each sample size *)
+let output16 (buffer : ArrayTypes.uint8a) ch =
+	let out = BigarrayUtils.uint8_to_int16 buffer in
+	Array1.sub out ch (Array1.dim out - ch)
+
+let output24 (buffer : ArrayTypes.uint8a) ch =
+	Array1.sub buffer (ch * 3) (Array1.dim buffer - ch * 3)
+
+let output32 (buffer : ArrayTypes.uint8a) ch =
+	let out = BigarrayUtils.uint8_to_int32 buffer in
+	Array1.sub out ch (Array1.dim out - ch)
+
+let read_signed8 bits =
+	let x = BitBuffer.read bits 8 in
+	if x >= 0x80 then x - 0x100 else x
+
+(* the samples of an escaped element, straight into the mix buffers *)
+let read_verbatim bits num_samples chan_bits channels =
+	if BitBuffer.read_verbatim bits !mix_buffer_U !mix_buffer_V num_samples chan_bits channels <> 0 then
+		failwith "alac: escaped element runs past the packet"
+
+(* one channel's predictor header: mode, den_shift, pb_factor and the
+   number of coefficients, which are read into [coefs] *)
+let read_predictor bits (coefs : ArrayTypes.int16a) =
+	let header_byte = BitBuffer.read bits 8 in
+	let mode = header_byte lsr 4 in
+	let den_shift = header_byte land 0xf in
+
+	let header_byte = BitBuffer.read bits 8 in
+	let pb_factor = header_byte lsr 5 in
+	let num = header_byte land 0x1f in
+
+	for i = 0 to num - 1 do
+		coefs.{i} <- BitBuffer.read bits 16;
+	done;
+	(mode, den_shift, pb_factor, num)
+
+(* decompress and run the predictor for one channel *)
+let decode_channel bits out num_samples chan_bits coefs (mode, den_shift, pb_factor, num) =
+	let ag_params = AdaptiveGolomb.make_params !config.mb ((!config.pb * pb_factor) / 4) !config.kb num_samples num_samples !config.max_run in
+	AdaptiveGolomb.dyn_decomp ag_params bits !predictor num_samples chan_bits;
+
+	if mode = 0 then begin
+		DynamicPredictor.unpc_block !predictor out num_samples coefs num chan_bits den_shift;
+	end else begin
+		(* the special "num_active = 31" mode can be done in-place *)
+		DynamicPredictor.unpc_block !predictor !predictor num_samples coefs 31 chan_bits 0;
+		DynamicPredictor.unpc_block !predictor out num_samples coefs num chan_bits den_shift;
+	end
+
+(* Decode one frame into [sample_buffer], interleaving [num_channels]
+   channels of !config.bit_depth samples: 16 and 32-bit ones native
+   endian, 20 and 24-bit ones packed in 3 little-endian bytes. A frame is
+   a run of SCE/LFE (one channel) and CPE (two) elements up to END. *)
 let decode bits (sample_buffer : ArrayTypes.uint8a) num_samples num_channels =
 	let shift_bits = ref (BitBuffer.create "" 0) in
-	let out_num_samples = ref 0 in
+	let out_num_samples = ref num_samples in
 	let coefs_U = Array1.create int16_signed c_layout 32 in
 	let coefs_V = Array1.create int16_signed c_layout 32 in
-	let mix_bits = ref 0 in
-	let mix_res = ref 0 in
-	try (*while true do*)
-		let pb = !config.pb in
-		begin match to_element (BitBuffer.read_small bits 3) with
-		| CPE ->
-			(* stereo channel pair *)
-			let _ (* element_instance_tag *) = BitBuffer.read_small bits 4 in
-			(* don't care about active elements *)
-
-			(* read the 12 unused header bits *)
-			let unused_header = BitBuffer.read bits 12 in
-			(* assert = 0 *)
-			assert (unused_header = 0);
-
-			(* read the 1-bit "partial frame" flag, 2-bit "shift-off" flag & 1-bit "escape" flag *)
-			let header_byte = BitBuffer.read bits 4 in
-
-			let partial_frame = header_byte lsr 3 in
-			let bytes_shifted = (header_byte lsr 1) land 0x3 in
-			(* assert != 3 *)
-			assert (bytes_shifted <> 3);
-
-			(*let shift = bytes_shifted * 8 in (* unused *)*)
-			let escape_flag = header_byte land 0x1 in
-
-			let chan_bits = 16 - (bytes_shifted * 8) + 1 in
-
-			(* check for partial frame length to override requested num_samples *)
-			let num_samples = if partial_frame <> 0 then begin
-					let override = (BitBuffer.read bits 16) lsl 16 in
-					override lor BitBuffer.read bits 16;
-				end else num_samples in
-
-			out_num_samples := num_samples;			
-
-			if escape_flag = 0 then begin
+	let bit_depth = !config.bit_depth in
+	let channel_index = ref 0 in
+
+	(* element header, up to the escape flag *)
+	let read_header () =
+		let _ (* element_instance_tag *) = BitBuffer.read_small bits 4 in
+
+		(* read the 12 unused header bits *)
+		let unused_header = BitBuffer.read bits 12 in
+		(* assert = 0 *)
+		assert (unused_header = 0);
+
+		(* read the 1-bit "partial frame" flag, 2-bit "shift-off" flag & 1-bit "escape" flag *)
+		let header_byte = BitBuffer.read bits 4 in
+
+		let partial_frame = header_byte lsr 3 in
+		let bytes_shifted = (header_byte lsr 1) land 0x3 in
+		(* assert != 3 *)
+		assert (bytes_shifted <> 3);
+
+		let escape_flag = header_byte land 0x1 in
+
+		(* check for partial frame length to override requested num_samples *)
+		let num_samples = if partial_frame <> 0 then begin
+				let override = (BitBuffer.read bits 16) lsl 16 in
+				let override = override lor BitBuffer.read bits 16 in
+				(* a partial frame is never longer than a whole one *)
+				if override < 0 || override > num_samples then
+					raise AdaptiveGolomb.ALAC_parameter_error;
+				override
+			end else num_samples in
+
+		out_num_samples := num_samples;
+		(num_samples, bytes_shifted, escape_flag <> 0)
+	in
+
+	(* if shift active, skip the interleaved shifted values, but remember where they start *)
+	let skip_shifted bytes_shifted count =
+		if bytes_shifted <> 0 then begin
+			shift_bits := BitBuffer.copy bits;
+			BitBuffer.advance bits (bytes_shifted * 8 * count);
+		end
+	in
+
+	let read_shifted bytes_shifted count =
+		let shift = bytes_shifted * 8 in
+		(* assert <= 16 *)
+		assert (shift <= 16);
+		if BitBuffer.read_shifted !shift_bits !shift_buffer count shift <> 0 then
+			failwith "alac: shifted values run past the packet"
+	in
+
+	let single () =
+		let num_samples, bytes_shifted, escape = read_header () in
+		let chan_bits = bit_depth - (bytes_shifted * 8) in
+		let bytes_shifted =
+			if not escape then begin
+				let _ (* mix_bits *) = BitBuffer.read bits 8 in
+				let _ (* mix_res *) = BitBuffer.read bits 8 in
+				let predictor_U = read_predictor bits coefs_U in
+				skip_shifted bytes_shifted num_samples;
+				decode_channel bits !mix_buffer_U num_samples chan_bits coefs_U predictor_U;
+				bytes_shifted
+			end else begin
+				(* uncompressed frame, copy data into the mix buffer to use common output code *)
+				read_verbatim bits num_samples chan_bits 1;
+				0
+			end in
+
+		(* now read the shifted values into the shift buffer *)
+		if bytes_shifted <> 0 then read_shifted bytes_shifted num_samples;
+
+		let ch = !channel_index in
+		begin match bit_depth with
+		| 16 ->
+			Matrix.copy_predictor_to_16 !mix_buffer_U (output16 sample_buffer ch) num_channels num_samples
+		| 20 ->
+			Matrix.copy_predictor_to_20 !mix_buffer_U (output24 sample_buffer ch) num_channels num_samples
+		| 24 when bytes_shifted <> 0 ->
+			Matrix.copy_predictor_to_24_shift !mix_buffer_U !shift_buffer (output24 sample_buffer ch) num_channels num_samples bytes_shifted
+		| 24 ->
+			Matrix.copy_predictor_to_24 !mix_buffer_U (output24 sample_buffer ch) num_channels num_samples
+		| 32 when bytes_shifted <> 0 ->
+			Matrix.copy_predictor_to_32_shift !mix_buffer_U !shift_buffer (output32 sample_buffer ch) num_channels num_samples bytes_shifted
+		| 32 ->
+			Matrix.copy_predictor_to_32 !mix_buffer_U (output32 sample_buffer ch) num_channels num_samples
+		| n -> failf "alac: unsupported bit depth %d" n
+		end;
+		incr channel_index
+	in
+
+	let pair () =
+		let num_samples, bytes_shifted, escape = read_header () in
+		let chan_bits = bit_depth - (bytes_shifted * 8) + 1 in
+		let mix_bits, mix_res, bytes_shifted =
+			if not escape then begin
 				(* compressed frame, read rest of parameters *)
-				mix_bits := BitBuffer.read bits 8;
-				mix_res := BitBuffer.read bits 8;
-
-				let header_byte = BitBuffer.read bits 8 in
-				let mode_U = header_byte lsr 4 in
-				let den_shift_U = header_byte land 0xf in
-
-				let header_byte = BitBuffer.read bits 8 in
-				let pb_factor_U = header_byte lsr 5 in
-				let num_U = header_byte land 0x1f in
-
-				for i = 0 to num_U - 1 do
-					coefs_U.{i} <- BitBuffer.read bits 16;
-				done;
-		
-				let header_byte = BitBuffer.read bits 8 in
-				let mode_V = header_byte lsr 4 in
-				let den_shift_V = header_byte land 0xf in
-
-				let header_byte = BitBuffer.read bits 8 in
-				let pb_factor_V = header_byte lsr 5 in
-				let num_V = header_byte land 0x1f in
-
-				for i = 0 to num_V - 1 do
-					coefs_V.{i} <- BitBuffer.read bits 16;
-				done;
-		
-				(* if shift active, skip the interleaved shifted values, but remember where they start *)
-				if bytes_shifted <> 0 then begin
-					shift_bits := BitBuffer.copy bits;
-					BitBuffer.advance bits (bytes_shifted * 8 * 2 * num_samples);
-				end;
-
-				(* decompress and run predictor for "left" channel *)
-				let ag_params = AdaptiveGolomb.make_params !config.mb ((pb * pb_factor_U) / 4) !config.kb num_samples num_samples !config.max_run in
-				AdaptiveGolomb.dyn_decomp ag_params bits !predictor num_samples chan_bits;
-
-				if mode_U = 0 then begin
-					DynamicPredictor.unpc_block !predictor !mix_buffer_U num_samples coefs_U num_U chan_bits den_shift_U;
-				end else begin
-					(* the special "num_active = 31" mode can be done in-place *)
-					DynamicPredictor.unpc_block !predictor !predictor num_samples coefs_U 31 chan_bits 0;
-					DynamicPredictor.unpc_block !predictor !mix_buffer_U num_samples coefs_U num_U chan_bits den_shift_U;
-				end;
-
-				(* decompress and run predictor for "right" channel -- U => V *)
-				let ag_params = AdaptiveGolomb.make_params !config.mb ((pb * pb_factor_V) / 4) !config.kb num_samples num_samples !config.max_run in
-				AdaptiveGolomb.dyn_decomp ag_params bits !predictor num_samples chan_bits;
-
-				if mode_V = 0 then begin
-					DynamicPredictor.unpc_block !predictor !mix_buffer_V num_samples coefs_V num_V chan_bits den_shift_V;
-				end else begin
-					DynamicPredictor.unpc_block !predictor !predictor num_samples coefs_V 31 chan_bits 0;
-					DynamicPredictor.unpc_block !predictor !mix_buffer_V num_samples coefs_V num_V chan_bits den_shift_V;
-				end;
+				let mix_bits = BitBuffer.read bits 8 in
+				let mix_res = read_signed8 bits in
+				let predictor_U = read_predictor bits coefs_U in
+				let predictor_V = read_predictor bits coefs_V in
+				skip_shifted bytes_shifted (2 * num_samples);
+				decode_channel bits !mix_buffer_U num_samples chan_bits coefs_U predictor_U;
+				decode_channel bits !mix_buffer_V num_samples chan_bits coefs_V predictor_V;
+				(mix_bits, mix_res, bytes_shifted)
 			end else begin
 				(* uncompressed frame, copy data into the mix buffers to use common output code *)
-				let chan_bits = 16 in (* !config.bit_depth *)
-				let shift = 32 - chan_bits in
-				(* if chan_bits <= 16 *)
-				for i = 0 to num_samples - 1 do
-					let value = Int32.of_int (BitBuffer.read bits chan_bits) in
-					let value = Int32.shift_right (Int32.shift_left value shift) shift in
-					!mix_buffer_U.{i} <- value;
-
-					let value = Int32.of_int (BitBuffer.read bits chan_bits) in
-					let value = Int32.shift_right (Int32.shift_left value shift) shift in
-					!mix_buffer_V.{i} <- value;
-				done;
-
-				(* bits1 & bits2 serve no useful purpose *)
-				mix_bits := 0;
-				mix_res := 0;
-				(* bytes_shifted <- 0, if escape_flag = 0 && bytes_shifted <> 0 *)
-			end;
-
-			(* now read the shifted values into the shift buffer *)
-			(* if escape_flag <> 0, then don't need to shift *)
-			if escape_flag = 0 && bytes_shifted <> 0 then begin
-				let shift = bytes_shifted * 8 in
-				(* assert <= 16 *)
-				assert (shift <= 16);
-
-				for i = 0 to num_samples - 1 do
-					!shift_buffer.{i * 2}     <- BitBuffer.read !shift_bits shift;
-					!shift_buffer.{i * 2 + 1} <- BitBuffer.read !shift_bits shift;
-				done
-			end;
-
-			(* un-mix the data and convert to output format *)
-			(* - note that mix_res = 0 means just interleave so we use that path for uncompressed frames *)
-			let out16 = BigarrayUtils.uint8_to_int16 sample_buffer in
-			Matrix.unmix16 !mix_buffer_U !mix_buffer_V out16 num_channels num_samples !mix_bits !mix_res;
-		| DSE ->
-			(* data stream element -- parse but ignore *)
-			data_stream_element bits
-		| FIL ->
-			(* fill element -- parse but ignore *)
-			fill_element bits
-		| END ->
-			BitBuffer.byte_align bits false;
-			raise Done
-		| x -> failf "unexpected frame element: %d%!" (of_element x)
+				read_verbatim bits num_samples bit_depth 2;
+				(* mix_res = 0 means just interleave *)
+				(0, 0, 0)
+			end in
+
+		if bytes_shifted <> 0 then read_shifted bytes_shifted (2 * num_samples);
+
+		(* un-mix the data and convert to output format *)
+		let ch = !channel_index in
+		begin match bit_depth with
+		| 16 ->
+			Matrix.unmix16 !mix_buffer_U !mix_buffer_V (output16 sample_buffer ch) num_channels num_samples mix_bits mix_res
+		| 20 ->
+			Matrix.unmix20 !mix_buffer_U !mix_buffer_V (output24 sample_buffer ch) num_channels num_samples mix_bits mix_res
+		| 24 ->
+			Matrix.unmix24 !mix_buffer_U !mix_buffer_V (output24 sample_buffer ch) num_channels num_samples mix_bits mix_res !shift_buffer bytes_shifted
+		| 32 ->
+			Matrix.unmix32 !mix_buffer_U !mix_buffer_V (output32 sample_buffer ch) num_channels num_samples mix_bits mix_res !shift_buffer bytes_shifted
+		| n -> failf "alac: unsupported bit depth %d" n
 		end;
-	(*done;*) `ok !out_num_samples with Done -> `ok !out_num_samples | ex -> `fail (!out_num_samples,ex)
+		channel_index := !channel_index + 2
+	in
+
+	let rec elements () =
+		if !channel_index < num_channels then begin
+			match to_element (BitBuffer.read_small bits 3) with
+			| SCE | LFE -> single (); elements ()
+			(* a pair that would take us past num_channels: stop here *)
+			| CPE when !channel_index + 2 > num_channels -> ()
+			| CPE -> pair (); elements ()
+			| DSE ->
+				(* data stream element -- parse but ignore *)
+				data_stream_element bits; elements ()
+			| FIL ->
+				(* fill element -- parse but ignore *)
+				fill_element bits; elements ()
+			| END -> BitBuffer.byte_align bits false
+			| x -> failf "unexpected frame element: %d%!" (of_element x)
+		end else begin
+			(* every channel is done; take the END that should follow, so
+			   the buffer is left at the start of the next frame *)
+			if BitBuffer.read_small bits 3 = of_element END
+			then BitBuffer.byte_align bits false
+			else BitBuffer.rewind bits 3
+		end
+	in
+
+	try
+		elements ();
+		(* fill any channels the frame left out with silence *)
+		for ch = !channel_index to num_channels - 1 do
+			match bit_depth with
+			| 16 -> zero16 (output16 sample_buffer ch) !out_num_samples num_channels
+			| 20 | 24 -> zero24 (output24 sample_buffer ch) !out_num_samples num_channels
+			| _ -> zero32 (output32 sample_buffer ch) !out_num_samples num_channels
+		done;
+		`ok !out_num_samples
+	with ex -> `fail (!out_num_samples, ex)
@@ -13,7 +13,7 @@ let rec loop_while p f = function
 	| n when n >= 0 -> if p (f n) then loop_while p f (n-1)
 	| _ -> ()
 
-let unpc_block (pc1 : int32a) (out : int32a) num (coefs : int16a) numactive chanbits denshift =
+let unpc_block_ml (pc1 : int32a) (out : int32a) num (coefs : int16a) numactive chanbits denshift =
 	let chanshift = 32 - chanbits in
 	let denhalf = 1 lsl (denshift - 1) in
 
@@ -68,3 +68,12 @@ let unpc_block (pc1 : int32a) (out : int32a) num (coefs : int16a) numactive chan
 			end;
 		done;
 	end
+
+(* The same in C (alac_stubs.c), with numactive = 4 and 8 unrolled; it
+   returns nonzero, having done nothing, if the buffers are too small *)
+external unpc_block_c : int32a -> int32a -> int -> int16a -> int -> int -> int -> int
+	= "alac_unpc_block_bytecode" "alac_unpc_block" "noalloc"
+
+let unpc_block pc1 out num coefs numactive chanbits denshift =
+	if unpc_block_c pc1 out num coefs numactive chanbits denshift <> 0 then
+		raise AdaptiveGolomb.ALAC_parameter_error
@@ -5,7 +5,7 @@
 open ArrayTypes
 
 (* u : int32, v : int32, out : int16 ... *)
-let unmix16 (u : int32a) (v : int32a) (out : int16a) stride num_samples mixbits = function (* mixres *)
+let unmix16_ml (u : int32a) (v : int32a) (out : int16a) stride num_samples mixbits = function (* mixres *)
 	| 0 -> (* the else branch *)
 		(* conventional separated stereo *)
 		for j = 0 to num_samples - 1 do
@@ -15,14 +15,14 @@ let unmix16 (u : int32a) (v : int32a) (out : int16a) stride num_samples mixbits
 	| mixres ->
 		(* matrixed stereo *)
 		for j = 0 to num_samples - 1 do
-			let l = Int32.sub (Int32.add u.{j} v.{j}) (Int32.shift_right_logical (Int32.mul (Int32.of_int mixres) v.{j}) mixbits) in
+			let l = Int32.sub (Int32.add u.{j} v.{j}) (Int32.shift_right (Int32.mul (Int32.of_int mixres) v.{j}) mixbits) in
 			let r = Int32.sub l v.{j} in
 
 			out.{j * stride} <- Int32.to_int l; (* cast from 32 to 16 bit *)
 			out.{j * stride + 1} <- Int32.to_int r; (* cast from 32 to 16 bit *)
 		done
 
-let unmix20 (u : int32a) (v : int32a) (out : uint8a) stride num_samples mixbits = function (* mixres *)
+let unmix20_ml (u : int32a) (v : int32a) (out : uint8a) stride num_samples mixbits = function (* mixres *)
 	| 0 ->
 		(* conventional separated stereo *)
 		let op = ref 0 in
@@ -43,7 +43,7 @@ let unmix20 (u : int32a) (v : int32a) (out : uint8a) stride num_samples mixbits
 		(* matrixed stereo *)
 		let op = ref 0 in
 		for j = 0 to num_samples - 1 do
-			let l = Int32.sub (Int32.add u.{j} v.{j}) (Int32.shift_right_logical (Int32.mul (Int32.of_int mixres) v.{j}) mixbits) in
+			let l = Int32.sub (Int32.add u.{j} v.{j}) (Int32.shift_right (Int32.mul (Int32.of_int mixres) v.{j}) mixbits) in
 			let r = Int32.sub l v.{j} in
 
 			let l = Int32.shift_left l 4 in
@@ -60,28 +60,97 @@ let unmix20 (u : int32a) (v : int32a) (out : uint8a) stride num_samples mixbits
 			op := !op + ((stride - 1) * 3);
 		done
 
-let unmix24 (u : int32a) (v : int32a) (out : uint8a) stride num_samples mixbits mixres (shift_uv : uint16a) bytes_shifted =
-	failwith "unmix24"
-
-let unmix32 (u : int32a) (v : int32a) (out : int32a) stride num_samples mixbits mixres (shift_uv : uint16a) bytes_shifted =
-	failwith "unmix32"
-
-let copy_predictor_to_24 (inp : int32a) (out : uint8a) stride num_samples =
-	failwith "copy_predictor_to_24"
-
-let copy_predictor_to_24_shift (inp : int32a) (shift : uint16a) (out : uint8a) stride num_samples bytes_shifted =
-	failwith "copy_predictor_to_24_shift"
-
-let copy_predictor_to_20 (inp : int32a) (out : uint8a) stride num_samples =
-	failwith "copy_predictor_to_20"
+let unmix24_ml (u : int32a) (v : int32a) (out : uint8a) stride num_samples mixbits mixres (shift_uv : uint16a) bytes_shifted =
+	let shift = bytes_shifted * 8 in
+	let put op x =
+		out.{op+2} <- (Int32.to_int (Int32.shift_right_logical x 16)) land 0xFF;
+		out.{op+1} <- (Int32.to_int (Int32.shift_right_logical x 8)) land 0xFF;
+		out.{op} <- (Int32.to_int x) land 0xFF in
+	for j = 0 to num_samples - 1 do
+		let l, r = if mixres <> 0 then begin
+				let l = Int32.sub (Int32.add u.{j} v.{j}) (Int32.shift_right (Int32.mul (Int32.of_int mixres) v.{j}) mixbits) in
+				l, Int32.sub l v.{j}
+			end else u.{j}, v.{j} in
+		let l, r = if bytes_shifted <> 0 then
+				Int32.logor (Int32.shift_left l shift) (Int32.of_int shift_uv.{j*2}),
+				Int32.logor (Int32.shift_left r shift) (Int32.of_int shift_uv.{j*2+1})
+			else l, r in
+		put (j * stride * 3) l;
+		put (j * stride * 3 + 3) r;
+	done
 
-let copy_predictor_to_32 (inp : int32a) (out : int32a) stride num_samples =
+let copy_predictor_to_32_ml (inp : int32a) (out : int32a) stride num_samples =
 	for i = 0 to num_samples - 1 do
 		out.{i*stride} <- inp.{i}
 	done
 
-let copy_predictor_to_32_shift (inp : int32a) (shift : uint16a) (out : int32a) stride num_samples bytes_shifted =
+let copy_predictor_to_32_shift_ml (inp : int32a) (shift : uint16a) (out : int32a) stride num_samples bytes_shifted =
 	let shift_val = bytes_shifted * 8 in
 	for j = 0 to num_samples - 1 do
 		out.{j*stride} <- Int32.logor (Int32.shift_left inp.{j} shift_val) (Int32.of_int shift.{j});
 	done
+
+(* The same in C (alac_stubs.c). Each checks its buffers are big enough
+   first and returns nonzero, having written nothing, if they aren't. *)
+
+let check r = if r <> 0 then raise AdaptiveGolomb.ALAC_parameter_error
+
+external unmix16_c : int32a -> int32a -> int16a -> int -> int -> int -> int -> int
+	= "alac_unmix16_bytecode" "alac_unmix16" "noalloc"
+let unmix16 u v out stride num mixbits mixres =
+	check (unmix16_c u v out stride num mixbits mixres)
+
+external unmix20_c : int32a -> int32a -> uint8a -> int -> int -> int -> int -> int
+	= "alac_unmix20_bytecode" "alac_unmix20" "noalloc"
+let unmix20 u v out stride num mixbits mixres =
+	check (unmix20_c u v out stride num mixbits mixres)
+
+external unmix24_c : int32a -> int32a -> uint8a -> int -> int -> int -> int -> uint16a -> int -> int
+	= "alac_unmix24_bytecode" "alac_unmix24" "noalloc"
+let unmix24 u v out stride num mixbits mixres shift_uv bytes_shifted =
+	check (unmix24_c u v out stride num mixbits mixres shift_uv bytes_shifted)
+
+external unmix32_c : int32a -> int32a -> int32a -> int -> int -> int -> int -> uint16a -> int -> int
+	= "alac_unmix32_bytecode" "alac_unmix32" "noalloc"
+let unmix32 u v out stride num mixbits mixres shift_uv bytes_shifted =
+	check (unmix32_c u v out stride num mixbits mixres shift_uv bytes_shifted)
+
+(* a single channel element: [copy_predictor_to_N inp out stride num_samples] *)
+
+external copy_predictor_to_16_c : int32a -> int16a -> int -> int -> int
+	= "alac_copy_predictor_to_16" "noalloc"
+let copy_predictor_to_16 inp out stride num =
+	check (copy_predictor_to_16_c inp out stride num)
+
+external copy_predictor_to_20_c : int32a -> uint8a -> int -> int -> int
+	= "alac_copy_predictor_to_20" "noalloc"
+let copy_predictor_to_20 inp out stride num =
+	check (copy_predictor_to_20_c inp out stride num)
+
+external copy_predictor_to_24_c : int32a -> uint8a -> int -> int -> int
+	= "alac_copy_predictor_to_24" "noalloc"
+let copy_predictor_to_24 inp out stride num =
+	check (copy_predictor_to_24_c inp out stride num)
+
+external copy_predictor_to_24_shift_c : int32a -> uint16a -> uint8a -> int -> int -> int -> int
+	= "alac_copy_predictor_to_24_shift_bytecode" "alac_copy_predictor_to_24_shift" "noalloc"
+let copy_predictor_to_24_shift inp shift out stride num bytes_shifted =
+	check (copy_predictor_to_24_shift_c inp shift out stride num bytes_shifted)
+
+external copy_predictor_to_32_c : int32a -> int32a -> int -> int -> int
+	= "alac_copy_predictor_to_32" "noalloc"
+let copy_predictor_to_32 inp out stride num =
+	check (copy_predictor_to_32_c inp out stride num)
+
+external copy_predictor_to_32_shift_c : int32a -> uint16a -> int32a -> int -> int -> int -> int
+	= "alac_copy_predictor_to_32_shift_bytecode" "alac_copy_predictor_to_32_shift" "noalloc"
+let copy_predictor_to_32_shift inp shift out stride num bytes_shifted =
+	check (copy_predictor_to_32_shift_c inp shift out stride num bytes_shifted)
+
+(* [to_s16 inp width channels first out out_channels num_samples] keeps the
+   top 16 bits of channels [first] to [first + out_channels - 1] of the
+   decoded [width]-byte samples, for playback *)
+external to_s16_c : uint8a -> int -> int -> int -> int16a -> int -> int -> int
+	= "alac_to_s16_bytecode" "alac_to_s16" "noalloc"
+let to_s16 inp width channels first out out_channels num =
+	check (to_s16_c inp width channels first out out_channels num)
@@ -1,33 +1,40 @@
 
+(* ALAC : MP4 demuxer *)
+
 type box = {
 	kind : string;
-	offset : int;
-	size : int;
+	offset : int; (* of the contents, past the header *)
+	size : int; (* including the header *)
 }
 
-let input_int32 ic =
-	let a = input_byte ic in
-	let b = input_byte ic in
-	let c = input_byte ic in
-	let d = input_byte ic in
-	(a lsl 24) lor (b lsl 16) lor (c lsl 8) lor d
+(* The sample table of the audio track. Each sample is one ALAC frame;
+   its file offset and size are looked up directly. Time to sample (stts)
+   is kept as runs of samples of the same length in PCM frames. *)
+type samples = {
+	count : int;
+	offsets : int array;
+	sizes : int array;
+	run_sample : int array; (* first sample of each run *)
+	run_frame : int array; (* and its first PCM frame *)
+	run_delta : int array; (* PCM frames per sample *)
+	frames : int; (* total *)
+}
 
-let input_int16 ic =
-	let a = input_byte ic in
-	let b = input_byte ic in
-	(a lsl 8) lor b
+let get32 s i =
+	(Char.code s.[i] lsl 24) lor (Char.code s.[i+1] lsl 16) lor
+	(Char.code s.[i+2] lsl 8) lor (Char.code s.[i+3])
 
-let skip ic num =
-	seek_in ic (pos_in ic + num)
+let get16 s i =
+	(Char.code s.[i] lsl 8) lor (Char.code s.[i+1])
 
 let box ic offset =
 	seek_in ic offset;
-	let size = input_int32 ic in
-	let kind = String.make 4 '\000' in
-	really_input ic kind 0 4;
+	let header = String.create 8 in
+	really_input ic header 0 8;
+	let size = get32 header 0 in
 	if size = 0 then failwith "large box"
 	else if size = 1 then failwith "rest of file box"
-	else { kind; offset = pos_in ic; size = size }
+	else { kind = String.sub header 4 4; offset = offset + 8; size = size }
 
 let rec find_box ic kind offset limit =
 	if offset >= limit then raise Not_found
@@ -40,34 +47,131 @@ let rec find_box ic kind offset limit =
 let rec get_box path ic box = match path with
 	| [] -> box
 	| k :: kinds ->
-		get_box kinds ic (find_box ic k box.offset (box.offset + box.size))
+		get_box kinds ic (find_box ic k box.offset (box.offset + box.size - 8))
+
+(* the whole contents of a box, read in one go *)
+let contents ic b =
+	let s = String.create (b.size - 8) in
+	seek_in ic b.offset;
+	really_input ic s 0 (b.size - 8);
+	s
+
+(* the whole file, as a box whose contents start at 0 *)
+let file_box ic = { kind = "    "; offset = 0; size = in_channel_length ic + 8 }
+
+let stbl_path = ["moov";"trak";"mdia";"minf";"stbl"]
 
 let openfile ic =
-	let filebox = { kind = "    "; offset = 0; size = in_channel_length ic } in
+	let filebox = file_box ic in
 	let ftyp = box ic 0 in
 	if ftyp.kind <> "ftyp" then failwith "not an mp4 container";
-	(* already here, but for sanity's sake *)
-	seek_in ic ftyp.offset;
-	really_input ic ftyp.kind 0 4;
-	if ftyp.kind <> "M4A " then failwith "not an audio file";
-	let stsd = get_box ["moov";"trak";"mdia";"minf";"stbl";"stsd"] ic filebox in
+	if String.sub (contents ic ftyp) 0 4 <> "M4A " then failwith "not an audio file";
+	let stsd = get_box (stbl_path @ ["stsd"]) ic filebox in
 	let mdat = get_box ["mdat"] ic filebox in
-	(* dump stsd data *)
-	seek_in ic (stsd.offset + 4);
-	let num_entries = input_int32 ic in
-	skip ic 4;
-	really_input ic stsd.kind 0 4;
-	skip ic 6;
-	let x = input_int16 ic in
-	skip ic 8;
-	let num_channels = input_int16 ic in
-	let bits_per_channel = input_int16 ic in
-	skip ic 4;
-	let sample_rate = input_int16 ic in
-	let cookie_offset = pos_in ic + 2 in
-	(* we only care about 16-bit stereo @ 44100Hz *)
-	assert (num_entries = 1 && stsd.kind = "alac" && x = 1 && num_channels = 2 && bits_per_channel = 16 && sample_rate = 44100);
-	Printf.printf "cookie @ %d bytes into file\n" cookie_offset;
-	Printf.printf "mdat data starts at %d bytes into file\n" mdat.offset;
+	let s = contents ic stsd in
+	(* one AudioSampleEntry, followed by the ALAC cookie *)
+	let num_entries = get32 s 4 in
+	let kind = String.sub s 12 4 in
+	let num_channels = get16 s 32 in
+	let bits_per_channel = get16 s 34 in
+	let sample_rate = get16 s 40 in
+	if num_entries <> 1 || kind <> "alac" then failwith "not an ALAC track";
+	Printf.printf "alac: %d channels, %d bits, %d Hz\n" num_channels bits_per_channel sample_rate;
 	(* return cookie 'box' & the mdat box *)
-	{ kind = "kuki"; offset = cookie_offset; size = stsd.size - cookie_offset + stsd.offset }, mdat
+	let cookie_offset = stsd.offset + 44 in
+	{ kind = "kuki"; offset = cookie_offset; size = stsd.size - 44 }, mdat
+
+(* chunk offsets, from stco or co64 *)
+let chunk_offsets ic stbl =
+	try
+		let s = contents ic (get_box ["stco"] ic stbl) in
+		Array.init (get32 s 4) (fun i -> get32 s (8 + 4 * i))
+	with Not_found ->
+		let s = contents ic (get_box ["co64"] ic stbl) in
+		Array.init (get32 s 4) (fun i ->
+			if get32 s (8 + 8 * i) <> 0 then failwith "mp4: file too large";
+			get32 s (12 + 8 * i))
+
+let sample_table ic =
+	let stbl = get_box stbl_path ic (file_box ic) in
+
+	let s = contents ic (get_box ["stsz"] ic stbl) in
+	let count = get32 s 8 in
+	let sizes = match get32 s 4 with
+		| 0 -> Array.init count (fun i -> get32 s (12 + 4 * i))
+		| size -> Array.make count size
+	in
+
+	(* stsc gives samples per chunk in runs of chunks, numbered from 1 *)
+	let chunks = chunk_offsets ic stbl in
+	let s = contents ic (get_box ["stsc"] ic stbl) in
+	let entries = get32 s 4 in
+	let first_chunk e = get32 s (8 + 12 * e) - 1 in
+	let per_chunk e = get32 s (12 + 12 * e) in
+	let offsets = Array.make count 0 in
+	let sample = ref 0 in
+	let entry = ref 0 in
+	Array.iteri (fun chunk base ->
+		while !entry + 1 < entries && first_chunk (!entry + 1) <= chunk do incr entry done;
+		let ofs = ref base in
+		for i = 1 to min (per_chunk !entry) (count - !sample) do
+			offsets.(!sample) <- !ofs;
+			ofs := !ofs + sizes.(!sample);
+			incr sample
+		done) chunks;
+	if !sample < count then failwith "mp4: short sample-to-chunk table";
+
+	let s = contents ic (get_box ["stts"] ic stbl) in
+	let runs = get32 s 4 in
+	let run_sample = Array.make runs 0 in
+	let run_frame = Array.make runs 0 in
+	let run_delta = Array.init runs (fun r -> get32 s (12 + 8 * r)) in
+	for r = 1 to runs - 1 do
+		let n = get32 s (8 + 8 * (r - 1)) in
+		run_sample.(r) <- run_sample.(r - 1) + n;
+		run_frame.(r) <- run_frame.(r - 1) + n * run_delta.(r - 1)
+	done;
+	let frames =
+		if runs = 0 then 0
+		else run_frame.(runs - 1) + get32 s (8 + 8 * (runs - 1)) * run_delta.(runs - 1) in
+	{ count; offsets; sizes; run_sample; run_frame; run_delta; frames }
+
+(* [seek t frame] is the sample holding PCM frame [frame] and how many
+   frames into it that is *)
+let seek t frame =
+	if frame <= 0 || Array.length t.run_frame = 0 then (0, 0)
+	else if frame >= t.frames then (t.count, 0)
+	else begin
+		let rec search lo hi = (* last run starting at or before frame *)
+			if lo >= hi then lo
+			else begin
+				let mid = (lo + hi + 1) / 2 in
+				if t.run_frame.(mid) <= frame then search mid hi else search lo (mid - 1)
+			end in
+		let r = search 0 (Array.length t.run_frame - 1) in
+		let into = frame - t.run_frame.(r) in
+		(t.run_sample.(r) + into / t.run_delta.(r), into mod t.run_delta.(r))
+	end
+
+(* How many samples from [first] on lie back to back in the file and
+   fit in [limit] bytes together; at least one *)
+let run t first limit =
+	let rec extend n bytes =
+		let i = first + n in
+		if i < t.count && t.offsets.(i) = t.offsets.(first) + bytes
+			&& bytes + t.sizes.(i) <= limit
+		then extend (n + 1) (bytes + t.sizes.(i))
+		else n in
+	max 1 (extend 0 0)
+
+(* [read_run t ic first buffer limit] reads the run of samples starting
+   at [first], up to [limit] bytes of it, into the start of [buffer] with
+   one read, and returns how many samples that was. Sample [i] of the run
+   starts at [t.offsets.(i) - t.offsets.(first)]. *)
+let read_run t ic first buffer limit =
+	let n = run t first limit in
+	let bytes = t.offsets.(first + n - 1) + t.sizes.(first + n - 1) - t.offsets.(first) in
+	if bytes > String.length buffer then failwith "mp4: sample larger than buffer";
+	seek_in ic t.offsets.(first);
+	really_input ic buffer 0 bytes;
+	n